@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+# 跨节点发布的延迟：在回环上起几个节点组集群，都从节点 0 发，按房间的家节点分开统计
+# 家在节点 0 的房间本地定序；家在别的节点的转过去定序，落盘以后 ack 再转回来
+# 另开一条连接在节点 1 上订阅，看消息从发出到在别的节点上收到要多久
+# 房间归哪个节点按服务器的一致性散列在这边算一遍，节点列表和服务器上的写法要一样
+#
+#   python3 bench/cluster.py ./chatserver [--nodes 3] [--base-port 8180] [--messages 2000]
+import argparse
+import bisect
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+header = struct.Struct('<IB3xQQ')
+JOIN, SEND, MESSAGE, ACK, JOINED = 1, 3, 0x81, 0x82, 0x83
+VIRTUAL_NODES = 64
+MASK = (1 << 64) - 1
+
+
+def mix(x):
+    x ^= x >> 30
+    x = (x * 0xbf58476d1ce4e5b9) & MASK
+    x ^= x >> 27
+    x = (x * 0x94d049bb133111eb) & MASK
+    x ^= x >> 31
+    return x
+
+
+def fnv(key):
+    h = 0xcbf29ce484222325
+    for c in key.encode():
+        h = ((h ^ c) * 0x100000001b3) & MASK
+    return mix(h)
+
+
+def make_ring(addresses):
+    return sorted((fnv(f'{address}#{v}'), i) for i, address in enumerate(addresses) for v in range(VIRTUAL_NODES))
+
+
+def home(ring, room):
+    i = bisect.bisect_left(ring, (mix(room), 0))
+    return ring[i % len(ring)][1]
+
+
+class connection:
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.sock.settimeout(5)
+        self.buffer = b''
+
+    def send(self, opcode, room, seq=0, payload=b''):
+        self.sock.sendall(header.pack(len(payload), opcode, room, seq) + payload)
+
+    def read(self):
+        while True:
+            if len(self.buffer) >= header.size:
+                size, opcode, room, seq = header.unpack_from(self.buffer)
+                if len(self.buffer) >= header.size + size:
+                    payload = self.buffer[header.size:header.size + size]
+                    self.buffer = self.buffer[header.size + size:]
+                    return opcode, room, seq, payload
+            data = self.sock.recv(1 << 16)
+            if not data:
+                raise EOFError
+            self.buffer += data
+
+
+def percentiles(name, latencies):
+    latencies.sort()
+    n = len(latencies)
+    p50, p90, p99 = (latencies[min(n - 1, int(n * q))] * 1e6 for q in (0.5, 0.9, 0.99))
+    print(f'{name:28} {n:>6}  p50 {p50:>7.0f} us  p90 {p90:>7.0f} us  p99 {p99:>7.0f} us')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('server', help='服务器程序')
+    parser.add_argument('--nodes', type=int, default=3)
+    parser.add_argument('--base-port', type=int, default=8180, help='节点 i 的 HTTP 端口是 base + 100 * i，二进制端口再加一')
+    parser.add_argument('--messages', type=int, default=2000, help='每种房间各发多少条')
+    parser.add_argument('--size', type=int, default=64, help='正文字节数')
+    args = parser.parse_args()
+
+    ports = [args.base_port + 100 * i for i in range(args.nodes)]
+    addresses = [f'127.0.0.1:{p + 1}' for p in ports]
+    data = tempfile.mkdtemp(prefix='cluster-bench-')
+    procs = []
+    try:
+        for i, port in enumerate(ports):
+            procs.append(subprocess.Popen([args.server, '--http-port', str(port), '--binary-port', str(port + 1),
+                                           '--data', os.path.join(data, str(i)), '--cluster', ','.join(addresses),
+                                           '--node', str(i), '--cluster-secret', 'bench', '--rate-limit', 'off'],
+                                          stdout=subprocess.DEVNULL, stderr=subprocess.STDOUT))
+        time.sleep(1)
+
+        ring = make_ring(addresses)
+        rooms = {'local': [], 'remote': []}
+        room = 1
+        while min(len(r) for r in rooms.values()) < 16:
+            rooms['local' if home(ring, room) == 0 else 'remote'].append(room)
+            room += 1
+
+        publisher = connection(ports[0] + 1)
+        subscriber = connection(ports[1 % args.nodes] + 1)
+        for kind in rooms:
+            rooms[kind] = rooms[kind][:16]
+            for r in rooms[kind]:
+                subscriber.send(JOIN, r)
+                assert subscriber.read()[0] == JOINED
+        time.sleep(0.3)
+
+        payload = b'x' * args.size
+        for kind in ('local', 'remote'):
+            acked, delivered = [], []
+            for i in range(args.messages):
+                r = rooms[kind][i % len(rooms[kind])]
+                begin = time.perf_counter()
+                publisher.send(SEND, r, 0, payload)
+                got_ack = got_message = False
+                while not (got_ack and got_message):
+                    if not got_ack:
+                        opcode = publisher.read()[0]
+                        assert opcode == ACK, opcode
+                        acked.append(time.perf_counter() - begin)
+                        got_ack = True
+                    if not got_message:
+                        opcode, room_id, _, _ = subscriber.read()
+                        if opcode == MESSAGE and room_id == r:
+                            delivered.append(time.perf_counter() - begin)
+                            got_message = True
+            percentiles(f'{kind} home, ack on node 0', acked)
+            percentiles(f'{kind} home, seen on node {1 % args.nodes}', delivered)
+    finally:
+        for p in procs:
+            p.kill()
+        shutil.rmtree(data, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# 房间定序的争用压测：很多连接同时往一个热房间发，和分散到很多冷房间对比
+# 走二进制协议，每条连接一直保持 window 条在路上；热房间另开一条连接订阅，检查收到的序号严格递增
+# 服务器要用 --rate-limit off 起，不然测的是限流
+#
+#   ./chatserver --rate-limit off &
+#   python3 bench/contention.py [--host 127.0.0.1] [--port 8081] [--processes 4] [--connections 8] [--messages 20000]
+import argparse
+import asyncio
+import multiprocessing
+import socket
+import struct
+import threading
+import time
+
+header = struct.Struct('<IB3xQQ')
+JOIN, SEND, MESSAGE, ACK, JOINED = 1, 3, 0x81, 0x82, 0x83
+
+
+def frame(opcode, room, seq=0, payload=b''):
+    return header.pack(len(payload), opcode, room, seq) + payload
+
+
+async def publisher(args, rooms, count):
+    reader, writer = await asyncio.open_connection(args.host, args.port)
+    payload = b'x' * args.size
+    sent = acked = 0
+    while acked < count:
+        while sent < count and sent - acked < args.window:
+            writer.write(frame(SEND, rooms[sent % len(rooms)], 0, payload))
+            sent += 1
+        await writer.drain()
+        size, opcode, _, _ = header.unpack(await reader.readexactly(header.size))
+        await reader.readexactly(size)
+        if opcode == ACK:
+            acked += 1
+    writer.close()
+
+
+def worker(args, mode, index, start):
+    async def run():
+        tasks = []
+        for c in range(args.connections):
+            if mode == 'hot':
+                rooms = [1]
+            else:
+                rooms = [1000 + (index * args.connections + c) * args.rooms_per_connection + r for r in range(args.rooms_per_connection)]
+            tasks.append(publisher(args, rooms, args.messages // (args.processes * args.connections)))
+        start.wait()
+        await asyncio.gather(*tasks)
+    asyncio.run(run())
+
+
+def subscribe(args, room, result):
+    s = socket.create_connection((args.host, args.port))
+    s.sendall(frame(JOIN, room))
+    buffer = b''
+    last = 0
+    received = 0
+    s.settimeout(2)
+    try:
+        while True:
+            data = s.recv(1 << 20)
+            if not data:
+                break
+            buffer += data
+            while len(buffer) >= header.size:
+                size, opcode, _, seq = header.unpack_from(buffer)
+                if len(buffer) < header.size + size:
+                    break
+                buffer = buffer[header.size + size:]
+                if opcode == JOINED:
+                    result['joined'].set()
+                elif opcode == MESSAGE:
+                    if seq <= last:
+                        result['out_of_order'] += 1
+                    last = seq
+                    received += 1
+    except socket.timeout:
+        pass
+    result['received'] = received
+
+
+def run(args, mode):
+    result = {'joined': threading.Event(), 'out_of_order': 0, 'received': 0}
+    subscriber = None
+    if mode == 'hot':
+        subscriber = threading.Thread(target=subscribe, args=(args, 1, result))
+        subscriber.start()
+        result['joined'].wait(5)
+    start = multiprocessing.Event()
+    procs = [multiprocessing.Process(target=worker, args=(args, mode, i, start)) for i in range(args.processes)]
+    for p in procs:
+        p.start()
+    time.sleep(0.5)
+    begin = time.perf_counter()
+    start.set()
+    for p in procs:
+        p.join()
+    elapsed = time.perf_counter() - begin
+    total = args.messages // (args.processes * args.connections) * args.processes * args.connections
+    line = f'{mode:4}  {total} messages in {elapsed:.2f} s  {total / elapsed:,.0f} msg/s'
+    if subscriber:
+        subscriber.join()
+        line += f'  subscriber got {result["received"]}, out of order {result["out_of_order"]}'
+    print(line)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8081)
+    parser.add_argument('--processes', type=int, default=4)
+    parser.add_argument('--connections', type=int, default=8, help='每个进程的连接数')
+    parser.add_argument('--messages', type=int, default=20000, help='每种模式一共发多少条')
+    parser.add_argument('--window', type=int, default=16, help='每条连接最多多少条没确认')
+    parser.add_argument('--size', type=int, default=64, help='正文字节数')
+    parser.add_argument('--rooms-per-connection', type=int, default=4, help='冷房间模式下每条连接轮流发的房间数')
+    args = parser.parse_args()
+    for mode in ('hot', 'cold'):
+        run(args, mode)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# HTTP 和二进制协议发布的对比：同样的连接数、同样的正文，各发一遍，看吞吐和每条从发出到确认的延迟
+# HTTP 每条连接一次一个请求；二进制先一次一条跟 HTTP 比，再让每条连接保持 window 条在路上
+# 服务器要用 --rate-limit off 起，不然测的是限流
+#
+#   ./chatserver --rate-limit off &
+#   python3 bench/protocols.py [--host 127.0.0.1] [--http-port 8080] [--binary-port 8081] [--processes 4] [--connections 8] [--messages 20000]
+import argparse
+import asyncio
+import multiprocessing
+import struct
+import time
+
+header = struct.Struct('<IB3xQQ')
+SEND, ACK = 3, 0x82
+
+
+async def http_publisher(args, room, count, latencies):
+    reader, writer = await asyncio.open_connection(args.host, args.http_port)
+    body = b'x' * args.size
+    request = b'POST /rooms/%d/messages HTTP/1.1\r\nContent-length: %d\r\n\r\n' % (room, len(body)) + body
+    for _ in range(count):
+        begin = time.perf_counter()
+        writer.write(request)
+        head = await reader.readuntil(b'\r\n\r\n')
+        assert head.startswith(b'HTTP/1.1 200'), head
+        length = next(int(line.split(b':')[1]) for line in head.split(b'\r\n') if line.lower().startswith(b'content-length'))
+        await reader.readexactly(length)
+        latencies.append(time.perf_counter() - begin)
+    writer.close()
+
+
+async def binary_publisher(args, room, count, latencies, window):
+    reader, writer = await asyncio.open_connection(args.host, args.binary_port)
+    request = header.pack(args.size, SEND, room, 0) + b'x' * args.size
+    sent = acked = 0
+    started = []
+    while acked < count:
+        while sent < count and sent - acked < window:
+            writer.write(request)
+            started.append(time.perf_counter())
+            sent += 1
+        await writer.drain()
+        size, opcode, _, _ = header.unpack(await reader.readexactly(header.size))
+        await reader.readexactly(size)
+        if opcode == ACK:
+            latencies.append(time.perf_counter() - started[acked])
+            acked += 1
+    writer.close()
+
+
+def worker(args, mode, index, start, queue):
+    async def run():
+        latencies = []
+        count = args.messages // (args.processes * args.connections)
+        tasks = []
+        for c in range(args.connections):
+            room = 1 + index * args.connections + c
+            if mode == 'http':
+                tasks.append(http_publisher(args, room, count, latencies))
+            else:
+                tasks.append(binary_publisher(args, room, count, latencies, 1 if mode == 'binary' else args.window))
+        start.wait()
+        await asyncio.gather(*tasks)
+        return latencies
+    queue.put(asyncio.run(run()))
+
+
+def run(args, mode):
+    start = multiprocessing.Event()
+    queue = multiprocessing.Queue()
+    procs = [multiprocessing.Process(target=worker, args=(args, mode, i, start, queue)) for i in range(args.processes)]
+    for p in procs:
+        p.start()
+    time.sleep(0.5)
+    begin = time.perf_counter()
+    start.set()
+    latencies = []
+    for _ in procs:
+        latencies += queue.get()
+    elapsed = time.perf_counter() - begin
+    for p in procs:
+        p.join()
+    latencies.sort()
+    n = len(latencies)
+    p50, p99 = (latencies[min(n - 1, int(n * q))] * 1e6 for q in (0.5, 0.99))
+    print(f'{mode:15}  {n / elapsed:>10,.0f} msg/s  p50 {p50:>7.0f} us  p99 {p99:>7.0f} us')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--http-port', type=int, default=8080)
+    parser.add_argument('--binary-port', type=int, default=8081)
+    parser.add_argument('--processes', type=int, default=4)
+    parser.add_argument('--connections', type=int, default=8, help='每个进程的连接数')
+    parser.add_argument('--messages', type=int, default=20000, help='每种协议一共发多少条')
+    parser.add_argument('--window', type=int, default=16, help='二进制流水线模式下每条连接最多多少条没确认')
+    parser.add_argument('--size', type=int, default=64, help='正文字节数')
+    args = parser.parse_args()
+    for mode in ('http', 'binary', 'binary-pipelined'):
+        run(args, mode)
+
+
+if __name__ == '__main__':
+    main()
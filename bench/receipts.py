@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# 未读徽章查询的耗时：一个人进了 rooms 个房间，每个房间都有未读，反复查 /users/<名字>/unread
+# 同一条长连接上再查一个几乎什么都不做的 /stats/ephemeral 当底数，两者的差就是算一个人所有房间未读数的开销
+# 服务器要用 --rate-limit off 起，不然进房间、发消息会被限流
+#
+#   ./chatserver --rate-limit off &
+#   python3 bench/receipts.py [--host 127.0.0.1] [--http-port 8080] [--binary-port 8081] [--rooms 1,16,256] [--requests 5000]
+import argparse
+import random
+import socket
+import struct
+import time
+
+header = struct.Struct('<IB3xQQ')
+JOIN, SEND, HELLO = 1, 3, 6
+ACK, JOINED = 0x82, 0x83
+
+
+def read_frame(sock, buffer):
+    while True:
+        if len(buffer) >= header.size:
+            size, opcode, room, seq = header.unpack_from(buffer)
+            if len(buffer) >= header.size + size:
+                return opcode, buffer[header.size + size:]
+        data = sock.recv(1 << 16)
+        if not data:
+            raise EOFError
+        buffer += data
+
+
+def member(args, name, rooms):
+    sock = socket.create_connection((args.host, args.binary_port))
+    payload = name.encode()
+    sock.sendall(header.pack(len(payload), HELLO, 0, 0) + payload)
+    sock.sendall(b''.join(header.pack(0, JOIN, room, 0) for room in rooms))
+    buffer = b''
+    joined = 0
+    while joined < len(rooms):
+        opcode, buffer = read_frame(sock, buffer)
+        joined += opcode == JOINED
+    #每个房间发几条，进房间以后的才算未读
+    body = b'unread'
+    sock.sendall(b''.join(header.pack(len(body), SEND, room, 0) + body for room in rooms for _ in range(3)))
+    acked = 0
+    while acked < 3 * len(rooms):
+        opcode, buffer = read_frame(sock, buffer)
+        acked += opcode == ACK
+    return sock
+
+
+def measure(sock, path, count):
+    request = f'GET {path} HTTP/1.1\r\n\r\n'.encode()
+    latencies = []
+    buffer = b''
+    for _ in range(count):
+        begin = time.perf_counter()
+        sock.sendall(request)
+        while b'\r\n\r\n' not in buffer:
+            buffer += sock.recv(1 << 16)
+        head, buffer = buffer.split(b'\r\n\r\n', 1)
+        length = next(int(line.split(b':')[1]) for line in head.split(b'\r\n') if line.lower().startswith(b'content-length'))
+        while len(buffer) < length:
+            buffer += sock.recv(1 << 16)
+        buffer = buffer[length:]
+        latencies.append(time.perf_counter() - begin)
+    latencies.sort()
+    return latencies[len(latencies) // 2] * 1e6, latencies[min(len(latencies) - 1, int(len(latencies) * 0.99))] * 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--http-port', type=int, default=8080)
+    parser.add_argument('--binary-port', type=int, default=8081)
+    parser.add_argument('--rooms', default='1,16,256', help='一个人进多少个房间，逗号分开的几种；一条连接最多 256 个')
+    parser.add_argument('--requests', type=int, default=5000)
+    args = parser.parse_args()
+
+    http = socket.create_connection((args.host, args.http_port))
+    http.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    base = random.randint(1 << 32, 1 << 40)
+    members = []
+    for n in map(int, args.rooms.split(',')):
+        name = f'badge{base}-{n}'
+        members.append(member(args, name, [base + n * 1000 + i for i in range(n)]))
+        measure(http, f'/users/{name}/unread', 200)
+        p50, p99 = measure(http, f'/users/{name}/unread', args.requests)
+        b50, b99 = measure(http, '/stats/ephemeral', args.requests)
+        print(f'{n:>4} rooms  unread p50 {p50:>6.1f} us  p99 {p99:>6.1f} us  baseline p50 {b50:>6.1f} us  lookup ~{p50 - b50:>5.1f} us')
+
+
+if __name__ == '__main__':
+    main()
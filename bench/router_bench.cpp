@@ -0,0 +1,51 @@
+// 路由查找的耗时：照着服务器的写法注册 300 条路由，静态的和带参数的各占一部分，反复查一组路径
+// 直接把 server.cpp 包进来用里面的 http_router，服务器的 main 改个名字不用
+//
+//   cmake --build build --target router_bench && ./build/router_bench [轮数]
+#define main server_main
+#include "../server.cpp"
+#undef main
+
+struct bench_handler {
+    uint64_t m_hits = 0;
+};
+
+int main(int argc, char **argv) {
+    using router = http_router<bench_handler>;
+    size_t rounds = argc > 1 ? std::stoul(argv[1]) : 200000;
+    router r;
+    auto hit = [] (bench_handler &self, http_route_params const &, std::string_view) {
+        ++self.m_hits;
+    };
+    //100 组资源，每组一条静态的、一条整数参数的、一条整数加名字参数的，一共 300 条
+    for (int i = 0; i < 100; ++i) {
+        r.add("GET", fmt::format("/api/v1/resource{}/stats", i), hit);
+        r.add("GET", fmt::format("/api/v1/resource{}/{{id:int}}/items", i), hit);
+        r.add("POST", fmt::format("/api/v1/resource{}/{{id:int}}/members/{{name:slug}}", i), hit);
+    }
+    std::vector<std::pair<std::string, std::string>> requests;
+    for (int i = 0; i < 100; i += 7) {
+        requests.emplace_back("GET", fmt::format("/api/v1/resource{}/stats", i));
+        requests.emplace_back("GET", fmt::format("/api/v1/resource{}/{}/items", i, 1000 + i));
+        requests.emplace_back("POST", fmt::format("/api/v1/resource{}/{}/members/user-{}", i, i, i));
+        requests.emplace_back("GET", fmt::format("/api/v1/resource{}/nope", i));
+    }
+    bench_handler handler;
+    http_route_params params;
+    size_t misses = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        for (auto const &[method, path] : requests) {
+            auto match = r.find(method, path, params);
+            if (match.m_handler) {
+                match.m_handler(handler, params, {});
+            } else {
+                ++misses;
+            }
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    size_t lookups = rounds * requests.size();
+    fmt::println("{} routes, {} lookups ({} hits, {} misses): {:.1f} ns per lookup", 300, lookups, handler.m_hits, misses, elapsed / lookups);
+    return 0;
+}
@@ -1,23 +1,47 @@
 #include <algorithm>
 #include <arpa/inet.h>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <csignal>
+#include <charconv>
+#include <chrono>
 #include <deque>
 #include <stdexcept>
 #include <system_error>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <fcntl.h>
 #include <map>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <thread>
+#include <time.h>
 #include <type_traits>
+#include <unordered_map>
 #include <unistd.h>
 #include <fmt/format.h>
 #include <string.h>
 #include <utility>
 #include <vector>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <memory>
 
 struct no_move {
@@ -48,11 +72,11 @@ std::error_category const &gai_category() {
     throw std::system_error(ec, what);
 }
 
-template <int Except = 0, class T>
+template <int ...Except, class T>
 T check_error(const char *what, T res){
     if(res == -1){
-        if constexpr (Except != 0){
-            if(errno == Except){
+        if constexpr (sizeof...(Except) != 0){
+            if(((errno == Except) || ...)){
                 return -1;
             }
         }
@@ -141,7 +165,7 @@ struct address_resolver {
     }
 };
 
-using string_map = std::map<std::string, std::string>;
+using string_map = std::pmr::map<std::pmr::string, std::pmr::string>;
 
 struct bytes_const_view {
     char const *m_data;
@@ -212,13 +236,14 @@ struct bytes_view {
 };
 
 struct bytes_buffer {
-    std::vector<char> m_data;
+    std::pmr::vector<char> m_data;
 
     bytes_buffer() = default;
     bytes_buffer(bytes_buffer &&) = default;
     bytes_buffer &operator=(bytes_buffer &&) = default;
     explicit bytes_buffer(bytes_buffer const &) = default;
     explicit bytes_buffer(size_t n) : m_data(n) {}
+    explicit bytes_buffer(std::pmr::memory_resource *mr) : m_data(mr) {}
 
     char const *data() const noexcept {
         return m_data.data();
@@ -278,10 +303,29 @@ struct bytes_buffer {
         append(std::string_view{literial, N - 1});
     }
 
+    //在末尾留出 n 字节给 read 直接写入，读完再用 commit 截到实际长度
+    bytes_view prepare(size_t n) {
+        size_t old_size = m_data.size();
+        if (m_data.capacity() < old_size + n) {
+            m_data.reserve(std::max(old_size + n, m_data.capacity() * 2));
+        }
+        m_data.resize(old_size + n);
+        return {m_data.data() + old_size, n};
+    }
+
+    void commit(bytes_view spare, size_t n) {
+        m_data.resize(static_cast<size_t>(spare.data() - m_data.data()) + n);
+    }
+
     void clear() {
         m_data.clear();
     }
 
+    //连容量一起还回去，arena 回退之前必须先调用
+    void release() {
+        std::pmr::vector<char>(m_data.get_allocator()).swap(m_data);
+    }
+
     void resize(size_t n) {
         m_data.resize(n);
     }
@@ -320,527 +364,7739 @@ struct static_bytes_buffer {
     }
 };
 
-struct http11_request_parser {
-    bytes_buffer m_header;
-    std::string m_heading_line;
-    string_map m_header_keys;
-    std::string m_body;
-    bool m_header_finished = false;
+//小对象内存池：每次异步操作都要 new 一个回调，按大小分档用线程内的空闲链表复用
+struct small_object_pool {
+    static constexpr size_t granularity = 16;
+    static constexpr size_t max_size = 1280;    // 等可写时的回调要带上一整组 iovec
+    static constexpr size_t max_cached = 4096;
 
-    void reset_state() {
-        m_header.clear();
-        m_heading_line.clear();
-        m_header_keys.clear();
-        m_body.clear();
-        m_header_finished = 0;
+    struct _node {
+        _node *m_next;
+    };
+
+    _node *m_free[max_size / granularity] = {};
+    size_t m_count[max_size / granularity] = {};
+
+    static small_object_pool &instance() {
+        static thread_local small_object_pool pool;
+        return pool;
     }
 
-    //正文结束不需要更多字节
-    [[nodiscared]] bool header_finished() {
-        return m_header_finished;
+    void *allocate(size_t n) {
+        if (n > max_size) {
+            return ::operator new(n);
+        }
+        size_t i = (n - 1) / granularity;
+        if (m_free[i] == nullptr) {
+            return ::operator new((i + 1) * granularity);
+        }
+        _node *node = m_free[i];
+        m_free[i] = node->m_next;
+        --m_count[i];
+        return node;
     }
-    
-    void _extract_headers(){
-        std::string_view header = m_header;
-        size_t pos = header.find("\r\n");
-        m_heading_line = header.substr(0, pos);
-        // size_t pos = header.find("\r\n", 0, 2);
-        while(pos != std::string::npos){
-            //跳过\r\n
-            pos += 2;
-            //从当前pos往下找
-            size_t next_pos = header.find("\r\n", pos);
-            // size_t next_pos = header.find("\r\n", pos, 2);
-            size_t line_len = std::string::npos;
-            //如果下一行不是结束，line_len获取当前行到下一行的距离
-            if(next_pos != std::string::npos){
-                line_len = next_pos - pos;
-            }
-            std::string_view line = header.substr(pos, line_len);
-            size_t colon = line.find(": ");
-            // size_t colon = line.find(": ", 0, 2);
-            if(colon != std::string::npos){
-                std::string key = std::string(line.substr(0, colon));
-                //排除": ",注意这里是两个字符
-                std::string_view value = line.substr(colon + 2);
-                //转换成小写
-                std::transform(key.begin(), key.end(), key.begin(), [] (char c){
-                    if('A' <= c && c <= 'Z'){
-                        c += 'a' - 'A';
-                    }
-                    return c;
-                });
-                // if(key == "content_length"){
-                //     content_length = std::stoi(value);
-                // }
-                m_header_keys.insert_or_assign(std::move(key), value);
-            }
-            pos = next_pos;
+
+    void deallocate(void *p, size_t n) noexcept {
+        if (n > max_size) {
+            return ::operator delete(p);
         }
+        size_t i = (n - 1) / granularity;
+        if (m_count[i] >= max_cached) {
+            return ::operator delete(p);
+        }
+        auto *node = static_cast<_node *>(p);
+        node->m_next = m_free[i];
+        m_free[i] = node;
+        ++m_count[i];
     }
-    
-    void push_chunk(bytes_const_view chunk){
-        assert(!m_header_finished);
-        size_t old_size = m_header.size();
-        m_header.append(chunk);
-        std::string_view header = m_header;
-        // size_t header_len = header.find("\r\n\r\n");
-        if (old_size < 4)
-            old_size = 4;
-        old_size -= 4;
-        size_t header_len = header.find("\r\n\r\n", old_size, 4);
-        if(header_len != std::string::npos){
-            m_header_finished = true;
-            m_body = header.substr(header_len + 4);
-            m_header.resize(header_len);
-            //解析头部中的Content_length字段
-            //http响应不区分大小写，在解析Content_length的时候不能直接find
-            _extract_headers();
+
+    ~small_object_pool() {
+        for (_node *&head : m_free) {
+            while (head) {
+                _node *next = head->m_next;
+                ::operator delete(head);
+                head = next;
+            }
         }
     }
+};
 
-    std::string &headline() {
-        return m_heading_line;
+//构造回调
+template <class ...Args>
+struct callback {
+    struct _callback_base {
+        virtual void _call(Args... args) = 0;
+        virtual ~_callback_base() = default;
+    };
+    template <class F>
+    struct _callback_impl final : _callback_base {
+        F m_func;
+        template <class ...Ts, class = std::enable_if_t<std::is_constructible_v<F, Ts...>>>
+        _callback_impl(Ts &&...ts) : m_func(std::forward<Ts>(ts)...) {}
+        void _call(Args... args) override {
+            m_func(std::forward<Args>(args)...);
+        }
+        static void *operator new(size_t n) {
+            return small_object_pool::instance().allocate(n);
+        }
+        static void operator delete(void *p, size_t n) noexcept {
+            small_object_pool::instance().deallocate(p, n);
+        }
+    };
+    std::unique_ptr<_callback_base> m_base;
+    template <class F, class = std::enable_if_t<std::is_invocable_v<F, Args...> && !std::is_same_v<std::decay_t<F>, callback>>>
+    callback(F &&f) : m_base(std::make_unique<_callback_impl<std::decay_t<F>>>(std::forward<F>(f))) {}
+    callback() = default;
+    callback(callback const &) = delete;
+    callback &operator=(callback const &) = delete;
+    callback(callback &&) = default;
+    callback &operator=(callback &&) = default;
+    void operator()(Args... args) const {
+        assert(m_base);
+        return m_base->_call(std::forward<Args>(args)...);
     }
-    
-    string_map &headers() {
-        return m_header_keys;
+
+    template <class F>
+    F &target() const {
+        assert(m_base);
+        return static_cast<_callback_impl<F> &>(*m_base);
     }
-    bytes_buffer &headers_raw() {
-        return m_header;
+    void *leak_address() {
+        return static_cast<void *>(m_base.release());
     }
-
-    std::string &extra_body() {
-        return m_body;
+    static callback from_address(void *addr) {
+        callback cb;
+        cb.m_base = std::unique_ptr<_callback_base>(static_cast<_callback_base *>(addr));
+        return cb;
     }
-    
 };
 
-template<class HeaderParser = http11_request_parser>
-struct _http_base_parser {
-    HeaderParser m_header_parser;
-    size_t m_content_length = 0;
-    size_t body_accumulated_size = 0;
-    bool m_body_finished = false;
-    //正文结束不需要更多字节
+//侵入式引用计数；ref_counted 的计数不是原子的，对象只在创建它的事件循环线程里被引用
+//T 可以带 const：计数是 mutable 的，只读的引用也能持有；最后一个引用没了照样回收，和 delete 一个 const 指针一样
+template <class T>
+struct intrusive_ptr {
+    T *m_ptr = nullptr;
 
-    void reset_state() {
-        m_header_parser.reset_state();
-        m_content_length = 0;
-        body_accumulated_size = 0;
-        m_body_finished = false;
+    intrusive_ptr() = default;
+    explicit intrusive_ptr(T *p) noexcept : m_ptr(p) {
+        if (m_ptr)
+            ++m_ptr->m_refcount;
     }
-
-    [[nodiscard]] bool header_finished() {
-        return m_header_parser.header_finished();
+    intrusive_ptr(intrusive_ptr const &that) noexcept : intrusive_ptr(that.m_ptr) {}
+    intrusive_ptr(intrusive_ptr &&that) noexcept : m_ptr(that.m_ptr) {
+        that.m_ptr = nullptr;
     }
-
-    [[nodiscared]] bool request_finished() {
-        return m_body_finished;
+    intrusive_ptr &operator=(intrusive_ptr that) noexcept {
+        std::swap(m_ptr, that.m_ptr);
+        return *this;
     }
-
-    std::string &m_header_raw() {
-        return m_header_parser.headers_raw();
+    ~intrusive_ptr() {
+        using object = std::remove_const_t<T>;
+        if (m_ptr && --m_ptr->m_refcount == 0)
+            object::_destroy(const_cast<object *>(m_ptr));
     }
 
-    std::string &headline() {
-        return m_header_parser.headline();
+    T *get() const noexcept {
+        return m_ptr;
     }
-
-    string_map &headers() {
-        return m_header_parser.headers();
+    //交出引用但不减计数，之后由 adopt 接回来
+    T *release() noexcept {
+        return std::exchange(m_ptr, nullptr);
+    }
+    static intrusive_ptr adopt(T *p) noexcept {
+        intrusive_ptr ptr;
+        ptr.m_ptr = p;
+        return ptr;
+    }
+    T *operator->() const noexcept {
+        return m_ptr;
+    }
+    T &operator*() const noexcept {
+        return *m_ptr;
     }
+    explicit operator bool() const noexcept {
+        return m_ptr != nullptr;
+    }
+};
 
-    std::string _headline_first() {
-        auto &line = headline();
-        size_t space = line.find(' ');
-        if(space == std::string::npos){
-            return "";
-        }
-        return line.substr(0, space);
+template <class T>
+struct ref_counted {
+    mutable size_t m_refcount = 0;
+
+    intrusive_ptr<T> ref_from_this() noexcept {
+        return intrusive_ptr<T>(static_cast<T *>(this));
     }
 
-    std::string _headline_second(){
-        auto &line = headline();
-        size_t space1 = line.find(' ');
-        if(space1 == std::string::npos){
-            return "";
-        }
-        size_t space2 = line.find(' ', space1 + 1);
-        if(space2 == std::string::npos){
-            return "";
-        }
-        return line.substr(space1, space2 - space1);
+    //最后一个引用没了就删掉，派生类可以同名覆盖成回收进对象池
+    static void _destroy(T *p) {
+        delete p;
     }
+};
 
-    std::string _headline_third(){
-        auto &line = headline();
-        size_t space1 = line.find(' ');
-        if(space1 == std::string::npos){
-            return "";
-        }
-        size_t space2 = line.find(' ', space1 + 1);
-        if(space2 == std::string::npos){
-            return "";
-        }
-        return line.substr(space2 + 1);
+//要在事件循环线程之间传递的对象用原子计数，哪个线程放掉最后一个引用就在哪个线程销毁
+template <class T>
+struct atomic_ref_counted {
+    mutable std::atomic<size_t> m_refcount{0};
+
+    static void _destroy(T *p) {
+        delete p;
     }
+};
 
-    std::string &body() {
-        return m_header_parser.extra_body();
+//线程内的空闲对象链表，用来回收频繁创建销毁的对象
+template <class T>
+struct object_pool {
+    static constexpr size_t max_cached = 1024;
+    std::vector<T *> m_free;
+
+    static object_pool &instance() {
+        static thread_local object_pool pool;
+        return pool;
     }
 
-    size_t _extract_content_length(){
-        auto& headers = m_header_parser.headers();
-        auto it = headers.find("content-length");
-        if(it == headers.end()){
-            return 0;
-        }
-        try{
-            return std::stoi(it->second);
-        }catch (std::logic_error const &){
-            return 0;
+    T *acquire() {
+        if (m_free.empty()) {
+            return new T;
         }
+        T *p = m_free.back();
+        m_free.pop_back();
+        return p;
     }
-    
-    void push_chunk(bytes_const_view chunk){
-        assert(!m_body_finished);
-        if(!m_header_parser.header_finished()){
-            m_header_parser.push_chunk(chunk);
-            if(m_header_parser.header_finished()){
-                body_accumulated_size = body().size();
-                m_content_length = _extract_content_length();
-                if(body_accumulated_size >= m_content_length){
-                    m_body_finished = true;
-                    // body().resize(m_content_length);
-                }
-            }
-        }
-        else{
-            //正文已经结束但是收到了正文的其他部分
-            body().append(chunk);
-            body_accumulated_size += chunk.size();
-            if(body_accumulated_size >= m_content_length){
-                m_body_finished = true;
-            }
+
+    void release(T *p) {
+        if (m_free.size() >= max_cached) {
+            delete p;
+            return;
         }
+        m_free.push_back(p);
     }
 
-    std::string read_some_body() {
-        return std::move(body());
+    ~object_pool() {
+        for (T *p : m_free) {
+            delete p;
+        }
     }
 };
 
-template<class HeaderParser = http11_request_parser>
-struct http_request_parser : _http_base_parser<HeaderParser>{
-    std::string method(){
-        return this->_headline_first();
+//全局内存账：所有连接的缓冲区都记在这里，超过预算就暂停读，降到恢复线以下再继续
+struct memory_stats {
+    std::atomic<size_t> m_used{0};
+    std::atomic<size_t> m_peak{0};
+    size_t m_limit = size_t(1) << 30;
+
+    static memory_stats &global() {
+        static memory_stats instance;
+        return instance;
     }
 
-    std::string url() {
-        return this->_headline_second();
+    void charge(size_t n) noexcept {
+        size_t used = m_used.fetch_add(n, std::memory_order_relaxed) + n;
+        size_t peak = m_peak.load(std::memory_order_relaxed);
+        while (used > peak && !m_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+            ;
     }
 
-    std::string http_version() {
-        return this->_headline_third();
+    void uncharge(size_t n) noexcept {
+        m_used.fetch_sub(n, std::memory_order_relaxed);
     }
-};
 
-template<class HeaderParser = http11_request_parser>
-struct http_response_parser : _http_base_parser<HeaderParser>{
-    std::string http_version(){
-        return this->_headline_first();
+    size_t used() const noexcept {
+        return m_used.load(std::memory_order_relaxed);
     }
 
-    int status() {
-        auto s = this->_headline_second();
-        try{
-            return std::stoi(s);
-        }catch (std::logic_error const &) {
-            return -1;
-        }
+    size_t peak() const noexcept {
+        return m_peak.load(std::memory_order_relaxed);
     }
 
-    std::string status_string() {
-        return this->_headline_third();
+    bool over_budget() const noexcept {
+        return used() > m_limit;
     }
-};
 
-//构造响应
-struct http11_header_writer{
-    bytes_buffer m_buffer;
+    //过了一半预算，空闲连接就把留着的缓冲块也还回去
+    bool above_high_water() const noexcept {
+        return used() > m_limit / 2;
+    }
 
-    void reset_state() {
-        m_buffer.clear();
+    //留一点余量，避免在预算线上来回暂停恢复
+    bool can_resume() const noexcept {
+        return used() <= m_limit / 10 * 9;
     }
 
-    bytes_buffer &buffer() {
-        return m_buffer;
+    static std::vector<callback<>> &_waiters() {
+        static thread_local std::vector<callback<>> waiters;
+        return waiters;
     }
-     void begin_header(std::string_view first, std::string_view second, std::string_view third) {
-        m_buffer.append(first);
-        m_buffer.append_literial(" ");
-        m_buffer.append(second);
-        m_buffer.append_literial(" ");
-        m_buffer.append(third);
+
+    static void wait_for_budget(callback<> cb) {
+        _waiters().push_back(std::move(cb));
     }
 
-    void write_header(std::string_view key, std::string_view value) {
-        m_buffer.append_literial("\r\n");
-        m_buffer.append(key);
-        m_buffer.append_literial(": ");
-        m_buffer.append(value);
+    static bool has_waiters() {
+        return !_waiters().empty();
     }
 
-    void end_header() {
-        m_buffer.append_literial("\r\n\r\n");
+    //事件循环每一轮调用一次
+    static void resume_waiters() {
+        if (!has_waiters() || !global().can_resume())
+            return;
+        std::vector<callback<>> waiters = std::move(_waiters());
+        _waiters().clear();
+        for (auto &cb : waiters) {
+            cb();
+        }
     }
 };
 
+//单个连接的内存账，同时记到全局账上；只在连接所在的线程里改
+struct memory_account {
+    size_t m_used = 0;
+    size_t m_peak = 0;
+    size_t m_limit = 16 * 1024 * 1024;
 
-template <class HeaderWriter = http11_header_writer>
-struct _http_base_writer {
-    HeaderWriter m_header_writer;
-
-    void _begin_header(std::string_view first, std::string_view second, std::string_view third) {
-        m_header_writer.begin_header(first, second, third);
+    void charge(size_t n) noexcept {
+        m_used += n;
+        m_peak = std::max(m_peak, m_used);
+        memory_stats::global().charge(n);
     }
 
-    void reset_state() {
-        m_header_writer.reset_state();
+    void uncharge(size_t n) noexcept {
+        assert(m_used >= n);
+        m_used -= n;
+        memory_stats::global().uncharge(n);
     }
 
-    bytes_buffer &buffer() {
-        return m_header_writer.buffer();
+    bool over_budget() const noexcept {
+        return m_used > m_limit;
     }
+};
 
-    void write_header(std::string_view key, std::string_view value) {
-        m_header_writer.write_header(key, value);
-    }
+//碰撞指针分配器，每个连接独享一个
+//一次请求里的头部、正文、响应都从这里分配，deallocate 什么也不做
+//请求结束后 reset() 整体回退到开头，超过高水位的块还给线程内的块池
+struct bytes_arena : std::pmr::memory_resource, no_move {
+    static constexpr size_t block_size = 16 * 1024;
+    static constexpr size_t high_water_blocks = 4;
 
-    void end_header() {
-        m_header_writer.end_header();
-    }
+    struct alignas(std::max_align_t) _block {
+        _block *m_next = nullptr;
 
-    void write_body(std::string_view body) {
-        m_header_writer.buffer().append(body);
+        char *data() noexcept {
+            return reinterpret_cast<char *>(this + 1);
+        }
+
+        static constexpr size_t capacity() noexcept {
+            return block_size - sizeof(_block);
+        }
+    };
+
+    //放不进一个块的大分配单独向系统要，回退时直接释放
+    struct alignas(std::max_align_t) _large {
+        _large *m_next;
+        size_t m_size;
+    };
+
+    struct _block_pool {
+        static constexpr size_t max_cached = 1024;
+        _block *m_free = nullptr;
+        size_t m_count = 0;
+
+        _block *acquire() {
+            if (m_free == nullptr) {
+                return new (::operator new(block_size)) _block;
+            }
+            _block *b = m_free;
+            m_free = b->m_next;
+            --m_count;
+            b->m_next = nullptr;
+            return b;
+        }
+
+        void release(_block *b) noexcept {
+            if (m_count >= max_cached) {
+                ::operator delete(b);
+                return;
+            }
+            b->m_next = m_free;
+            m_free = b;
+            ++m_count;
+        }
+
+        ~_block_pool() {
+            while (m_free) {
+                _block *next = m_free->m_next;
+                ::operator delete(m_free);
+                m_free = next;
+            }
+        }
+    };
+
+    static _block_pool &pool() {
+        static thread_local _block_pool instance;
+        return instance;
+    }
+
+    _block *m_head = nullptr;
+    _block *m_curr = nullptr;
+    size_t m_used = 0;  // m_curr 里已经用掉的字节
+    size_t m_nblocks = 0;
+    _large *m_large = nullptr;
+    memory_account *m_account = nullptr;
+
+    bytes_arena() = default;
+    explicit bytes_arena(memory_account *account) : m_account(account) {}
+
+    ~bytes_arena() override {
+        reset();
+        shrink();
+    }
+
+    _block *_acquire_block() {
+        if (m_account)
+            m_account->charge(block_size);
+        return pool().acquire();
+    }
+
+    void _release_block(_block *b) noexcept {
+        if (m_account)
+            m_account->uncharge(block_size);
+        pool().release(b);
+    }
+
+    //从第 keep 块之后全部还给块池
+    void _trim(size_t keep) noexcept {
+        if (m_nblocks <= keep)
+            return;
+        _block *rest = m_head;
+        if (keep != 0) {
+            _block *last = m_head;
+            for (size_t i = 1; i < keep; ++i) {
+                last = last->m_next;
+            }
+            rest = last->m_next;
+            last->m_next = nullptr;
+        } else {
+            m_head = nullptr;
+        }
+        while (rest) {
+            _block *next = rest->m_next;
+            _release_block(rest);
+            rest = next;
+        }
+        m_nblocks = keep;
+    }
+
+    void reset() noexcept {
+        while (m_large) {
+            _large *next = m_large->m_next;
+            if (m_account)
+                m_account->uncharge(m_large->m_size);
+            ::operator delete(m_large);
+            m_large = next;
+        }
+        _trim(high_water_blocks);
+        m_curr = m_head;
+        m_used = 0;
+    }
+
+    //连接关闭时把留着的块也还回去
+    void shrink() noexcept {
+        assert(m_large == nullptr && m_used == 0);
+        _trim(0);
+        m_curr = nullptr;
+    }
+
+    //连接空闲时调用：平时留着高水位以内的块给下一个请求，全局内存紧张时才一块不留
+    void release_idle() noexcept {
+        reset();
+        if (memory_stats::global().above_high_water())
+            shrink();
+    }
+
+    void *_allocate_large(size_t bytes) {
+        auto *l = static_cast<_large *>(::operator new(sizeof(_large) + bytes));
+        l->m_next = m_large;
+        l->m_size = sizeof(_large) + bytes;
+        m_large = l;
+        if (m_account)
+            m_account->charge(l->m_size);
+        return l + 1;
+    }
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        assert(align <= alignof(std::max_align_t));
+        if (bytes + align > _block::capacity()) {
+            return _allocate_large(bytes);
+        }
+        if (m_curr == nullptr) {
+            if (m_head == nullptr) {
+                m_head = _acquire_block();
+                m_nblocks = 1;
+            }
+            m_curr = m_head;
+            m_used = 0;
+        }
+        while (true) {
+            uintptr_t base = reinterpret_cast<uintptr_t>(m_curr->data());
+            uintptr_t p = (base + m_used + align - 1) & ~static_cast<uintptr_t>(align - 1);
+            if (p + bytes <= base + _block::capacity()) {
+                m_used = p + bytes - base;
+                return reinterpret_cast<void *>(p);
+            }
+            //之前留下的块优先复用
+            if (m_curr->m_next == nullptr) {
+                m_curr->m_next = _acquire_block();
+                ++m_nblocks;
+            }
+            m_curr = m_curr->m_next;
+            m_used = 0;
+        }
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+//换成同一分配器下的空容器，连容量一起释放
+template <class T>
+void _release_storage(T &t) {
+    T(t.get_allocator()).swap(t);
+}
+
+//一次 readv/writev 用的 iovec 数组
+//一页历史、一批订阅消息是很多段头和共享正文交替着来的，一次系统调用多带一些段
+struct io_vectors {
+    static constexpr size_t max_count = 64;
+    struct iovec m_iov[max_count];
+    size_t m_count = 0;
+
+    bool full() const noexcept {
+        return m_count == max_count;
+    }
+
+    void push(void const *data, size_t size) {
+        assert(!full());
+        m_iov[m_count++] = {const_cast<void *>(data), size};
+    }
+
+    void push(bytes_const_view buf) {
+        push(buf.data(), buf.size());
+    }
+
+    size_t total_size() const noexcept {
+        size_t total = 0;
+        for (size_t i = 0; i < m_count; ++i) {
+            total += m_iov[i].iov_len;
+        }
+        return total;
+    }
+};
+
+//链式缓冲区：一串带引用计数的定长块，追加时不搬动已有数据，拆分和拼接只复制块的引用
+//块的引用计数不是原子的，iobuf 只在一个线程里用
+struct iobuf {
+    struct _block : ref_counted<_block> {
+        static constexpr size_t capacity = 16 * 1024 - 3 * sizeof(size_t);
+        size_t m_size = 0;
+        memory_account *m_account = nullptr;  // 谁分配的块记在谁的账上
+        char m_data[capacity];
+
+        static void _destroy(_block *b) {
+            if (b->m_account)
+                b->m_account->uncharge(sizeof(_block));
+            b->m_size = 0;
+            b->m_account = nullptr;
+            object_pool<_block>::instance().release(b);
+        }
+    };
+
+    //m_block 为空表示借用外面的内存，由调用者保证它比 iobuf 活得久
+    struct _segment {
+        intrusive_ptr<_block> m_block;
+        char *m_data;
+        size_t m_size;
+
+        bytes_const_view view() const noexcept {
+            return {m_data, m_size};
+        }
+
+        //只有独占这个块、并且正好在块的末尾时才能原地往后写
+        size_t tailroom() const noexcept {
+            if (!m_block || m_block->m_refcount != 1 || m_data + m_size != m_block->m_data + m_block->m_size)
+                return 0;
+            return _block::capacity - m_block->m_size;
+        }
+    };
+
+    std::pmr::vector<_segment> m_segments;
+    size_t m_first = 0;     // 前面已经被拿走的段数
+    size_t m_size = 0;
+    size_t m_prepared = 0;  // prepare 出去的第一个段
+    bytes_buffer m_coalesced;
+    memory_account *m_account = nullptr;
+
+    explicit iobuf(std::pmr::memory_resource *mr = std::pmr::get_default_resource(), memory_account *account = nullptr)
+        : m_segments(mr), m_coalesced(mr), m_account(account) {}
+
+    iobuf(iobuf &&that) noexcept
+        : m_segments(std::move(that.m_segments)), m_first(that.m_first), m_size(that.m_size),
+          m_coalesced(std::move(that.m_coalesced)), m_account(that.m_account) {
+        that.m_first = 0;
+        that.m_size = 0;
+    }
+
+    iobuf &operator=(iobuf &&) = delete;
+
+    size_t size() const noexcept {
+        return m_size;
+    }
+
+    bool empty() const noexcept {
+        return m_size == 0;
+    }
+
+    size_t segment_count() const noexcept {
+        return m_segments.size() - m_first;
+    }
+
+    void clear() {
+        m_segments.clear();
+        m_first = 0;
+        m_size = 0;
+        m_coalesced.clear();
+    }
+
+    void release() {
+        _release_storage(m_segments);
+        m_first = 0;
+        m_size = 0;
+        m_coalesced.release();
+    }
+
+    template <class F>
+    void for_each(F &&f) const {
+        for (size_t i = m_first; i < m_segments.size(); ++i) {
+            f(m_segments[i].view());
+        }
+    }
+
+    _block *_acquire_block() {
+        _block *b = object_pool<_block>::instance().acquire();
+        b->m_account = m_account;
+        if (m_account)
+            m_account->charge(sizeof(_block));
+        return b;
+    }
+
+    _segment &_new_block_segment() {
+        _block *b = _acquire_block();
+        m_segments.push_back({intrusive_ptr<_block>(b), b->m_data, 0});
+        return m_segments.back();
+    }
+
+    size_t _tailroom() const noexcept {
+        return segment_count() == 0 ? 0 : m_segments.back().tailroom();
+    }
+
+    void _extend_back(size_t n) noexcept {
+        _segment &seg = m_segments.back();
+        seg.m_size += n;
+        seg.m_block->m_size += n;
+        m_size += n;
+    }
+
+    void append(bytes_const_view chunk) {
+        while (chunk.size() != 0) {
+            size_t room = _tailroom();
+            if (room == 0) {
+                _new_block_segment();
+                room = _block::capacity;
+            }
+            _segment &seg = m_segments.back();
+            size_t n = std::min(room, chunk.size());
+            memcpy(seg.m_data + seg.m_size, chunk.data(), n);
+            _extend_back(n);
+            chunk = chunk.subspan(n);
+        }
+    }
+
+    void append(std::string_view chunk) {
+        append(bytes_const_view{chunk.data(), chunk.size()});
+    }
+
+    //不拷贝，直接引用外面的内存
+    void append_external(bytes_const_view chunk) {
+        if (chunk.size() == 0)
+            return;
+        m_segments.push_back({intrusive_ptr<_block>(), const_cast<char *>(chunk.data()), chunk.size()});
+        m_size += chunk.size();
+    }
+
+    //共享对方的块
+    void append(iobuf const &that) {
+        for (size_t i = that.m_first; i < that.m_segments.size(); ++i) {
+            _segment const &seg = that.m_segments[i];
+            if (!seg.m_block && that._is_coalesced(seg)) {
+                append(seg.view());
+                continue;
+            }
+            _push_shared(seg);
+        }
+    }
+
+    //同一个块里紧挨着上一段的就并进上一段，少一个 iovec
+    void _push_shared(_segment const &seg) {
+        if (segment_count() != 0) {
+            _segment &last = m_segments.back();
+            if (last.m_block && last.m_block.m_ptr == seg.m_block.m_ptr && last.m_data + last.m_size == seg.m_data) {
+                last.m_size += seg.m_size;
+                m_size += seg.m_size;
+                return;
+            }
+        }
+        m_segments.push_back(seg);
+        m_size += seg.m_size;
+    }
+
+    //线程内共用的块：很多条小数据挤在同一个块里，各自共享自己那一段
+    //块里写过的部分不会再变，只有这里往后写，所以可以放心共享
+    static intrusive_ptr<_block> &_pack_block() {
+        static thread_local intrusive_ptr<_block> block = [] {
+            object_pool<_block>::instance();    // 让块池比它晚析构
+            return intrusive_ptr<_block>();
+        }();
+        return block;
+    }
+
+    //拷进共用块，适合要长期保存的小数据，免得每份都独占一整块
+    void append_packed(bytes_const_view chunk) {
+        auto &pack = _pack_block();
+        while (chunk.size() != 0) {
+            if (!pack || pack->m_size == _block::capacity) {
+                pack = intrusive_ptr<_block>(_acquire_block());
+            }
+            size_t n = std::min(_block::capacity - pack->m_size, chunk.size());
+            char *dst = pack->m_data + pack->m_size;
+            memcpy(dst, chunk.data(), n);
+            pack->m_size += n;
+            _push_shared({pack, dst, n});
+            chunk = chunk.subspan(n);
+        }
+    }
+
+    void append_packed(std::string_view chunk) {
+        append_packed(bytes_const_view{chunk.data(), chunk.size()});
+    }
+
+    //共享对方开头的 n 个字节
+    void append_prefix(iobuf const &that, size_t n) {
+        for (size_t i = that.m_first; n != 0 && i < that.m_segments.size(); ++i) {
+            _segment seg = that.m_segments[i];
+            seg.m_size = std::min(seg.m_size, n);
+            n -= seg.m_size;
+            if (!seg.m_block && that._is_coalesced(seg)) {
+                append(seg.view());
+                continue;
+            }
+            _push_shared(seg);
+        }
+    }
+
+    //把对方的数据拷进来，不共享也不借用，适合要长期保存的数据
+    void append_copy(iobuf const &that) {
+        that.for_each([this] (bytes_const_view chunk) {
+            append(chunk);
+        });
+    }
+
+    void prepend(bytes_const_view chunk) {
+        while (chunk.size() != 0) {
+            size_t n = std::min(chunk.size(), _block::capacity);
+            _block *b = _acquire_block();
+            memcpy(b->m_data, chunk.end() - n, n);
+            b->m_size = n;
+            _segment seg{intrusive_ptr<_block>(b), b->m_data, n};
+            if (m_first != 0) {
+                m_segments[--m_first] = std::move(seg);
+            } else {
+                m_segments.insert(m_segments.begin(), std::move(seg));
+            }
+            m_size += n;
+            chunk = chunk.subspan(0, chunk.size() - n);
+        }
+    }
+
+    bool _is_coalesced(_segment const &seg) const noexcept {
+        return m_coalesced.size() != 0 && seg.m_data >= m_coalesced.data() && seg.m_data < m_coalesced.data() + m_coalesced.size();
+    }
+
+    void _compact_front() {
+        if (m_first == m_segments.size()) {
+            m_segments.clear();
+            m_first = 0;
+        }
+    }
+
+    //丢掉前面 n 个字节
+    void consume(size_t n) {
+        assert(n <= m_size);
+        m_size -= n;
+        while (n != 0) {
+            _segment &seg = m_segments[m_first];
+            if (seg.m_size <= n) {
+                n -= seg.m_size;
+                seg = _segment{};
+                ++m_first;
+            } else {
+                seg.m_data += n;
+                seg.m_size -= n;
+                n = 0;
+            }
+        }
+        _compact_front();
+    }
+
+    //把前面 n 个字节拆成一个新的 iobuf，块是共享的
+    iobuf split(size_t n) {
+        assert(n <= m_size);
+        iobuf front(m_segments.get_allocator().resource(), m_account);
+        while (n != 0) {
+            _segment &seg = m_segments[m_first];
+            if (seg.m_size <= n && !_is_coalesced(seg)) {
+                n -= seg.m_size;
+                m_size -= seg.m_size;
+                front.m_size += seg.m_size;
+                front.m_segments.push_back(std::move(seg));
+                ++m_first;
+                continue;
+            }
+            size_t take = std::min(n, seg.m_size);
+            if (_is_coalesced(seg)) {
+                front.append(bytes_const_view{seg.m_data, take});
+            } else {
+                front.m_segments.push_back({seg.m_block, seg.m_data, take});
+                front.m_size += take;
+            }
+            seg.m_data += take;
+            seg.m_size -= take;
+            m_size -= take;
+            n -= take;
+            if (seg.m_size == 0)
+                ++m_first;
+        }
+        _compact_front();
+        return front;
+    }
+
+    //只留下前面 n 个字节
+    void truncate(size_t n) {
+        while (m_size > n) {
+            _segment &seg = m_segments.back();
+            size_t drop = std::min(seg.m_size, m_size - n);
+            seg.m_size -= drop;
+            m_size -= drop;
+            if (seg.m_size == 0)
+                m_segments.pop_back();
+        }
+        _compact_front();
+    }
+
+    //拼成一段连续内存，只有一段时不用拷贝
+    bytes_const_view coalesce() {
+        if (segment_count() == 0)
+            return {nullptr, 0};
+        if (segment_count() == 1)
+            return m_segments[m_first].view();
+        bytes_buffer joined(m_coalesced.m_data.get_allocator().resource());
+        joined.reserve(m_size);
+        for_each([&] (bytes_const_view seg) {
+            joined.append(seg);
+        });
+        m_coalesced = std::move(joined);
+        m_segments.clear();
+        m_first = 0;
+        m_segments.push_back({intrusive_ptr<_block>(), m_coalesced.data(), m_coalesced.size()});
+        return m_segments.back().view();
+    }
+
+    //跳过前面 skip 个字节，把剩下的段填进 iovec，填满为止
+    void to_iovecs(io_vectors &vecs, size_t skip = 0) const {
+        for (size_t i = m_first; i < m_segments.size() && !vecs.full(); ++i) {
+            bytes_const_view seg = m_segments[i].view();
+            if (skip >= seg.size()) {
+                skip -= seg.size();
+                continue;
+            }
+            vecs.push(seg.subspan(skip));
+            skip = 0;
+        }
+    }
+
+    //给 readv 准备至少 n 字节的空闲区，读完用 commit 确认实际读到多少
+    void prepare(size_t n, io_vectors &vecs) {
+        m_prepared = m_segments.size();
+        if (size_t room = _tailroom(); room != 0) {
+            m_prepared = m_segments.size() - 1;
+            _segment &seg = m_segments.back();
+            vecs.push(seg.m_data + seg.m_size, room);
+            n -= std::min(n, room);
+        }
+        while (n != 0 && !vecs.full()) {
+            _segment &seg = _new_block_segment();
+            vecs.push(seg.m_data, _block::capacity);
+            n -= std::min(n, _block::capacity);
+        }
+    }
+
+    void commit(size_t n) {
+        for (size_t i = m_prepared; i < m_segments.size() && n != 0; ++i) {
+            _segment &seg = m_segments[i];
+            size_t take = std::min(n, _block::capacity - seg.m_block->m_size);
+            seg.m_size += take;
+            seg.m_block->m_size += take;
+            m_size += take;
+            n -= take;
+        }
+        while (segment_count() != 0 && m_segments.back().m_size == 0) {
+            m_segments.pop_back();
+        }
+        _compact_front();
+    }
+};
+
+//头部读进一块连续的缓冲区，和头部一起读进来的正文也留在这里不再拷贝
+struct http11_request_parser {
+    bytes_buffer m_header;
+    std::pmr::string m_heading_line;
+    string_map m_header_keys;
+    bytes_view m_spare{nullptr, 0};
+    size_t m_header_len = 0;
+    bool m_header_finished = false;
+
+    explicit http11_request_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_header(mr), m_heading_line(mr), m_header_keys(mr) {}
+
+    //只释放容器，内存由外面的 arena 统一回退
+    void reset_state() {
+        m_header.release();
+        _release_storage(m_heading_line);
+        m_header_keys.clear();
+        m_header_len = 0;
+        m_header_finished = 0;
+    }
+
+    //正文结束不需要更多字节
+    [[nodiscared]] bool header_finished() const {
+        return m_header_finished;
+    }
+    
+    void _extract_headers(){
+        std::string_view header = headers_raw();
+        size_t pos = header.find("\r\n");
+        m_heading_line = header.substr(0, pos);
+        // size_t pos = header.find("\r\n", 0, 2);
+        while(pos != std::string::npos){
+            //跳过\r\n
+            pos += 2;
+            //从当前pos往下找
+            size_t next_pos = header.find("\r\n", pos);
+            // size_t next_pos = header.find("\r\n", pos, 2);
+            size_t line_len = std::string::npos;
+            //如果下一行不是结束，line_len获取当前行到下一行的距离
+            if(next_pos != std::string::npos){
+                line_len = next_pos - pos;
+            }
+            std::string_view line = header.substr(pos, line_len);
+            size_t colon = line.find(": ");
+            // size_t colon = line.find(": ", 0, 2);
+            if(colon != std::string::npos){
+                std::pmr::string key(line.substr(0, colon), m_header_keys.get_allocator());
+                //排除": ",注意这里是两个字符
+                std::string_view value = line.substr(colon + 2);
+                //转换成小写
+                std::transform(key.begin(), key.end(), key.begin(), [] (char c){
+                    if('A' <= c && c <= 'Z'){
+                        c += 'a' - 'A';
+                    }
+                    return c;
+                });
+                // if(key == "content_length"){
+                //     content_length = std::stoi(value);
+                // }
+                m_header_keys.insert_or_assign(std::move(key), value);
+            }
+            pos = next_pos;
+        }
+    }
+    
+    //新数据从 old_size 开始，只在新数据附近找头部结束标记
+    void _find_header_end(size_t old_size) {
+        if (m_header_finished)
+            return;
+        std::string_view header = m_header;
+        // size_t header_len = header.find("\r\n\r\n");
+        if (old_size < 4)
+            old_size = 4;
+        old_size -= 4;
+        size_t header_len = header.find("\r\n\r\n", old_size, 4);
+        if(header_len != std::string::npos){
+            m_header_finished = true;
+            m_header_len = header_len;
+            //解析头部中的Content_length字段
+            //http响应不区分大小写，在解析Content_length的时候不能直接find
+            _extract_headers();
+        }
+    }
+
+    void push_chunk(bytes_const_view chunk){
+        size_t old_size = m_header.size();
+        m_header.append(chunk);
+        _find_header_end(old_size);
+    }
+
+    //给 read 直接写入的空闲区
+    bytes_view prepare(size_t n) {
+        m_spare = m_header.prepare(n);
+        return m_spare;
+    }
+
+    void commit(size_t n) {
+        size_t old_size = m_header.size() - m_spare.size();
+        m_header.commit(m_spare, n);
+        m_spare = {nullptr, 0};
+        _find_header_end(old_size);
+    }
+
+    size_t buffered_size() const noexcept {
+        return m_header.size();
+    }
+
+    std::pmr::string &headline() {
+        return m_heading_line;
+    }
+    
+    string_map &headers() {
+        return m_header_keys;
+    }
+    bytes_const_view headers_raw() const {
+        return m_header.subspan(0, m_header_len);
+    }
+
+    //头部之后已经收到的字节
+    std::string_view extra_body() const {
+        if (!m_header_finished)
+            return {};
+        return std::string_view(m_header).substr(m_header_len + 4);
+    }
+    
+};
+
+template<class HeaderParser = http11_request_parser>
+struct _http_base_parser {
+    HeaderParser m_header_parser;
+    iobuf m_body;
+    size_t m_content_length = 0;
+    size_t body_accumulated_size = 0;
+    size_t m_max_header_size = 32 * 1024;
+    size_t m_max_body_size = 8 * 1024 * 1024;
+    int m_error = 0;    // 不为 0 时是拒绝这个请求要用的状态码
+    bool m_body_finished = false;
+    //正文结束不需要更多字节
+
+    explicit _http_base_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource(), memory_account *account = nullptr)
+        : m_header_parser(mr), m_body(mr, account) {}
+
+    void reset_state() {
+        m_body.release();
+        m_header_parser.reset_state();
+        m_content_length = 0;
+        body_accumulated_size = 0;
+        m_error = 0;
+        m_body_finished = false;
+    }
+
+    [[nodiscard]] int error() const noexcept {
+        return m_error;
+    }
+
+    [[nodiscard]] bool header_finished() {
+        return m_header_parser.header_finished();
+    }
+
+    [[nodiscared]] bool request_finished() {
+        return m_body_finished;
+    }
+
+    bytes_const_view m_header_raw() {
+        return m_header_parser.headers_raw();
+    }
+
+    std::pmr::string &headline() {
+        return m_header_parser.headline();
+    }
+
+    string_map &headers() {
+        return m_header_parser.headers();
+    }
+
+    std::string_view _headline_first() {
+        std::string_view line = headline();
+        size_t space = line.find(' ');
+        if(space == std::string::npos){
+            return "";
+        }
+        return line.substr(0, space);
+    }
+
+    std::string_view _headline_second(){
+        std::string_view line = headline();
+        size_t space1 = line.find(' ');
+        if(space1 == std::string::npos){
+            return "";
+        }
+        size_t space2 = line.find(' ', space1 + 1);
+        if(space2 == std::string::npos){
+            return "";
+        }
+        return line.substr(space1 + 1, space2 - space1 - 1);
+    }
+
+    std::string_view _headline_third(){
+        std::string_view line = headline();
+        size_t space1 = line.find(' ');
+        if(space1 == std::string::npos){
+            return "";
+        }
+        size_t space2 = line.find(' ', space1 + 1);
+        if(space2 == std::string::npos){
+            return "";
+        }
+        return line.substr(space2 + 1);
+    }
+
+    iobuf &body() {
+        return m_body;
+    }
+
+    size_t _extract_content_length(){
+        auto& headers = m_header_parser.headers();
+        auto it = headers.find("content-length");
+        if(it == headers.end()){
+            return 0;
+        }
+        size_t len = 0;
+        auto &value = it->second;
+        if (std::from_chars(value.data(), value.data() + value.size(), len).ec != std::errc()) {
+            return 0;
+        }
+        return len;
+    }
+    
+    void _on_body(size_t n) {
+        body_accumulated_size += n;
+        if(body_accumulated_size >= m_content_length){
+            m_body_finished = true;
+            m_body.truncate(m_content_length);
+        }
+    }
+
+    void _on_header_finished() {
+        if (m_header_parser.headers_raw().size() > m_max_header_size) {
+            m_error = 431;
+            return;
+        }
+        m_content_length = _extract_content_length();
+        if (m_content_length > m_max_body_size) {
+            m_error = 413;
+            return;
+        }
+        //和头部一起读进来的正文直接借用头部缓冲区里的内存
+        std::string_view extra = m_header_parser.extra_body();
+        m_body.append_external({extra.data(), extra.size()});
+        _on_body(extra.size());
+    }
+
+    void _on_header_appended() {
+        if(m_header_parser.header_finished()){
+            _on_header_finished();
+        } else if (m_header_parser.buffered_size() > m_max_header_size) {
+            //一直等不到头部结束，不能无限制地攒下去
+            m_error = 431;
+        }
+    }
+
+    void push_chunk(bytes_const_view chunk){
+        assert(!m_body_finished && !m_error);
+        if(m_header_parser.header_finished()){
+            //头部已经结束，收到的是正文的其他部分
+            m_body.append(chunk);
+            _on_body(chunk.size());
+            return;
+        }
+        m_header_parser.push_chunk(chunk);
+        _on_header_appended();
+    }
+
+    //让 read 直接写进解析器的缓冲区：头部阶段是连续缓冲区，正文阶段是 iobuf 末尾的块
+    void prepare(size_t n, io_vectors &vecs) {
+        if(m_header_parser.header_finished()){
+            m_body.prepare(n, vecs);
+        } else {
+            vecs.push(m_header_parser.prepare(n));
+        }
+    }
+
+    void commit(size_t n) {
+        assert(!m_body_finished && !m_error);
+        if(m_header_parser.header_finished()){
+            m_body.commit(n);
+            _on_body(n);
+            return;
+        }
+        m_header_parser.commit(n);
+        _on_header_appended();
+    }
+
+    size_t buffered_size() const noexcept {
+        if(!m_header_parser.header_finished()){
+            return m_header_parser.buffered_size();
+        }
+        return m_header_parser.headers_raw().size() + 4 + body_accumulated_size;
+    }
+
+    iobuf read_some_body() {
+        return m_body.split(m_body.size());
+    }
+};
+
+template<class HeaderParser = http11_request_parser>
+struct http_request_parser : _http_base_parser<HeaderParser>{
+    using _http_base_parser<HeaderParser>::_http_base_parser;
+
+    std::string_view method(){
+        return this->_headline_first();
+    }
+
+    std::string_view url() {
+        return this->_headline_second();
+    }
+
+    std::string_view http_version() {
+        return this->_headline_third();
+    }
+};
+
+template<class HeaderParser = http11_request_parser>
+struct http_response_parser : _http_base_parser<HeaderParser>{
+    using _http_base_parser<HeaderParser>::_http_base_parser;
+
+    std::string_view http_version(){
+        return this->_headline_first();
+    }
+
+    int status() {
+        auto s = this->_headline_second();
+        int status = -1;
+        if (std::from_chars(s.data(), s.data() + s.size(), status).ec != std::errc()) {
+            return -1;
+        }
+        return status;
+    }
+
+    std::string_view status_string() {
+        return this->_headline_third();
+    }
+};
+
+std::string_view http_status_reason(int status) {
+    switch (status) {
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 421: return "Misdirected Request";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+//构造响应
+struct http11_header_writer{
+    bytes_buffer m_buffer;
+
+    explicit http11_header_writer(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_buffer(mr) {}
+
+    void reset_state() {
+        m_buffer.release();
+    }
+
+    bytes_buffer &buffer() {
+        return m_buffer;
+    }
+     void begin_header(std::string_view first, std::string_view second, std::string_view third) {
+        m_buffer.append(first);
+        m_buffer.append_literial(" ");
+        m_buffer.append(second);
+        m_buffer.append_literial(" ");
+        m_buffer.append(third);
+    }
+
+    void write_header(std::string_view key, std::string_view value) {
+        m_buffer.append_literial("\r\n");
+        m_buffer.append(key);
+        m_buffer.append_literial(": ");
+        m_buffer.append(value);
+    }
+
+    void end_header() {
+        m_buffer.append_literial("\r\n\r\n");
+    }
+};
+
+
+//分块传输编码：每块前面是十六进制的长度，后面跟 \r\n
+void http_chunk_begin(iobuf &out, size_t size) {
+    char head[24];
+    auto end = fmt::format_to_n(head, sizeof(head), "{:x}\r\n", size);
+    out.append(bytes_const_view{head, end.size});
+}
+
+void http_chunk_end(iobuf &out) {
+    out.append(std::string_view("\r\n"));
+}
+
+template <class HeaderWriter = http11_header_writer>
+struct _http_base_writer {
+    HeaderWriter m_header_writer;
+    iobuf m_body;
+
+    explicit _http_base_writer(std::pmr::memory_resource *mr = std::pmr::get_default_resource(), memory_account *account = nullptr)
+        : m_header_writer(mr), m_body(mr, account) {}
+
+    void _begin_header(std::string_view first, std::string_view second, std::string_view third) {
+        m_header_writer.begin_header(first, second, third);
+    }
+
+    void reset_state() {
+        m_header_writer.reset_state();
+        m_body.release();
+    }
+
+    bytes_buffer &buffer() {
+        return m_header_writer.buffer();
+    }
+
+    void write_header(std::string_view key, std::string_view value) {
+        m_header_writer.write_header(key, value);
+    }
+
+    void end_header() {
+        m_header_writer.end_header();
+    }
+
+    //正文单独放在 iobuf 里，可以先写正文再写头部
+    void write_body(std::string_view body) {
+        m_body.append(body);
+    }
+
+    //共享 body 的块，不拷贝
+    void write_body(iobuf const &body) {
+        m_body.append(body);
+    }
+
+    //拷进线程内共用的块：一串消息的头和分隔符连着写会并成一段，夹在共享的正文之间不用每段单独开块
+    void write_body_packed(std::string_view body) {
+        m_body.append_packed(body);
+    }
+
+    //引用外面的内存，调用者保证响应写完之前它一直有效
+    void write_body_external(bytes_const_view body) {
+        m_body.append_external(body);
+    }
+
+    iobuf &body() {
+        return m_body;
+    }
+
+    size_t size() {
+        return buffer().size() + m_body.size();
+    }
+
+    //流式响应：不写 Content-length，之后的正文一段段按分块传输编码
+    void begin_chunked() {
+        write_header("Transfer-Encoding", "chunked");
+    }
+
+    void write_chunk(iobuf const &chunk) {
+        http_chunk_begin(m_body, chunk.size());
+        m_body.append(chunk);
+        http_chunk_end(m_body);
+    }
+
+    //跳过已经写出去的 skip 个字节，头部和正文一起交给 writev
+    void to_iovecs(io_vectors &vecs, size_t skip) {
+        bytes_const_view header = buffer();
+        if (skip < header.size()) {
+            vecs.push(header.subspan(skip));
+            skip = 0;
+        } else {
+            skip -= header.size();
+        }
+        m_body.to_iovecs(vecs, skip);
+    }
+};
+
+template <class HeaderWriter = http11_header_writer>
+struct http_request_writer : _http_base_writer<HeaderWriter> {
+    using _http_base_writer<HeaderWriter>::_http_base_writer;
+
+    void begin_header(int status) {
+        this->_begin_header("HTTP/1.1", std::to_string(status), "OK");
+    }
+};
+
+
+template<class HeaderWriter = http11_header_writer>
+struct http_response_writer : _http_base_writer<HeaderWriter>{
+    using _http_base_writer<HeaderWriter>::_http_base_writer;
+
+    void begin_header(int status) {
+        this->_begin_header("HTTP/1.1", std::to_string(status), http_status_reason(status));
+    }
+};
+
+//每个事件循环线程有自己的 epoll
+thread_local int epollfd;
+
+//事件循环的定时器：按到期时间排的小根堆，epoll_wait 的超时取最早的那个
+struct timer_queue {
+    using clock = std::chrono::steady_clock;
+    struct _timer {
+        clock::time_point m_deadline;
+        callback<> m_cb;
+    };
+    std::vector<_timer> m_heap;
+
+    static timer_queue &instance() {
+        static thread_local timer_queue queue;
+        return queue;
+    }
+
+    static bool _later(_timer const &a, _timer const &b) noexcept {
+        return a.m_deadline > b.m_deadline;
+    }
+
+    void add(clock::duration delay, callback<> cb) {
+        m_heap.push_back({clock::now() + delay, std::move(cb)});
+        std::push_heap(m_heap.begin(), m_heap.end(), _later);
+    }
+
+    //没有定时器返回 -1，一直等
+    int timeout_ms() const {
+        if (m_heap.empty())
+            return -1;
+        auto left = m_heap.front().m_deadline - clock::now();
+        if (left <= clock::duration::zero())
+            return 0;
+        return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    }
+
+    void run_expired() {
+        auto now = clock::now();
+        while (!m_heap.empty() && m_heap.front().m_deadline <= now) {
+            std::pop_heap(m_heap.begin(), m_heap.end(), _later);
+            callback<> cb = std::move(m_heap.back().m_cb);
+            m_heap.pop_back();
+            cb();
+        }
+    }
+};
+
+//每个事件循环线程一份：这一轮里有东西要发的连接，一轮处理完再各自整批写一次
+//一轮里投给同一个连接的几十条消息合成一次 writev；flush_delay 大于 0 时再多攒这么久
+//flush_delay 由 --flush-delay 在起线程之前设好，各线程只读
+struct write_batcher {
+    static inline std::chrono::milliseconds flush_delay{0};
+    std::vector<callback<>> m_pending;
+    std::vector<callback<>> m_running;
+    bool m_timer_armed = false;
+
+    static write_batcher &instance() {
+        static thread_local write_batcher batcher;
+        return batcher;
+    }
+
+    void schedule(callback<> flush) {
+        m_pending.push_back(std::move(flush));
+        if (flush_delay != flush_delay.zero() && !m_timer_armed) {
+            m_timer_armed = true;
+            timer_queue::instance().add(flush_delay, [this] {
+                m_timer_armed = false;
+                _run();
+            });
+        }
+    }
+
+    //上一轮写的时候又排进来的，这一轮不能睡
+    bool has_due() const noexcept {
+        return flush_delay == flush_delay.zero() && !m_pending.empty();
+    }
+
+    //一轮结束时调用
+    void run() {
+        if (flush_delay == flush_delay.zero())
+            _run();
+    }
+
+    void _run() {
+        //写的过程中可能又有连接排进来，留到下一轮
+        m_running.swap(m_pending);
+        for (auto &flush : m_running) {
+            flush();
+        }
+        m_running.clear();
+    }
+};
+
+//一次 epoll_wait 拿到的一批事件：前面的回调可能把后面还没轮到的连接关掉
+//关掉时它的分发回调先不释放，记下来，轮到它时跳过，整批处理完再释放，地址也就不会被新的回调重用
+struct event_batch {
+    std::vector<void *> m_cancelled;
+    bool m_dispatching = false;
+
+    static event_batch &instance() {
+        static thread_local event_batch batch;
+        return batch;
+    }
+
+    void cancel(void *armed) {
+        if (!m_dispatching) {
+            callback<>::from_address(armed);
+            return;
+        }
+        m_cancelled.push_back(armed);
+    }
+
+    void dispatch(struct epoll_event const *events, int count) {
+        m_dispatching = true;
+        for (int i = 0; i < count; ++i) {
+            void *armed = events[i].data.ptr;
+            //刚加进 epoll 还没挂回调时也可能报挂断
+            if (!armed || std::find(m_cancelled.begin(), m_cancelled.end(), armed) != m_cancelled.end())
+                continue;
+            auto cb = callback<>::from_address(armed);
+            cb();
+        }
+        m_dispatching = false;
+        for (void *armed : m_cancelled) {
+            callback<>::from_address(armed);
+        }
+        m_cancelled.clear();
+    }
+};
+
+struct async_file {
+    int m_fd = -1;
+    //读和写各自挂一个等待的回调，同一个 fd 可以一边等读一边等写
+    callback<> m_read_waiter;
+    callback<> m_write_waiter;
+    void *m_armed = nullptr;  // 已经交给 epoll 的分发回调
+    async_file() = default;
+    explicit async_file(int fd) : m_fd(fd) {}
+    static async_file async_wrap(int fd) {
+        int flags = CHECK_CALL(fcntl, fd, F_GETFL);
+        flags |= O_NONBLOCK;
+        CHECK_CALL(fcntl, fd, F_SETFL, flags);
+        struct epoll_event event;
+        event.events = EPOLLET;
+        event.data.ptr = nullptr;
+        CHECK_CALL(epoll_ctl, epollfd, EPOLL_CTL_ADD, fd, &event);
+        return async_file{fd};
+    }
+    //对端重置这类错误不抛异常，返回 -1 交给回调当作连接断开处理
+    template <class T>
+    static T _check_io(const char *what, T res) {
+        return check_error<EAGAIN, ECONNRESET, EPIPE>(what, res);
+    }
+    void _arm() {
+        struct epoll_event event;
+        event.events = EPOLLET | EPOLLONESHOT;
+        if (m_read_waiter.m_base)
+            event.events |= EPOLLIN;
+        if (m_write_waiter.m_base)
+            event.events |= EPOLLOUT;
+        if (m_armed == nullptr) {
+            callback<> dispatch = [this] {
+                m_armed = nullptr;
+                //不知道是哪边就绪了，两边都重试一次，没就绪的会再挂回去
+                callback<> on_read = std::move(m_read_waiter);
+                callback<> on_write = std::move(m_write_waiter);
+                if (on_read.m_base)
+                    on_read();
+                //读回调里可能已经把连接关了；写回调还在说明对象还活着，可以看 m_fd
+                if (on_write.m_base && m_fd != -1)
+                    on_write();
+            };
+            m_armed = dispatch.leak_address();
+        }
+        event.data.ptr = m_armed;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, m_fd, &event);
+    }
+    ssize_t sync_read(bytes_view buf) {
+        return CHECK_CALL(read, m_fd, buf.data(), buf.size());
+    }
+    ssize_t sync_write(bytes_const_view buf) {
+        return CHECK_CALL(write, m_fd, buf.data(), buf.size());
+    }
+    int sync_accept(address_resolver::address &addr) {
+        return CHECK_CALL(accept, m_fd, &addr.m_addr, &addr.m_addrlen);
+    }
+    void async_read(bytes_view buf, callback<ssize_t> cb) {
+        ssize_t ret = _check_io(SOURCE_INFO() "read", read(m_fd, buf.data(), buf.size()));
+        if (ret != -1 || errno != EAGAIN) {
+            cb(ret);
+            return;
+        }
+
+        // 如果 read 可以读了，请操作系统，调用，我这个回调
+        m_read_waiter = [this, buf, cb = std::move(cb)] () mutable {
+            return async_read(buf, std::move(cb));
+        };
+        _arm();
+    }
+    //先读进 bufs，放不下的部分落到栈上的溢出区，回调里要当场把溢出部分拷走
+    void async_read_overflow(io_vectors bufs, callback<ssize_t, bytes_const_view> cb) {
+        char overflow[16 * 1024];
+        struct iovec iov[io_vectors::max_count + 1];
+        std::copy_n(bufs.m_iov, bufs.m_count, iov);
+        iov[bufs.m_count] = {overflow, sizeof(overflow)};
+        ssize_t ret = _check_io(SOURCE_INFO() "readv", readv(m_fd, iov, bufs.m_count + 1));
+        if (ret != -1 || errno != EAGAIN) {
+            size_t direct = bufs.total_size();
+            size_t extra = ret > 0 && static_cast<size_t>(ret) > direct ? ret - direct : 0;
+            cb(ret, bytes_const_view{overflow, extra});
+            return;
+        }
+
+        m_read_waiter = [this, bufs, cb = std::move(cb)] () mutable {
+            return async_read_overflow(bufs, std::move(cb));
+        };
+        _arm();
+    }
+    void async_write(bytes_const_view buf, callback<ssize_t> cb) {
+        ssize_t ret = _check_io(SOURCE_INFO() "write", write(m_fd, buf.data(), buf.size()));
+        if (ret != -1 || errno != EAGAIN) {
+            cb(ret);
+            return;
+        }
+        // 如果 write 可以写了，请操作系统，调用，我这个回调
+        m_write_waiter = [this, buf, cb = std::move(cb)] () mutable {
+            return async_write(buf, std::move(cb));
+        };
+        _arm();
+    }
+    //只等可读，不占缓冲区
+    void async_wait_readable(callback<> cb) {
+        m_read_waiter = std::move(cb);
+        _arm();
+    }
+    void async_writev(io_vectors bufs, callback<ssize_t> cb) {
+        ssize_t ret = _check_io(SOURCE_INFO() "writev", writev(m_fd, bufs.m_iov, bufs.m_count));
+        if (ret != -1 || errno != EAGAIN) {
+            cb(ret);
+            return;
+        }
+        m_write_waiter = [this, bufs, cb = std::move(cb)] () mutable {
+            return async_writev(bufs, std::move(cb));
+        };
+        _arm();
+    }
+    void async_accept(address_resolver::address &addr, callback<int> cb) {
+        ssize_t ret = CHECK_CALL_EXCEPT(EAGAIN, accept, m_fd, &addr.m_addr, &addr.m_addrlen);
+        if (ret != -1) {
+            cb(ret);
+            return;
+        }
+        // 如果 accept 到请求了，请操作系统，调用，我这个回调
+        m_read_waiter = [this, &addr, cb = std::move(cb)] () mutable {
+            return async_accept(addr, std::move(cb));
+        };
+        _arm();
+    }
+    //非阻塞连接：马上连上或者出错就直接回调，否则等可写以后取 SO_ERROR；回调的参数是 errno，0 表示连上了
+    void async_connect(address_resolver::address_ref addr, callback<int> cb) {
+        int ret = ::connect(m_fd, addr.m_addr, addr.m_addrlen);
+        if (ret == 0 || errno != EINPROGRESS) {
+            cb(ret == 0 ? 0 : errno);
+            return;
+        }
+        m_write_waiter = [this, cb = std::move(cb)] () mutable {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            cb(err);
+        };
+        _arm();
+    }
+    //有回调在等的时候不能移动：分发回调里记着 this
+    async_file(async_file &&that) noexcept : m_fd(that.m_fd) {
+        assert(that.m_armed == nullptr);
+        that.m_fd = -1;
+    }
+    async_file &operator=(async_file &&that) noexcept {
+        assert(m_armed == nullptr && that.m_armed == nullptr);
+        std::swap(m_fd, that.m_fd);
+        return *this;
+    }
+    //主动关掉连接，挂着的回调也一起丢掉
+    void close_file() {
+        if (m_fd == -1)
+            return;
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, m_fd, nullptr);
+        if (m_armed) {
+            event_batch::instance().cancel(m_armed);
+            m_armed = nullptr;
+        }
+        close(m_fd);
+        m_fd = -1;
+        callback<> on_read = std::move(m_read_waiter);
+        callback<> on_write = std::move(m_write_waiter);
+    }
+    ~async_file() {
+        close_file();
+    }
+};
+
+//每次读多少字节：一次读满了就翻倍，每个请求结束后向实际请求大小靠拢
+struct adaptive_read_size {
+    static constexpr size_t min_size = 512;
+    static constexpr size_t max_size = 256 * 1024;
+    size_t m_size = 1024;
+
+    size_t size() const noexcept {
+        return m_size;
+    }
+
+    void on_read(size_t requested, size_t got) noexcept {
+        if (got >= requested) {
+            m_size = std::min(m_size * 2, max_size);
+        }
+    }
+
+    void on_request(size_t total) noexcept {
+        size_t target = std::clamp(total, min_size, max_size);
+        m_size = std::clamp((m_size * 3 + target) / 4, min_size, max_size);
+    }
+};
+
+//IEEE CRC32，日志恢复时靠它发现只写了一半的记录
+uint32_t crc32(bytes_const_view data, uint32_t crc = 0) {
+    static auto const table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (char ch : data) {
+        crc = table[(crc ^ static_cast<unsigned char>(ch)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+//写日志的线程通过 eventfd 告诉事件循环线程哪些追加已经落盘
+//每个事件循环线程一个，回调只在自己的线程里跑
+//不同房间的记录由不同的线程交给日志，同一个线程的 ticket 不一定按顺序落盘，所以逐个完成
+struct log_mailbox {
+    async_file m_event;
+    uint64_t m_counter = 0;
+    uint64_t m_next_ticket = 0;
+    std::vector<callback<>> m_pending;  // 第 i 个是 ticket m_first_ticket + i，完成了就置空
+    uint64_t m_first_ticket = 1;
+    size_t m_head = 0;                  // 前面的都完成了
+    std::mutex m_mutex;
+    std::vector<uint64_t> m_completed;  // 写线程放进来，本线程取走
+    std::vector<uint64_t> m_running;
+
+    static log_mailbox &instance() {
+        static thread_local log_mailbox mailbox;
+        return mailbox;
+    }
+
+    uint64_t enqueue(callback<> done) {
+        assert(done.m_base);
+        if (m_event.m_fd == -1) {
+            m_event = async_file::async_wrap(CHECK_CALL(eventfd, 0, EFD_CLOEXEC));
+            do_wait();
+        }
+        m_pending.push_back(std::move(done));
+        return ++m_next_ticket;
+    }
+
+    //在写线程里调用
+    void complete(uint64_t const *tickets, size_t n) {
+        bool was_empty;
+        {
+            std::lock_guard lock(m_mutex);
+            was_empty = m_completed.empty();
+            m_completed.insert(m_completed.end(), tickets, tickets + n);
+        }
+        if (was_empty) {
+            uint64_t one = 1;
+            CHECK_CALL(write, m_event.m_fd, &one, sizeof(one));
+        }
+    }
+
+    void do_wait() {
+        return m_event.async_read({reinterpret_cast<char *>(&m_counter), sizeof(m_counter)}, [this] (ssize_t) {
+            _run_completed();
+            return do_wait();
+        });
+    }
+
+    void _run_completed() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_running.swap(m_completed);
+        }
+        std::sort(m_running.begin(), m_running.end());
+        for (uint64_t ticket : m_running) {
+            //回调里可能再 enqueue，m_pending 会变长，每次重新取
+            callback<> done = std::move(m_pending[ticket - m_first_ticket]);
+            done();
+        }
+        m_running.clear();
+        while (m_head < m_pending.size() && !m_pending[m_head].m_base) {
+            ++m_head;
+        }
+        //一直有没完成的也不能无限变长，完成的前缀超过一半就挪掉
+        if (m_head != 0 && m_head * 2 >= m_pending.size()) {
+            m_pending.erase(m_pending.begin(), m_pending.begin() + m_head);
+            m_first_ticket += m_head;
+            m_head = 0;
+        }
+    }
+};
+
+//日志的一个段文件，整个映射进内存，读历史直接从映射里切片
+//写线程往文件末尾写，读的人只看已经落盘的部分；映射一直保留到进程退出，切片可以放心交给 writev
+struct log_segment {
+    //稀疏索引：每个房间每隔 index_interval 条记一个 (序号, 偏移)
+    static constexpr uint64_t index_interval = 64;
+    struct _room_index {
+        std::vector<std::pair<uint64_t, size_t>> m_entries;
+        uint64_t m_first_seq = 0;
+        uint64_t m_last_seq = 0;
+        uint64_t m_count = 0;
+    };
+
+    uint64_t m_number = 0;
+    uint64_t m_base = 0;        // 这个段的开头在整个日志里的位置
+    char *m_map = nullptr;
+    size_t m_map_size = 0;
+    size_t m_durable_size = 0;
+    bool m_sealed = false;      // 写满了，之后不会再变
+    std::unordered_map<uint64_t, _room_index> m_rooms;
+
+    log_segment(uint64_t number, int fd, size_t map_size) : m_number(number), m_map_size(map_size) {
+        void *p = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            check_error(SOURCE_INFO() "mmap", -1);
+        }
+        m_map = static_cast<char *>(p);
+    }
+
+    log_segment(log_segment &&) = delete;
+
+    ~log_segment() {
+        if (m_map)
+            munmap(m_map, m_map_size);
+    }
+
+    void index_record(uint64_t room, uint64_t seq, size_t offset) {
+        _room_index &index = m_rooms[room];
+        if (index.m_count % index_interval == 0) {
+            index.m_entries.emplace_back(seq, offset);
+        }
+        if (index.m_count == 0) {
+            index.m_first_seq = seq;
+        }
+        index.m_last_seq = seq;
+        ++index.m_count;
+    }
+
+    void seal() {
+        m_sealed = true;
+        for (auto &[room, index] : m_rooms) {
+            index.m_entries.shrink_to_fit();
+        }
+        //历史读得少，让内核按需读页，不要预读整段
+        madvise(m_map, m_map_size, MADV_RANDOM);
+    }
+
+    //封上的段把索引存成旁边的 .idx 文件，重启时直接读回来，不用再扫整段
+    //格式：头，每个房间一项，然后所有 (序号, 偏移)；crc 覆盖头后面的全部内容
+    struct _index_file_header {
+        char m_magic[8];
+        uint32_t m_crc;
+        uint32_t m_version;
+        uint64_t m_durable_size;
+        uint64_t m_room_count;
+        uint64_t m_entry_count;
+    };
+    struct _index_file_room {
+        uint64_t m_room;
+        uint64_t m_first_seq;
+        uint64_t m_last_seq;
+        uint64_t m_count;
+        uint64_t m_entry_count;
+    };
+    static constexpr char index_magic[8] = {'C', 'H', 'A', 'T', 'I', 'D', 'X', '1'};
+
+    void save_index(std::string const &path) const {
+        std::vector<char> data(sizeof(_index_file_header));
+        auto put = [&] (auto const &value) {
+            auto const *p = reinterpret_cast<char const *>(&value);
+            data.insert(data.end(), p, p + sizeof(value));
+        };
+        uint64_t entry_count = 0;
+        for (auto const &[room, index] : m_rooms) {
+            put(_index_file_room{room, index.m_first_seq, index.m_last_seq, index.m_count, index.m_entries.size()});
+            entry_count += index.m_entries.size();
+        }
+        for (auto const &[room, index] : m_rooms) {
+            for (auto const &[seq, offset] : index.m_entries) {
+                put(seq);
+                put(static_cast<uint64_t>(offset));
+            }
+        }
+        _index_file_header header{};
+        memcpy(header.m_magic, index_magic, sizeof(index_magic));
+        header.m_version = 1;
+        header.m_durable_size = m_durable_size;
+        header.m_room_count = m_rooms.size();
+        header.m_entry_count = entry_count;
+        header.m_crc = crc32({data.data() + sizeof(header), data.size() - sizeof(header)});
+        memcpy(data.data(), &header, sizeof(header));
+        int fd = CHECK_CALL(::open, path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        for (size_t done = 0; done < data.size();) {
+            done += CHECK_CALL(write, fd, data.data() + done, data.size() - done);
+        }
+        CHECK_CALL(fdatasync, fd);
+        close(fd);
+    }
+
+    //索引文件不存在、损坏或者和段的大小对不上都返回 false，调用者退回去扫段
+    bool load_index(std::string const &path, size_t segment_size) {
+        int fd = CHECK_CALL_EXCEPT(ENOENT, ::open, path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+        std::vector<char> data(CHECK_CALL(lseek, fd, 0, SEEK_END));
+        for (size_t done = 0; done < data.size();) {
+            done += CHECK_CALL(pread, fd, data.data() + done, data.size() - done, done);
+        }
+        close(fd);
+        _index_file_header header;
+        if (data.size() < sizeof(header))
+            return false;
+        memcpy(&header, data.data(), sizeof(header));
+        size_t expected = sizeof(header) + header.m_room_count * sizeof(_index_file_room) + header.m_entry_count * 2 * sizeof(uint64_t);
+        if (memcmp(header.m_magic, index_magic, sizeof(index_magic)) != 0 || header.m_version != 1
+            || header.m_durable_size != segment_size || data.size() != expected
+            || header.m_crc != crc32({data.data() + sizeof(header), data.size() - sizeof(header)}))
+            return false;
+        char const *rooms = data.data() + sizeof(header);
+        char const *entries = rooms + header.m_room_count * sizeof(_index_file_room);
+        for (uint64_t i = 0; i < header.m_room_count; ++i) {
+            _index_file_room item;
+            memcpy(&item, rooms + i * sizeof(item), sizeof(item));
+            _room_index &index = m_rooms[item.m_room];
+            index.m_first_seq = item.m_first_seq;
+            index.m_last_seq = item.m_last_seq;
+            index.m_count = item.m_count;
+            index.m_entries.resize(item.m_entry_count);
+            for (auto &[seq, offset] : index.m_entries) {
+                uint64_t pair[2];
+                memcpy(pair, entries, sizeof(pair));
+                entries += sizeof(pair);
+                seq = pair[0];
+                offset = pair[1];
+            }
+        }
+        m_durable_size = segment_size;
+        return true;
+    }
+};
+
+//只追加的消息日志，由一个专门的线程写盘
+//事件循环线程把记录拷进待写缓冲区就返回，写线程每轮把攒下的整批一次 write 加一次 fdatasync
+//不用额外等一个时间窗口：上一批 fdatasync 的时候新来的记录自然攒成下一批，负载越高批越大
+//fdatasync 失败没法补救，直接抛异常结束进程
+struct message_log {
+    //日志里每条记录：固定的头，后面跟正文；crc 覆盖房间、序号和正文
+    struct record_header {
+        uint32_t m_size;
+        uint32_t m_crc;
+        uint64_t m_room;
+        uint64_t m_seq;
+    };
+    static constexpr size_t segment_limit = 64 * 1024 * 1024;
+
+    std::string m_dir;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<char> m_pending;    // 下一批要写的记录
+    std::vector<std::pair<log_mailbox *, uint64_t>> m_pending_acks;  // 这一批里每条记录落盘后要完成的 ticket
+    bool m_stopping = false;
+    std::thread m_thread;
+    int m_fd = -1;
+    uint64_t m_appended = 0;    // 交给写线程的总字节数，也就是下一条记录在整个日志里的位置
+    uint64_t m_durable = 0;     // 落了盘、进了段索引的位置，拿 m_mutex 读写
+    std::condition_variable m_durable_cv;   // m_durable 往前走了
+    //段和索引只有写线程改，改的时候拿写锁；读历史拿读锁
+    std::shared_mutex m_index_mutex;
+    std::vector<std::unique_ptr<log_segment>> m_segments;
+
+    static message_log &instance() {
+        static message_log log;
+        return log;
+    }
+
+    bool enabled() const noexcept {
+        return m_thread.joinable();
+    }
+
+    log_segment &_active() {
+        return *m_segments.back();
+    }
+
+    std::string _segment_path(uint64_t segment) const {
+        return fmt::format("{}/{:08}.log", m_dir, segment);
+    }
+
+    std::string _index_path(uint64_t segment) const {
+        return fmt::format("{}/{:08}.idx", m_dir, segment);
+    }
+
+    static uint32_t _record_crc(record_header const &header, bytes_const_view body) {
+        uint32_t crc = crc32({reinterpret_cast<char const *>(&header.m_room), sizeof(header.m_room) + sizeof(header.m_seq)});
+        return crc32(body, crc);
+    }
+
+    //按顺序读出所有段里的记录交给 on_record(room, seq, body)，同时建索引，然后启动写线程
+    //日志位置在 from 之前的记录已经在快照里了，只建索引，不交给 on_record
+    //封上的段如果整段都在 from 之前、旁边又有完好的 .idx，就直接读索引，不扫段
+    //最后一段末尾不完整或者校验不对的记录是崩溃时写了一半的，截掉
+    template <class F>
+    void open(std::string dir, uint64_t from, F &&on_record) {
+        m_dir = std::move(dir);
+        CHECK_CALL_EXCEPT(EEXIST, mkdir, m_dir.c_str(), 0755);
+        std::vector<int> fds;
+        while (true) {
+            int fd = CHECK_CALL_EXCEPT(ENOENT, ::open, _segment_path(fds.size()).c_str(), O_RDWR | O_CLOEXEC);
+            if (fd == -1)
+                break;
+            fds.push_back(fd);
+        }
+        uint64_t base = 0;
+        for (uint64_t number = 0; number < fds.size(); ++number) {
+            int fd = fds[number];
+            bool last = number + 1 == fds.size();
+            size_t file_size = CHECK_CALL(lseek, fd, 0, SEEK_END);
+            auto &segment = *m_segments.emplace_back(std::make_unique<log_segment>(number, fd, std::max(file_size, segment_limit)));
+            segment.m_base = base;
+            if (last || base + file_size > from || !segment.load_index(_index_path(number), file_size)) {
+                size_t pos = 0;
+                while (pos + sizeof(record_header) <= file_size) {
+                    record_header header;
+                    memcpy(&header, segment.m_map + pos, sizeof(header));
+                    if (pos + sizeof(header) + header.m_size > file_size)
+                        break;
+                    bytes_const_view body{segment.m_map + pos + sizeof(header), header.m_size};
+                    //快照之前的记录当时已经落盘确认过，只有后面的才可能是写了一半的
+                    if (base + pos >= from) {
+                        if (_record_crc(header, body) != header.m_crc)
+                            break;
+                        on_record(header.m_room, header.m_seq, body);
+                    }
+                    segment.index_record(header.m_room, header.m_seq, pos);
+                    pos += sizeof(header) + header.m_size;
+                }
+                //前一段的记录都落了盘才开新段，只有最后一段会有写了一半的尾巴
+                //封好的段坏了，截掉会让后面每一段的位置都错开，快照和搜索索引记的位置全对不上，宁可不启动
+                if (pos != file_size && !last) {
+                    throw std::system_error(std::make_error_code(std::errc::io_error),
+                        fmt::format("日志段 {} 在 {} 字节处损坏，后面还有段", number, pos));
+                }
+                if (pos != file_size) {
+                    fmt::println("日志段 {} 末尾有 {} 字节不完整，截掉", number, file_size - pos);
+                    CHECK_CALL(ftruncate, fd, pos);
+                }
+                segment.m_durable_size = pos;
+                if (!last) {
+                    segment.save_index(_index_path(number));
+                }
+            }
+            if (last) {
+                m_fd = fd;
+            } else {
+                segment.seal();
+                close(fd);
+            }
+            base += segment.m_durable_size;
+        }
+        m_appended = base;
+        m_durable = base;
+        if (m_fd == -1) {
+            _open_segment(0);
+        }
+        CHECK_CALL(lseek, m_fd, _active().m_durable_size, SEEK_SET);
+        m_thread = std::thread([this] {
+            _run();
+        });
+    }
+
+    //在写线程里调用
+    void _open_segment(uint64_t number) {
+        int fd = CHECK_CALL(::open, _segment_path(number).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        //新文件的目录项也要落盘，不然崩溃后整个段可能找不到
+        int dirfd = CHECK_CALL(::open, m_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        CHECK_CALL(fsync, dirfd);
+        close(dirfd);
+        auto segment = std::make_unique<log_segment>(number, fd, segment_limit);
+        if (m_fd != -1) {
+            //索引只有写线程改，存文件不用拿锁
+            _active().save_index(_index_path(_active().m_number));
+            segment->m_base = _active().m_base + _active().m_durable_size;
+        }
+        std::unique_lock lock(m_index_mutex);
+        if (m_fd != -1) {
+            _active().seal();
+            close(m_fd);
+        }
+        m_fd = fd;
+        m_segments.push_back(std::move(segment));
+    }
+
+    //在房间的所有者线程里调用：记录拷进待写缓冲区，落盘后通知 mailbox 完成 ticket，mailbox 为空就不通知
+    void append(uint64_t room, uint64_t seq, bytes_const_view body, log_mailbox *mailbox, uint64_t ticket) {
+        record_header header{static_cast<uint32_t>(body.size()), 0, room, seq};
+        header.m_crc = _record_crc(header, body);
+        std::lock_guard lock(m_mutex);
+        bool was_empty = m_pending.empty();
+        size_t pos = m_pending.size();
+        m_pending.resize(pos + sizeof(header) + body.size());
+        memcpy(m_pending.data() + pos, &header, sizeof(header));
+        memcpy(m_pending.data() + pos + sizeof(header), body.data(), body.size());
+        if (mailbox) {
+            m_pending_acks.emplace_back(mailbox, ticket);
+        }
+        m_appended += sizeof(header) + body.size();
+        if (was_empty) {
+            m_cv.notify_one();
+        }
+    }
+
+    //不写记录，之前交给写线程的记录都落盘以后完成 ticket
+    void append_barrier(log_mailbox *mailbox, uint64_t ticket) {
+        std::lock_guard lock(m_mutex);
+        bool was_empty = m_pending.empty() && m_pending_acks.empty();
+        m_pending_acks.emplace_back(mailbox, ticket);
+        if (was_empty) {
+            m_cv.notify_one();
+        }
+    }
+
+    void _run() {
+        std::vector<char> batch;
+        std::vector<std::pair<log_mailbox *, uint64_t>> acks;
+        std::vector<uint64_t> tickets;
+        std::unique_lock lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [this] {
+                return !m_pending.empty() || !m_pending_acks.empty() || m_stopping;
+            });
+            if (m_pending.empty() && m_pending_acks.empty()) {
+                break;
+            }
+            batch.swap(m_pending);
+            acks.swap(m_pending_acks);
+            lock.unlock();
+            //只有 append_barrier 的一批不用写，上一批已经落盘了
+            if (!batch.empty()) {
+                //一批不拆到两个段里；段满了先封上再开新段
+                size_t start = _active().m_durable_size;
+                if (start != 0 && start + batch.size() > segment_limit) {
+                    _open_segment(_active().m_number + 1);
+                    start = 0;
+                }
+                for (size_t done = 0; done < batch.size();) {
+                    done += CHECK_CALL(write, m_fd, batch.data() + done, batch.size() - done);
+                }
+                CHECK_CALL(fdatasync, m_fd);
+                _index_batch(batch, start);
+            }
+            uint64_t durable = _active().m_base + _active().m_durable_size;
+            //同一个 mailbox 的 ticket 凑在一起，一次唤醒
+            std::sort(acks.begin(), acks.end());
+            for (size_t i = 0, j = 0; i < acks.size(); i = j) {
+                tickets.clear();
+                for (j = i; j < acks.size() && acks[j].first == acks[i].first; ++j) {
+                    tickets.push_back(acks[j].second);
+                }
+                acks[i].first->complete(tickets.data(), tickets.size());
+            }
+            batch.clear();
+            acks.clear();
+            lock.lock();
+            if (durable != m_durable) {
+                m_durable = durable;
+                m_durable_cv.notify_all();
+            }
+        }
+    }
+
+    //落盘以后才把这一批记进索引，读的人就只会看到落了盘的记录
+    void _index_batch(std::vector<char> const &batch, size_t start) {
+        std::unique_lock lock(m_index_mutex);
+        log_segment &segment = _active();
+        if (start + batch.size() > segment.m_map_size) {
+            //一批比整个段还大，原来的映射装不下，重新映射
+            auto bigger = std::make_unique<log_segment>(segment.m_number, m_fd, start + batch.size());
+            bigger->m_base = segment.m_base;
+            bigger->m_rooms = std::move(segment.m_rooms);
+            //旧的映射可能还被正在发送的切片引用，留着不释放
+            segment.m_rooms.clear();
+            segment.m_map_size = 0;
+            segment.m_map = nullptr;
+            m_segments.back() = std::move(bigger);
+        }
+        log_segment &active = _active();
+        for (size_t pos = 0; pos < batch.size();) {
+            record_header header;
+            memcpy(&header, batch.data() + pos, sizeof(header));
+            active.index_record(header.m_room, header.m_seq, start + pos);
+            pos += sizeof(header) + header.m_size;
+        }
+        active.m_durable_size = start + batch.size();
+    }
+
+    //房间 room 序号在 (after, before) 之间的最多 limit 条，按序号交给 f(seq, body)
+    //每段里一次二分找到起点，然后顺着往后扫；body 指向映射的文件，不拷贝
+    template <class F>
+    size_t read_range(uint64_t room, uint64_t after, uint64_t before, size_t limit, F &&f) {
+        std::shared_lock lock(m_index_mutex);
+        size_t count = 0;
+        for (auto &segment : m_segments) {
+            auto it = segment->m_rooms.find(room);
+            if (it == segment->m_rooms.end())
+                continue;
+            auto const &index = it->second;
+            if (index.m_last_seq <= after)
+                continue;
+            if (index.m_first_seq >= before || count == limit)
+                break;
+            auto entry = std::upper_bound(index.m_entries.begin(), index.m_entries.end(), after + 1, [] (uint64_t seq, auto const &e) {
+                return seq < e.first;
+            });
+            if (entry != index.m_entries.begin())
+                --entry;
+            size_t pos = entry->second;
+            while (pos < segment->m_durable_size && count < limit) {
+                record_header header;
+                memcpy(&header, segment->m_map + pos, sizeof(header));
+                if (header.m_room == room) {
+                    if (header.m_seq >= before)
+                        return count;
+                    if (header.m_seq > after) {
+                        f(header.m_seq, bytes_const_view{segment->m_map + pos + sizeof(header), header.m_size});
+                        ++count;
+                    }
+                    if (header.m_seq == index.m_last_seq)
+                        break;
+                }
+                pos += sizeof(header) + header.m_size;
+            }
+        }
+        return count;
+    }
+
+    //等到落了盘的位置超过 position 再返回它；stop 变成真以后要调 wake_durable_waiters 叫醒
+    uint64_t wait_durable(uint64_t position, std::atomic<bool> const &stop) {
+        std::unique_lock lock(m_mutex);
+        m_durable_cv.wait(lock, [&] {
+            return m_durable > position || m_stopping || stop.load(std::memory_order_acquire);
+        });
+        return m_durable;
+    }
+
+    void wake_durable_waiters() {
+        std::lock_guard lock(m_mutex);
+        m_durable_cv.notify_all();
+    }
+
+    //从日志位置 position 起按顺序把落了盘的记录交给 f(room, seq, body)，最多 max_records 条，返回读到的位置
+    //body 指向映射的文件；拿着段的读锁，f 里不要做太久
+    template <class F>
+    uint64_t read_records(uint64_t position, size_t max_records, F &&f) {
+        std::shared_lock lock(m_index_mutex);
+        for (auto &segment : m_segments) {
+            uint64_t end = segment->m_base + segment->m_durable_size;
+            while (position < end && max_records != 0) {
+                size_t pos = position - segment->m_base;
+                record_header header;
+                memcpy(&header, segment->m_map + pos, sizeof(header));
+                f(header.m_room, header.m_seq, bytes_const_view{segment->m_map + pos + sizeof(header), header.m_size});
+                position += sizeof(header) + header.m_size;
+                --max_records;
+            }
+            if (max_records == 0)
+                break;
+        }
+        return position;
+    }
+
+    //倒数第 n 个段开头的位置，段不够 n 个就是 0
+    uint64_t segment_start_from_end(size_t n) {
+        std::shared_lock lock(m_index_mutex);
+        return m_segments.size() > n ? m_segments[m_segments.size() - n]->m_base : 0;
+    }
+
+    //在这之前交给 append 的记录都在这个位置之前，快照记下它，重启时从这里开始回放
+    uint64_t durable_position() {
+        std::lock_guard lock(m_mutex);
+        return m_durable;
+    }
+
+    uint64_t appended_position() {
+        std::lock_guard lock(m_mutex);
+        return m_appended;
+    }
+
+    //日志里这个房间最早的序号，没有返回 0
+    uint64_t first_seq(uint64_t room) {
+        std::shared_lock lock(m_index_mutex);
+        for (auto &segment : m_segments) {
+            auto it = segment->m_rooms.find(room);
+            if (it != segment->m_rooms.end())
+                return it->second.m_first_seq;
+        }
+        return 0;
+    }
+
+    //写完还没落盘的记录再退出
+    void stop() {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cv.notify_one();
+        m_durable_cv.notify_all();
+        m_thread.join();
+    }
+
+    ~message_log() {
+        stop();
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+    }
+};
+
+//搜索用的分词：ASCII 的字母数字连成一个词，转成小写；别的字符（中文之类）每个字单独算一个词，相邻两个字再算一个词
+//查询时一串字只用两两相连的词，"你好吗" 查的是 "你好" 和 "好吗"；只有一个字时才用单字
+template <class F>
+void search_tokenize(std::string_view text, bool query, F &&f) {
+    static constexpr size_t max_word_size = 64;
+    auto is_alnum = [] (unsigned char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    };
+    //全角和中文的标点、空格不算字
+    auto is_separator = [] (uint32_t code) {
+        return (code >= 0x2000 && code <= 0x206F) || (code >= 0x3000 && code <= 0x303F)
+            || (code >= 0xFF00 && code <= 0xFF0F) || (code >= 0xFF1A && code <= 0xFF20);
+    };
+    std::string term;
+    std::string_view prev;
+    size_t run = 0;
+    auto end_run = [&] {
+        if (query && run == 1)
+            f(std::string_view(prev));
+        prev = {};
+        run = 0;
+    };
+    size_t i = 0;
+    while (i < text.size()) {
+        auto c = static_cast<unsigned char>(text[i]);
+        if (c < 0x80) {
+            end_run();
+            if (!is_alnum(c)) {
+                ++i;
+                continue;
+            }
+            term.clear();
+            for (; i < text.size() && is_alnum(c = static_cast<unsigned char>(text[i])); ++i) {
+                if (term.size() < max_word_size)
+                    term.push_back(static_cast<char>(c >= 'A' && c <= 'Z' ? c + 32 : c));
+            }
+            f(std::string_view(term));
+            continue;
+        }
+        size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        if (i + len > text.size())
+            break;
+        uint32_t code = len == 1 ? c : c & (0x7F >> len);
+        for (size_t k = 1; k < len; ++k) {
+            code = code << 6 | (static_cast<unsigned char>(text[i + k]) & 0x3F);
+        }
+        std::string_view ch = text.substr(i, len);
+        i += len;
+        if (len == 1 || is_separator(code)) {
+            end_run();
+            continue;
+        }
+        if (!query)
+            f(ch);
+        if (!prev.empty()) {
+            term.assign(prev);
+            term.append(ch);
+            f(std::string_view(term));
+        }
+        prev = ch;
+        ++run;
+    }
+    end_run();
+}
+
+//一个词在一个房间里出现过的消息序号，升序；存的是和前一个的差，LEB128 变长编码，聊天消息密的时候差多半一个字节
+//每 block_size 个开一块，块表里记块前一个序号和块的字节偏移，求交集时按块跳，不用从头解；太旧的整块可以丢掉
+struct posting_list {
+    static constexpr size_t block_size = 128;
+
+    std::vector<uint8_t> m_bytes;
+    std::vector<std::pair<uint64_t, uint32_t>> m_blocks;
+    uint64_t m_last = 0;
+    uint32_t m_count = 0;
+
+    //序号只会往后加；一条消息里同一个词出现好几次只记一次
+    bool add(uint64_t seq) {
+        if (m_count != 0 && seq <= m_last)
+            return false;
+        if (m_count % block_size == 0)
+            m_blocks.push_back({m_last, static_cast<uint32_t>(m_bytes.size())});
+        uint64_t delta = seq - m_last;
+        while (delta >= 0x80) {
+            m_bytes.push_back(static_cast<uint8_t>(delta | 0x80));
+            delta >>= 7;
+        }
+        m_bytes.push_back(static_cast<uint8_t>(delta));
+        m_last = seq;
+        ++m_count;
+        return true;
+    }
+
+    //把第 block 块解到 out 里，返回个数
+    //连着 8 个字节都没有续位，就是 8 个一字节的差，读成一个 64 位字一起判断、一起累加
+    size_t decode(size_t block, uint64_t *out) const {
+        uint8_t const *p = m_bytes.data() + m_blocks[block].second;
+        size_t n = std::min<size_t>(block_size, m_count - block * block_size);
+        uint64_t value = m_blocks[block].first;
+        size_t i = 0;
+        while (i < n) {
+            //后面还有 8 个数，就至少还有 8 个字节，读 8 个字节不会越界
+            if (n - i >= 8) {
+                uint64_t word;
+                memcpy(&word, p, 8);
+                if ((word & 0x8080808080808080ull) == 0) {
+                    for (int k = 0; k < 8; ++k) {
+                        value += (word >> (k * 8)) & 0xFF;
+                        out[i++] = value;
+                    }
+                    p += 8;
+                    continue;
+                }
+            }
+            uint64_t delta = 0;
+            int shift = 0;
+            do {
+                delta |= uint64_t(*p & 0x7F) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+            value += delta;
+            out[i++] = value;
+        }
+        return n;
+    }
+
+    //seq 可能在的块：最后一个块前序号比 seq 小的块；表是空的返回 m_blocks.size()
+    size_t block_of(uint64_t seq) const {
+        auto it = std::lower_bound(m_blocks.begin(), m_blocks.end(), seq, [] (auto const &block, uint64_t t) {
+            return block.first < t;
+        });
+        return it == m_blocks.begin() ? m_blocks.size() : static_cast<size_t>(it - m_blocks.begin()) - 1;
+    }
+
+    //内存里实际占的字节数，算在索引的总字节数里
+    size_t memory() const noexcept {
+        return m_bytes.capacity() + m_blocks.capacity() * sizeof(m_blocks[0]);
+    }
+
+    //丢掉全都小于 seq 的整块，丢了几个序号就返回几；留下的第一块前面可能还有比 seq 小的
+    size_t drop_before(uint64_t seq) {
+        size_t blocks = 0;
+        while (blocks + 1 < m_blocks.size() && m_blocks[blocks + 1].first < seq)
+            ++blocks;
+        if (blocks == 0)
+            return 0;
+        uint32_t offset = m_blocks[blocks].second;
+        m_bytes.erase(m_bytes.begin(), m_bytes.begin() + offset);
+        m_blocks.erase(m_blocks.begin(), m_blocks.begin() + blocks);
+        for (auto &block : m_blocks) {
+            block.second -= offset;
+        }
+        m_bytes.shrink_to_fit();
+        m_blocks.shrink_to_fit();
+        m_count -= static_cast<uint32_t>(blocks * block_size);
+        return blocks * block_size;
+    }
+
+    //倒着查一串序号在不在表里：序号越查越小，块也只往前退，解过的块不用再解
+    struct probe {
+        posting_list const *m_list;
+        size_t m_block;
+        size_t m_size = 0;
+        uint64_t m_values[block_size];
+
+        explicit probe(posting_list const &list) : m_list(&list), m_block(list.m_blocks.size()) {}
+
+        bool contains(uint64_t seq) {
+            size_t block = m_list->block_of(seq);
+            if (block == m_list->m_blocks.size())
+                return false;
+            if (block != m_block) {
+                m_size = m_list->decode(block, m_values);
+                m_block = block;
+            }
+            return std::binary_search(m_values, m_values + m_size, seq);
+        }
+    };
+};
+
+//全文索引：后台线程跟着日志落盘的位置往后读，把每条消息分词后加进所在房间的倒排表
+//索引只在内存里，启动时只从最后 rebuild_segments 个段建，不读整个日志；日志里有什么就能搜到什么，日志之外的（别的节点的房间）搜不到
+//总字节数有上限，算在全局内存账上；超了就把占得最多的房间较旧的一半丢掉，房间记下索引从哪个序号开始
+struct search_index {
+    static constexpr size_t chunk_records = 1024;   // 一次读这么多条再拿写锁加进去，搜索不会被饿着
+    static constexpr size_t rebuild_segments = 2;
+    static constexpr size_t max_bytes = 128 * 1024 * 1024;   // 也不超过全局内存预算的四分之一
+    static constexpr size_t max_candidates = 4096;  // 一页最多看领头的表里这么多个序号，搜索在事件循环里跑，不能太久
+    //一个词的表在房间的散列表里除了表本身还占多少：节点、桶、词
+    static constexpr size_t term_overhead = sizeof(std::pair<std::string const, posting_list>) + 2 * sizeof(void *);
+
+    struct stats {
+        uint64_t m_indexed;
+        uint64_t m_durable;
+        uint64_t m_messages;
+        uint64_t m_terms;
+        uint64_t m_postings;
+        uint64_t m_bytes;
+        uint64_t m_evictions;
+    };
+
+    struct _room {
+        std::unordered_map<std::string, posting_list> m_terms;
+        uint64_t m_first_seq = 0;   // 比它早的消息不在索引里：启动时没从头建，或者超了上限丢掉了
+        uint64_t m_last_seq = 0;
+        size_t m_bytes = 0;
+    };
+
+    std::shared_mutex m_mutex;
+    std::unordered_map<uint64_t, _room> m_rooms;
+    uint64_t m_messages = 0;
+    uint64_t m_terms = 0;
+    uint64_t m_postings = 0;
+    uint64_t m_bytes = 0;
+    uint64_t m_evictions = 0;
+    std::atomic<uint64_t> m_indexed{0};     // 日志里这个位置之前的记录都进了索引
+    std::atomic<bool> m_stopping{false};
+    std::thread m_thread;
+
+    //一条消息的词先攒在 terms 里，读完一批、放开日志的锁以后再加进倒排表
+    struct pending {
+        uint64_t m_room;
+        uint64_t m_seq;
+        size_t m_end;   // 这条消息的词在 terms 里的结尾
+    };
+
+    static search_index &instance() {
+        static search_index index;
+        return index;
+    }
+
+    void start() {
+        uint64_t from = message_log::instance().segment_start_from_end(rebuild_segments);
+        m_indexed.store(from, std::memory_order_release);
+        m_thread = std::thread([this, from] {
+            _run(from);
+        });
+    }
+
+    void _run(uint64_t position) {
+        auto &log = message_log::instance();
+        std::vector<pending> batch;
+        std::vector<std::string> terms;
+        size_t used = 0;
+        while (!m_stopping.load(std::memory_order_acquire)) {
+            uint64_t durable = log.wait_durable(position, m_stopping);
+            while (position < durable && !m_stopping.load(std::memory_order_acquire)) {
+                batch.clear();
+                used = 0;
+                position = log.read_records(position, chunk_records, [&] (uint64_t room, uint64_t seq, bytes_const_view body) {
+                    size_t begin = used;
+                    search_tokenize(std::string_view(body.data(), body.size()), false, [&] (std::string_view term) {
+                        if (used == terms.size())
+                            terms.emplace_back();
+                        terms[used++].assign(term);
+                    });
+                    //同一条消息里重复的词去掉，加进倒排表时就只用比最后一个
+                    std::sort(terms.begin() + begin, terms.begin() + used);
+                    used = std::unique(terms.begin() + begin, terms.begin() + used) - terms.begin();
+                    batch.push_back({room, seq, used});
+                });
+                _add(batch, terms);
+                m_indexed.store(position, std::memory_order_release);
+            }
+        }
+    }
+
+    void _add(std::vector<pending> const &batch, std::vector<std::string> const &terms) {
+        std::unique_lock lock(m_mutex);
+        size_t begin = 0;
+        size_t before = m_bytes;
+        for (auto const &item : batch) {
+            auto &room = m_rooms[item.m_room];
+            if (room.m_first_seq == 0)
+                room.m_first_seq = item.m_seq;
+            room.m_last_seq = item.m_seq;
+            for (size_t i = begin; i < item.m_end; ++i) {
+                auto [it, inserted] = room.m_terms.try_emplace(terms[i]);
+                size_t size = it->second.memory();
+                if (it->second.add(item.m_seq))
+                    ++m_postings;
+                size_t grown = it->second.memory() - size + (inserted ? term_overhead + terms[i].capacity() : 0);
+                room.m_bytes += grown;
+                m_bytes += grown;
+                m_terms += inserted;
+            }
+            begin = item.m_end;
+            ++m_messages;
+        }
+        //全局预算设得很小的时候索引最多占四分之一，别让它把连接的读都停了
+        size_t limit = std::min(max_bytes, memory_stats::global().m_limit / 4);
+        while (m_bytes > limit && _evict())
+            ;
+        if (m_bytes > before) {
+            memory_stats::global().charge(m_bytes - before);
+        } else {
+            memory_stats::global().uncharge(before - m_bytes);
+        }
+    }
+
+    //占得最多的房间丢掉较旧的一半，只剩一条的房间整个丢掉；丢不动了返回 false
+    bool _evict() {
+        auto largest = std::max_element(m_rooms.begin(), m_rooms.end(), [] (auto const &a, auto const &b) {
+            return a.second.m_bytes < b.second.m_bytes;
+        });
+        if (largest == m_rooms.end())
+            return false;
+        ++m_evictions;
+        auto &room = largest->second;
+        uint64_t cut = room.m_first_seq + (room.m_last_seq - room.m_first_seq) / 2 + 1;
+        if (room.m_first_seq == room.m_last_seq) {
+            for (auto const &[term, list] : room.m_terms) {
+                m_postings -= list.m_count;
+            }
+            m_terms -= room.m_terms.size();
+            m_bytes -= room.m_bytes;
+            m_rooms.erase(largest);
+            return true;
+        }
+        size_t bytes = 0;
+        for (auto it = room.m_terms.begin(); it != room.m_terms.end();) {
+            auto &list = it->second;
+            if (list.m_last < cut) {
+                m_postings -= list.m_count;
+                --m_terms;
+                it = room.m_terms.erase(it);
+                continue;
+            }
+            m_postings -= list.drop_before(cut);
+            bytes += list.memory() + term_overhead + it->first.capacity();
+            ++it;
+        }
+        m_bytes -= room.m_bytes - bytes;
+        room.m_bytes = bytes;
+        room.m_first_seq = cut;
+        return true;
+    }
+
+    //房间里同时含有查询里所有词的消息，序号小于 before 的最多 limit 条，从新到旧
+    //最短的表领头，从 before 所在的块起倒着一块块解，别的表用 probe 查在不在；更早的块不用碰
+    //一页最多看 max_candidates 个领头的序号；next_before 不是 0 就是还有更早的，拿它当 before 接着翻
+    //first_seq 是这个房间索引里最早的序号，比它早的搜不到
+    std::vector<uint64_t> search(uint64_t room, std::string_view query, uint64_t before, size_t limit, uint64_t &next_before, uint64_t &first_seq) {
+        std::vector<std::string> terms;
+        search_tokenize(query, true, [&] (std::string_view term) {
+            terms.emplace_back(term);
+        });
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        std::vector<uint64_t> found;
+        next_before = 0;
+        first_seq = 0;
+        if (terms.empty() || limit == 0)
+            return found;
+        std::shared_lock lock(m_mutex);
+        auto room_it = m_rooms.find(room);
+        if (room_it == m_rooms.end())
+            return found;
+        first_seq = room_it->second.m_first_seq;
+        std::vector<posting_list const *> lists;
+        for (auto const &term : terms) {
+            auto it = room_it->second.m_terms.find(term);
+            if (it == room_it->second.m_terms.end())
+                return found;
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [] (auto a, auto b) {
+            return a->m_count < b->m_count;
+        });
+        std::vector<posting_list::probe> probes;
+        probes.reserve(lists.size() - 1);
+        for (size_t i = 1; i < lists.size(); ++i) {
+            probes.emplace_back(*lists[i]);
+        }
+        auto const &lead = *lists[0];
+        uint64_t values[posting_list::block_size];
+        size_t candidates = 0;
+        for (size_t block = lead.block_of(before); block < lead.m_blocks.size(); --block) {
+            size_t n = lead.decode(block, values);
+            for (size_t i = n; i-- > 0;) {
+                uint64_t seq = values[i];
+                if (seq >= before)
+                    continue;
+                if (seq < first_seq)
+                    return found;
+                if (candidates++ == max_candidates) {
+                    next_before = seq + 1;
+                    return found;
+                }
+                bool all = std::all_of(probes.begin(), probes.end(), [seq] (auto &p) {
+                    return p.contains(seq);
+                });
+                if (!all)
+                    continue;
+                //多找一个，找到了说明更早的还有
+                if (found.size() == limit) {
+                    next_before = found.back();
+                    return found;
+                }
+                found.push_back(seq);
+            }
+        }
+        return found;
+    }
+
+    stats get_stats() {
+        std::shared_lock lock(m_mutex);
+        return {m_indexed.load(std::memory_order_acquire), message_log::instance().durable_position(), m_messages, m_terms, m_postings, m_bytes, m_evictions};
+    }
+
+    ~search_index() {
+        if (!m_thread.joinable())
+            return;
+        m_stopping.store(true, std::memory_order_release);
+        message_log::instance().wake_durable_waiters();
+        m_thread.join();
+    }
+};
+
+//WebSocket 握手要用的 SHA-1，只对很短的字符串算一次，不求快
+std::array<unsigned char, 20> sha1(std::string_view data) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    auto rol = [] (uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    };
+    std::string msg(data);
+    uint64_t bit_len = static_cast<uint64_t>(data.size()) * 8;
+    msg.push_back(static_cast<char>(0x80));
+    while (msg.size() % 64 != 56) {
+        msg.push_back(0);
+    }
+    for (int i = 7; i >= 0; --i) {
+        msg.push_back(static_cast<char>(bit_len >> (i * 8)));
+    }
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        auto const *p = reinterpret_cast<unsigned char const *>(msg.data() + chunk);
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = uint32_t(p[i * 4]) << 24 | uint32_t(p[i * 4 + 1]) << 16 | uint32_t(p[i * 4 + 2]) << 8 | p[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    std::array<unsigned char, 20> digest;
+    for (int i = 0; i < 20; ++i) {
+        digest[i] = static_cast<unsigned char>(h[i / 4] >> (24 - (i % 4) * 8));
+    }
+    return digest;
+}
+
+std::string base64_encode(bytes_const_view data) {
+    static constexpr char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    auto const *p = reinterpret_cast<unsigned char const *>(data.data());
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        uint32_t v = uint32_t(p[i]) << 16 | uint32_t(p[i + 1]) << 8 | p[i + 2];
+        out.push_back(table[v >> 18 & 63]);
+        out.push_back(table[v >> 12 & 63]);
+        out.push_back(table[v >> 6 & 63]);
+        out.push_back(table[v & 63]);
+    }
+    if (i < data.size()) {
+        uint32_t v = uint32_t(p[i]) << 16;
+        if (i + 1 < data.size())
+            v |= uint32_t(p[i + 1]) << 8;
+        out.push_back(table[v >> 18 & 63]);
+        out.push_back(table[v >> 12 & 63]);
+        out.push_back(i + 1 < data.size() ? table[v >> 6 & 63] : '=');
+        out.push_back('=');
+    }
+    return out;
+}
+
+//在逗号分隔的头部值里找某个词，不区分大小写，比如 Connection: keep-alive, Upgrade
+bool http_header_has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && item.front() == ' ')
+            item.remove_prefix(1);
+        while (!item.empty() && item.back() == ' ')
+            item.remove_suffix(1);
+        if (item.size() == token.size() && std::equal(item.begin(), item.end(), token.begin(), [] (char a, char b) {
+                return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+            })) {
+            return true;
+        }
+        if (comma == std::string_view::npos)
+            break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+std::string websocket_accept_key(std::string_view key) {
+    std::string text(key);
+    text += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    auto digest = sha1(text);
+    return base64_encode({reinterpret_cast<char const *>(digest.data()), digest.size()});
+}
+
+enum class websocket_opcode : uint8_t {
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xA,
+};
+
+//客户端发来的帧都带 4 字节掩码，逐字节异或；有 SIMD 时一次处理 16/32 字节
+void websocket_unmask(char *data, size_t size, char const *mask) {
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i mask256 = _mm256_set1_epi32(static_cast<int>(mask32));
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), _mm256_xor_si256(v, mask256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i mask128 = _mm_set1_epi32(static_cast<int>(mask32));
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(v, mask128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<uint8_t const *>(data + i));
+        vst1q_u8(reinterpret_cast<uint8_t *>(data + i), veorq_u8(v, mask128));
+    }
+#endif
+    uint64_t mask64 = uint64_t(mask32) << 32 | mask32;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= mask64;
+        memcpy(data + i, &v, 8);
+    }
+    for (; i < size; ++i) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+//文本消息必须是合法的 UTF-8：不许过长编码、代理区和超过 U+10FFFF 的码点
+//聊天消息多半是 ASCII，一次看 8 个字节都没有高位就整段跳过
+bool utf8_valid(std::string_view text) {
+    auto const *p = reinterpret_cast<unsigned char const *>(text.data());
+    size_t n = text.size(), i = 0;
+    while (i < n) {
+        if (i + 8 <= n) {
+            uint64_t word;
+            memcpy(&word, p + i, 8);
+            if ((word & 0x8080808080808080ull) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        unsigned char c = p[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t len;
+        uint32_t code, min;
+        if ((c & 0xE0) == 0xC0) {
+            len = 2, code = c & 0x1F, min = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            len = 3, code = c & 0x0F, min = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            len = 4, code = c & 0x07, min = 0x10000;
+        } else {
+            return false;
+        }
+        if (i + len > n)
+            return false;
+        for (size_t k = 1; k < len; ++k) {
+            if ((p[i + k] & 0xC0) != 0x80)
+                return false;
+            code = code << 6 | (p[i + k] & 0x3F);
+        }
+        if (code < min || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+            return false;
+        i += len;
+    }
+    return true;
+}
+
+//对方关闭帧里的状态码能不能原样回：1004~1006、1015 和没登记的保留段都不许出现在帧里
+bool websocket_close_code_valid(uint16_t code) {
+    if (code >= 3000 && code <= 4999)
+        return true;
+    return code >= 1000 && code <= 1014 && code != 1004 && code != 1005 && code != 1006;
+}
+
+//服务端发出的帧不带掩码，返回帧头的长度
+size_t websocket_frame_header(char (&out)[10], websocket_opcode opcode, size_t payload_size, bool fin = true) {
+    out[0] = static_cast<char>((fin ? 0x80 : 0) | static_cast<uint8_t>(opcode));
+    if (payload_size < 126) {
+        out[1] = static_cast<char>(payload_size);
+        return 2;
+    }
+    if (payload_size <= 0xFFFF) {
+        out[1] = 126;
+        out[2] = static_cast<char>(payload_size >> 8);
+        out[3] = static_cast<char>(payload_size);
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; ++i) {
+        out[2 + i] = static_cast<char>(static_cast<uint64_t>(payload_size) >> (56 - i * 8));
+    }
+    return 10;
+}
+
+struct websocket_frame {
+    bool m_fin;
+    websocket_opcode m_opcode;
+    bytes_const_view m_payload;
+};
+
+//增量解析客户端发来的帧，载荷原地去掉掩码
+struct websocket_frame_parser {
+    bytes_buffer m_buffer;
+    size_t m_pos = 0;   // 前面已经解析完的字节
+    bytes_view m_spare{nullptr, 0};
+    size_t m_max_frame_size = 1024 * 1024;
+    uint16_t m_error = 0;   // 不为 0 时是关闭连接要用的状态码
+
+    explicit websocket_frame_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_buffer(mr) {}
+
+    void reset_state() {
+        m_buffer.release();
+        m_pos = 0;
+        m_error = 0;
+    }
+
+    [[nodiscard]] uint16_t error() const noexcept {
+        return m_error;
+    }
+
+    bool empty() const noexcept {
+        return m_pos == m_buffer.size();
+    }
+
+    bytes_view prepare(size_t n) {
+        m_spare = m_buffer.prepare(n);
+        return m_spare;
+    }
+
+    void commit(size_t n) {
+        m_buffer.commit(m_spare, n);
+        m_spare = {nullptr, 0};
+    }
+
+    void push_chunk(bytes_const_view chunk) {
+        m_buffer.append(chunk);
+    }
+
+    //解析完的部分丢掉，剩下的半个帧挪到开头
+    void discard_consumed() {
+        if (m_pos == m_buffer.size()) {
+            m_buffer.clear();
+        } else if (m_pos != 0) {
+            m_buffer.m_data.erase(m_buffer.m_data.begin(), m_buffer.m_data.begin() + m_pos);
+        }
+        m_pos = 0;
+    }
+
+    //攒够一个完整的帧才返回 true
+    bool next_frame(websocket_frame &frame) {
+        if (m_error)
+            return false;
+        size_t avail = m_buffer.size() - m_pos;
+        auto const *p = reinterpret_cast<unsigned char const *>(m_buffer.data() + m_pos);
+        if (avail < 2)
+            return false;
+        bool fin = p[0] & 0x80;
+        auto opcode = static_cast<websocket_opcode>(p[0] & 0x0F);
+        bool masked = p[1] & 0x80;
+        uint64_t len = p[1] & 0x7F;
+        size_t header_len = 2;
+        if (len == 126) {
+            if (avail < 4)
+                return false;
+            len = uint64_t(p[2]) << 8 | p[3];
+            header_len = 4;
+        } else if (len == 127) {
+            if (avail < 10)
+                return false;
+            len = 0;
+            for (int i = 0; i < 8; ++i) {
+                len = len << 8 | p[2 + i];
+            }
+            header_len = 10;
+        }
+        if ((p[0] & 0x70) != 0 || !masked) {
+            //没有协商扩展，RSV 必须是 0；客户端的帧必须带掩码
+            m_error = 1002;
+            return false;
+        }
+        bool control = static_cast<uint8_t>(opcode) & 0x08;
+        if (control && (!fin || len > 125)) {
+            m_error = 1002;
+            return false;
+        }
+        if (len > m_max_frame_size) {
+            m_error = 1009;
+            return false;
+        }
+        header_len += 4;
+        if (avail < header_len + len)
+            return false;
+        char *payload = m_buffer.data() + m_pos + header_len;
+        websocket_unmask(payload, len, payload - 4);
+        frame = {fin, opcode, {payload, static_cast<size_t>(len)}};
+        m_pos += header_len + len;
+        return true;
+    }
+};
+
+//移动端用的二进制协议，单独一个端口：每帧是固定 24 字节的头加载荷，整数都是小端
+//客户端发 join/leave/send/history/ping，服务端回 joined/left/ack/pong/error，房间的消息是 message
+//history 帧的 m_seq 是要取的条数；message 和 ack 帧的 m_seq 是消息序号
+//hello 的载荷是客户端的名字，之后 send 帧的 m_seq 不是 0 就是客户端的消息号，重试时按它去重
+//hello 的 m_seq 选发送队列满了怎么办：1 丢最早的（默认），2 每个房间只留最新的，3 断开
+//error 帧的房间是 0 表示协议出错、连接要断开；不是 0 是那个房间的 send 被拒了（比如限流）
+//presence 和 ephemeral_batch 是不定序的通知，m_seq 总是 0，载荷和 WebSocket 上 "presence <房间> " 这样的前缀后面的部分一样
+enum class binary_opcode : uint8_t {
+    join = 1,
+    leave = 2,
+    send = 3,
+    history = 4,
+    ping = 5,
+    hello = 6,
+    node_hello = 7,     // 集群里别的节点连过来，这条连接是节点之间的链路
+    ephemeral = 8,      // 载荷是 "<种类> <值>"，只留最新的，定时合并广播
+    message = 0x81,
+    ack = 0x82,
+    joined = 0x83,
+    left = 0x84,
+    pong = 0x85,
+    presence = 0x86,        // "<人数> +进来的 -离开的"
+    ephemeral_batch = 0x87, // 每行 "<用户> <种类> <值>"
+    error = 0xFF,
+};
+
+struct binary_frame_header {
+    uint32_t m_size;    // 载荷的字节数，不算头
+    binary_opcode m_opcode;
+    binary_opcode m_answers;    // error 帧回的是哪种请求，节点的链路靠它认出哪个 error 是发布的；别的帧是 0
+    uint8_t m_reserved[2];
+    uint64_t m_room;
+    uint64_t m_seq;
+};
+static_assert(sizeof(binary_frame_header) == 24);
+//头直接 memcpy 进出，只支持小端的机器
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+binary_frame_header binary_frame_header_of(binary_opcode opcode, uint64_t room, uint64_t seq, size_t payload_size) {
+    binary_frame_header header{};
+    header.m_size = static_cast<uint32_t>(payload_size);
+    header.m_opcode = opcode;
+    header.m_room = room;
+    header.m_seq = seq;
+    return header;
+}
+
+struct binary_frame {
+    binary_frame_header m_header;
+    bytes_const_view m_payload;     // 指着解析缓冲区，下一次读之前有效
+};
+
+//增量解析，一次读进来的数据里有几帧就解析几帧，载荷不拷贝
+struct binary_frame_parser {
+    bytes_buffer m_buffer;
+    size_t m_pos = 0;   // 前面已经解析完的字节
+    bytes_view m_spare{nullptr, 0};
+    size_t m_max_frame_size = 1024 * 1024;
+    bool m_error = false;
+
+    explicit binary_frame_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_buffer(mr) {}
+
+    void reset_state() {
+        m_buffer.release();
+        m_pos = 0;
+        m_error = false;
+    }
+
+    [[nodiscard]] bool error() const noexcept {
+        return m_error;
+    }
+
+    bool empty() const noexcept {
+        return m_pos == m_buffer.size();
+    }
+
+    //至少留出 n 字节；头已经到了的半个帧，剩下的部分一次读进来
+    //容量不够时本来就要重新分配、整个拷一遍，这时才顺便把半个帧挪到开头，前面解析完的不跟着拷
+    bytes_view prepare(size_t n) {
+        n = std::max(n, missing());
+        if (m_pos != 0 && m_buffer.m_data.capacity() < m_buffer.size() + n) {
+            m_buffer.m_data.erase(m_buffer.m_data.begin(), m_buffer.m_data.begin() + m_pos);
+            m_pos = 0;
+        }
+        m_spare = m_buffer.prepare(n);
+        return m_spare;
+    }
+
+    void commit(size_t n) {
+        m_buffer.commit(m_spare, n);
+        m_spare = {nullptr, 0};
+    }
+
+    void push_chunk(bytes_const_view chunk) {
+        m_buffer.append(chunk);
+    }
+
+    //全部解析完才清空；剩下半个帧就留在原地，接着往它后面读，不挪
+    void discard_consumed() {
+        if (m_pos == m_buffer.size()) {
+            m_buffer.clear();
+            m_pos = 0;
+        }
+    }
+
+    //半个帧还差多少字节，头还没到齐的算 0
+    size_t missing() const noexcept {
+        size_t avail = m_buffer.size() - m_pos;
+        if (avail < sizeof(binary_frame_header))
+            return 0;
+        uint32_t size;
+        memcpy(&size, m_buffer.data() + m_pos, sizeof(size));
+        if (size > m_max_frame_size)
+            return 0;
+        size_t total = sizeof(binary_frame_header) + size;
+        return avail < total ? total - avail : 0;
+    }
+
+    //攒够一个完整的帧才返回 true
+    bool next_frame(binary_frame &frame) {
+        if (m_error)
+            return false;
+        size_t avail = m_buffer.size() - m_pos;
+        if (avail < sizeof(binary_frame_header))
+            return false;
+        memcpy(&frame.m_header, m_buffer.data() + m_pos, sizeof(binary_frame_header));
+        if (frame.m_header.m_size > m_max_frame_size) {
+            m_error = true;
+            return false;
+        }
+        if (avail < sizeof(binary_frame_header) + frame.m_header.m_size)
+            return false;
+        frame.m_payload = {m_buffer.data() + m_pos + sizeof(binary_frame_header), frame.m_header.m_size};
+        m_pos += sizeof(binary_frame_header) + frame.m_header.m_size;
+        return true;
+    }
+};
+
+bool parse_uint64(std::string_view text, uint64_t &id) {
+    auto res = std::from_chars(text.data(), text.data() + text.size(), id);
+    return res.ec == std::errc() && res.ptr == text.data() + text.size() && !text.empty();
+}
+
+//把请求目标拆成路径和 ? 后面的查询串
+std::string_view http_split_query(std::string_view target, std::string_view &query) {
+    size_t mark = target.find('?');
+    query = mark == std::string_view::npos ? std::string_view() : target.substr(mark + 1);
+    return target.substr(0, mark);
+}
+
+//在查询串里找 key=值，没有返回 false
+bool http_query_value(std::string_view query, std::string_view key, std::string_view &value) {
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view item = query.substr(0, amp);
+        if (item.size() > key.size() && item.substr(0, key.size()) == key && item[key.size()] == '=') {
+            value = item.substr(key.size() + 1);
+            return true;
+        }
+        if (amp == std::string_view::npos)
+            break;
+        query.remove_prefix(amp + 1);
+    }
+    return false;
+}
+
+//在查询串里找 key=数字，没有或者不是数字返回 false
+bool http_query_uint64(std::string_view query, std::string_view key, uint64_t &value) {
+    std::string_view text;
+    return http_query_value(query, key, text) && parse_uint64(text, value);
+}
+
+//查询串里的值：%XX 换回字节，+ 换成空格；不成对的 % 原样留着
+std::string http_url_decode(std::string_view text) {
+    auto hex = [] (char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    };
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '+') {
+            out.push_back(' ');
+        } else if (text[i] == '%' && i + 2 < text.size() && hex(text[i + 1]) >= 0 && hex(text[i + 2]) >= 0) {
+            out.push_back(static_cast<char>(hex(text[i + 1]) << 4 | hex(text[i + 2])));
+            i += 2;
+        } else {
+            out.push_back(text[i]);
+        }
+    }
+    return out;
+}
+
+//路由里参数段取到的值，按在模式里出现的顺序放；整数段已经解析好了
+struct http_route_params {
+    static constexpr size_t max_params = 4;
+
+    std::string_view m_texts[max_params];
+    uint64_t m_numbers[max_params] = {};
+    size_t m_count = 0;
+
+    uint64_t number(size_t i) const noexcept {
+        return m_numbers[i];
+    }
+
+    std::string_view text(size_t i) const noexcept {
+        return m_texts[i];
+    }
+};
+
+//路由表：方法 + 路径 -> 处理函数，启动时注册好，之后只读
+//路径存在压缩前缀树里：静态的部分按公共前缀合成一条边，{名字:int}、{名字:slug} 是参数段，匹配到下一个 / 为止
+//一个节点下静态的边先试，配不上再试参数；查找只在 string_view 上走，参数放在定长数组里，不分配内存
+template <class Handler>
+struct http_router {
+    using handler_type = void (*)(Handler &, http_route_params const &, std::string_view query);
+
+    enum class param_kind : uint8_t {
+        integer,    // 十进制的 64 位无符号数
+        slug,       // 字母、数字、- _ . 和 UTF-8 的多字节字符
+    };
+
+    struct _node {
+        std::string m_prefix;
+        std::string m_first;        // 每个静态子节点前缀的第一个字节，和 m_children 一一对应，查的时候扫它
+        std::vector<std::unique_ptr<_node>> m_children;
+        std::unique_ptr<_node> m_param;
+        param_kind m_kind = param_kind::slug;
+        std::vector<std::tuple<std::string, handler_type, uint32_t>> m_handlers;   // 方法 -> 处理函数、注册时给的标记
+        std::string m_allow;        // 注册过的方法用 ", " 连起来，回 405 时放进 Allow 头
+    };
+
+    struct match {
+        handler_type m_handler = nullptr;
+        uint32_t m_tag = 0;         // 注册时给的标记，处理之前要区别对待的路由用它认
+        bool m_path_found = false;  // 路径配上了但是没有这个方法，该回 405
+        std::string_view m_allow;   // 路径配上了时这个路径允许的方法
+    };
+
+    _node m_root;
+
+    //模式形如 /rooms/{room:int}/messages；同一个位置上的参数类型要一致，重复注册同一个方法抛 invalid_argument
+    void add(std::string_view method, std::string_view pattern, handler_type handler, uint32_t tag = 0) {
+        _node *node = &m_root;
+        size_t params = 0;
+        while (!pattern.empty()) {
+            if (pattern[0] == '{') {
+                size_t close = pattern.find('}');
+                if (close == std::string_view::npos || ++params > http_route_params::max_params)
+                    throw std::invalid_argument(std::string(pattern));
+                std::string_view spec = pattern.substr(1, close - 1);
+                size_t colon = spec.find(':');
+                std::string_view type = colon == std::string_view::npos ? "slug" : spec.substr(colon + 1);
+                if (type != "int" && type != "slug")
+                    throw std::invalid_argument(std::string(spec));
+                param_kind kind = type == "int" ? param_kind::integer : param_kind::slug;
+                if (!node->m_param) {
+                    node->m_param = std::make_unique<_node>();
+                    node->m_param->m_kind = kind;
+                } else if (node->m_param->m_kind != kind) {
+                    throw std::invalid_argument(std::string(spec));
+                }
+                node = node->m_param.get();
+                pattern.remove_prefix(close + 1);
+                continue;
+            }
+            std::string_view part = pattern.substr(0, pattern.find('{'));
+            node = _insert_static(*node, part);
+            pattern.remove_prefix(part.size());
+        }
+        for (auto const &[m, h, t] : node->m_handlers) {
+            if (m == method)
+                throw std::invalid_argument(std::string(method));
+        }
+        node->m_handlers.emplace_back(method, handler, tag);
+        if (!node->m_allow.empty())
+            node->m_allow += ", ";
+        node->m_allow += method;
+    }
+
+    //沿着公共前缀往下走，边只配上一部分就从中间劈开
+    static _node *_insert_static(_node &node, std::string_view part) {
+        _node *current = &node;
+        while (!part.empty()) {
+            size_t i = current->m_first.find(part[0]);
+            if (i == std::string::npos) {
+                auto child = std::make_unique<_node>();
+                child->m_prefix = part;
+                current->m_first.push_back(part[0]);
+                current->m_children.push_back(std::move(child));
+                return current->m_children.back().get();
+            }
+            _node *child = current->m_children[i].get();
+            size_t common = 0;
+            while (common < part.size() && common < child->m_prefix.size() && part[common] == child->m_prefix[common]) {
+                ++common;
+            }
+            if (common < child->m_prefix.size()) {
+                auto middle = std::make_unique<_node>();
+                middle->m_prefix = child->m_prefix.substr(0, common);
+                child->m_prefix.erase(0, common);
+                middle->m_first.push_back(child->m_prefix[0]);
+                middle->m_children.push_back(std::move(current->m_children[i]));
+                current->m_children[i] = std::move(middle);
+                child = current->m_children[i].get();
+            }
+            current = child;
+            part.remove_prefix(common);
+        }
+        return current;
+    }
+
+    static bool _accept(param_kind kind, std::string_view segment, uint64_t &number) {
+        if (segment.empty())
+            return false;
+        if (kind == param_kind::integer)
+            return parse_uint64(segment, number);
+        return std::all_of(segment.begin(), segment.end(), [] (char ch) {
+            auto c = static_cast<unsigned char>(ch);
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' || c >= 0x80;
+        });
+    }
+
+    //配上的节点，没有返回空；参数配上了后面却走不通时把它退掉再试别的
+    static _node const *_find(_node const &node, std::string_view path, http_route_params &params) {
+        if (path.empty())
+            return node.m_handlers.empty() ? nullptr : &node;
+        size_t i = node.m_first.find(path[0]);
+        if (i != std::string::npos) {
+            _node const &child = *node.m_children[i];
+            if (path.substr(0, child.m_prefix.size()) == child.m_prefix) {
+                if (_node const *found = _find(child, path.substr(child.m_prefix.size()), params))
+                    return found;
+            }
+        }
+        if (node.m_param && params.m_count < http_route_params::max_params) {
+            size_t end = std::min(path.find('/'), path.size());
+            std::string_view segment = path.substr(0, end);
+            size_t slot = params.m_count;
+            if (_accept(node.m_param->m_kind, segment, params.m_numbers[slot])) {
+                params.m_texts[slot] = segment;
+                params.m_count = slot + 1;
+                if (_node const *found = _find(*node.m_param, path.substr(end), params))
+                    return found;
+                params.m_count = slot;
+            }
+        }
+        return nullptr;
+    }
+
+    match find(std::string_view method, std::string_view path, http_route_params &params) const {
+        match result;
+        params.m_count = 0;
+        _node const *node = _find(m_root, path, params);
+        if (!node)
+            return result;
+        result.m_path_found = true;
+        result.m_allow = node->m_allow;
+        for (auto const &[m, h, t] : node->m_handlers) {
+            if (m == method) {
+                result.m_handler = h;
+                result.m_tag = t;
+                break;
+            }
+        }
+        return result;
+    }
+};
+
+//令牌桶限流：按客户端地址、客户端身份、房间各记一个桶，所有线程共用一张开放寻址表
+//每个槽是两个原子量：键，和桶的状态（上次补充的毫秒数 + 剩下的令牌），一起放在 16 字节里
+//令牌不用定时补，取的时候按粗粒度时钟算经过的时间补上；快路径只有一次 CAS，不加锁
+struct rate_limiter {
+    enum kind : uint64_t {
+        by_address = 1,
+        by_client = 2,
+        by_room = 3,
+    };
+    struct limit {
+        uint64_t m_rate;    // 每秒补多少个
+        uint64_t m_burst;   // 最多攒多少个
+    };
+    static constexpr size_t slot_count = size_t(1) << 16;
+    static constexpr size_t max_probe = 16;
+    static constexpr uint64_t token_unit = 1000;    // 令牌按千分之一个记，每毫秒补 m_rate 个单位
+    static constexpr int token_bits = 24;
+
+    struct alignas(16) _slot {
+        std::atomic<uint64_t> m_key{0};
+        std::atomic<uint64_t> m_state{0};   // 高 40 位是毫秒，低 24 位是令牌；全 0 就是攒满了
+    };
+
+    std::unique_ptr<_slot[]> m_slots{new _slot[slot_count]};
+    limit m_limits[4] = {{0, 0}, {1000, 2000}, {100, 200}, {1000, 2000}};  // 按 kind 下标；m_burst 乘 token_unit 要放得进 token_bits 位
+    bool m_enabled = true;  // --rate-limit off 关掉，压测用
+
+    static rate_limiter &instance() {
+        static rate_limiter limiter;
+        return limiter;
+    }
+
+    //CLOCK_MONOTONIC_COARSE 走 vDSO，比 steady_clock 便宜，精度几毫秒够用了
+    static uint64_t _now_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec) / 1000000;
+    }
+
+    static uint64_t _key(kind k, uint64_t id) {
+        uint64_t key = (id ^ (static_cast<uint64_t>(k) << 56)) * 0x9E3779B97F4A7C15ull;
+        return key == 0 ? 1 : key;
+    }
+
+    //按经过的时间补满以后剩多少
+    uint64_t _tokens(limit const &lim, uint64_t state, uint64_t now) const {
+        uint64_t last = state >> token_bits;
+        uint64_t tokens = state & ((uint64_t(1) << token_bits) - 1);
+        if (now > last)
+            tokens = std::min(lim.m_burst * token_unit, tokens + (now - last) * lim.m_rate);
+        return tokens;
+    }
+
+    //找这个键的槽：先找已有的，没有就占一个空槽，或者占一个早就攒满了的槽（它的状态和新桶一样）
+    //表满了返回空，调用的放行，宁可少限也不误伤
+    _slot *_find(limit const &lim, uint64_t key, uint64_t now) {
+        size_t start = static_cast<size_t>(key >> 48);
+        for (size_t i = 0; i < max_probe; ++i) {
+            _slot &slot = m_slots[(start + i) & (slot_count - 1)];
+            uint64_t found = slot.m_key.load(std::memory_order_relaxed);
+            if (found == key)
+                return &slot;
+            if (found == 0)
+                break;
+        }
+        for (size_t i = 0; i < max_probe; ++i) {
+            _slot &slot = m_slots[(start + i) & (slot_count - 1)];
+            uint64_t found = slot.m_key.load(std::memory_order_relaxed);
+            if (found == key)
+                return &slot;
+            bool idle = found == 0 || _tokens(lim, slot.m_state.load(std::memory_order_relaxed), now) == lim.m_burst * token_unit;
+            if (idle && (slot.m_key.compare_exchange_strong(found, key, std::memory_order_relaxed) || found == key))
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    //取一个令牌，没有了返回 false
+    bool admit(kind k, uint64_t id) {
+        if (!m_enabled)
+            return true;
+        limit const &lim = m_limits[k];
+        uint64_t now = _now_ms();
+        _slot *slot = _find(lim, _key(k, id), now);
+        if (!slot)
+            return true;
+        uint64_t state = slot->m_state.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t tokens = _tokens(lim, state, now);
+            if (tokens < token_unit)
+                return false;
+            uint64_t next = std::max(now, state >> token_bits) << token_bits | (tokens - token_unit);
+            if (slot->m_state.compare_exchange_weak(state, next, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    //发布要过三个桶：连接的地址、客户端身份（有的话）、房间
+    bool admit_publish(uint64_t peer, uint64_t client, uint64_t room) {
+        return admit(by_address, peer) && (client == 0 || admit(by_client, client)) && admit(by_room, room);
+    }
+
+    //连接的对端地址折成一个键，IPv4 取地址本身，IPv6 取前 64 位（一般是一个子网）
+    static uint64_t peer_key(address_resolver::address const &addr) {
+        if (addr.m_addr.sa_family == AF_INET) {
+            auto const &in = reinterpret_cast<struct sockaddr_in const &>(addr.m_addr_storage);
+            return in.sin_addr.s_addr;
+        }
+        if (addr.m_addr.sa_family == AF_INET6) {
+            auto const &in6 = reinterpret_cast<struct sockaddr_in6 const &>(addr.m_addr_storage);
+            uint64_t prefix;
+            memcpy(&prefix, in6.sin6_addr.s6_addr, sizeof(prefix));
+            return prefix;
+        }
+        return 0;
+    }
+};
+
+//不进历史、序号是 0 的通知，和房间里定了序的消息分开发：各有自己的 WebSocket 动词、二进制操作码和 SSE 事件名
+enum class notice_kind : uint8_t {
+    none,       // 不是通知，是定了序的消息
+    presence,   // 在线状态的变化
+    ephemeral,  // 一个周期里合并的短命事件
+};
+
+inline std::string_view notice_name(notice_kind kind) {
+    switch (kind) {
+    case notice_kind::presence: return "presence";
+    case notice_kind::ephemeral: return "ephemeral";
+    default: return "message";
+    }
+}
+
+//房间里的一条消息在一个线程里的编码，线程收到时编码一次，之后只读
+//这个线程里所有订阅者的输出队列共享同一批块，不再逐个拷贝
+struct room_message : ref_counted<room_message> {
+    uint64_t m_room = 0;
+    uint64_t m_seq = 0;
+    notice_kind m_notice = notice_kind::none;
+    uint32_t m_origin = 0;      // 通知最早是在哪个节点上发的，节点之间转的时候不再转回去
+    iobuf m_body;
+    iobuf m_websocket;  // 编码好的 WebSocket 文本帧："message <房间> <序号> <正文>"，通知是 "<动词> <房间> <正文>"；正文的块和 m_body 共享
+    mutable iobuf m_event_stream;   // SSE 的编码，第一次有 SSE 订阅者要时才生成
+    mutable iobuf m_binary;         // 二进制协议的 message 帧，第一次有二进制订阅者要时才生成
+    using pointer = intrusive_ptr<room_message>;
+    using const_pointer = intrusive_ptr<room_message const>;
+
+    static void _destroy(room_message *p) {
+        for (iobuf *buf : {&p->m_body, &p->m_websocket, &p->m_event_stream, &p->m_binary}) {
+            buf->clear();
+            buf->m_account = nullptr;
+        }
+        p->m_notice = notice_kind::none;
+        p->m_origin = 0;
+        object_pool<room_message>::instance().release(p);
+    }
+
+    //帧头写进共用块，正文共享 m_body 的块
+    iobuf const &binary_frame() const {
+        if (!m_binary.empty())
+            return m_binary;
+        auto opcode = m_notice == notice_kind::presence ? binary_opcode::presence
+            : m_notice == notice_kind::ephemeral ? binary_opcode::ephemeral_batch : binary_opcode::message;
+        auto header = binary_frame_header_of(opcode, m_room, m_seq, m_body.size());
+        m_binary.append_packed(bytes_const_view{reinterpret_cast<char const *>(&header), sizeof(header)});
+        m_binary.append(m_body);
+        return m_binary;
+    }
+
+    //一个完整的分块：id 一行，正文每一行前面加 data:，空行结尾
+    iobuf const &event_stream_chunk() const {
+        if (!m_event_stream.empty())
+            return m_event_stream;
+        //通知不带 id，客户端重连时不会拿它当断点；用 event: 和房间的消息分开
+        char id[40];
+        size_t id_size = m_notice != notice_kind::none ? fmt::format_to_n(id, sizeof(id), "event: {}\n", notice_name(m_notice)).size
+            : m_seq == 0 ? 0 : fmt::format_to_n(id, sizeof(id), "id: {}\n", m_seq).size;
+        //\r\n、\r、\n 都算换行，一律换成 \n 再接 data:，正文里单独的 \r 不能拿来伪造 id: 或者 event: 这样的字段
+        //先数一遍算出分块长度，再同样走一遍写出来
+        std::string_view data = "data: ";
+        auto split = [&] (auto &&on_text, auto &&on_break) {
+            bool after_cr = false;
+            m_body.for_each([&] (bytes_const_view chunk) {
+                size_t start = 0;
+                for (size_t i = 0; i < chunk.size(); ++i) {
+                    char c = chunk.data()[i];
+                    if (c != '\r' && c != '\n')
+                        continue;
+                    if (i != start) {
+                        on_text(chunk.subspan(start, i - start));
+                        after_cr = false;
+                    }
+                    start = i + 1;
+                    if (c == '\n' && after_cr) {
+                        after_cr = false;
+                        continue;
+                    }
+                    after_cr = c == '\r';
+                    on_break();
+                }
+                if (start != chunk.size()) {
+                    on_text(chunk.subspan(start));
+                    after_cr = false;
+                }
+            });
+        };
+        size_t text_size = 0, breaks = 0;
+        split([&] (bytes_const_view text) {
+            text_size += text.size();
+        }, [&] {
+            ++breaks;
+        });
+        char head[24];
+        auto head_end = fmt::format_to_n(head, sizeof(head), "{:x}\r\n", id_size + text_size + breaks + (breaks + 1) * data.size() + 2);
+        m_event_stream.append_packed(bytes_const_view{head, head_end.size});
+        m_event_stream.append_packed(bytes_const_view{id, id_size});
+        m_event_stream.append_packed(data);
+        split([&] (bytes_const_view text) {
+            m_event_stream.append_packed(text);
+        }, [&] {
+            m_event_stream.append_packed(std::string_view("\n"));
+            m_event_stream.append_packed(data);
+        });
+        m_event_stream.append_packed(std::string_view("\n\n\r\n"));
+        return m_event_stream;
+    }
+
+    static pointer make(uint64_t room, uint64_t seq, bytes_const_view body, memory_account *account, notice_kind notice = notice_kind::none) {
+        pointer msg(object_pool<room_message>::instance().acquire());
+        msg->m_room = room;
+        msg->m_seq = seq;
+        msg->m_notice = notice;
+        msg->m_body.m_account = account;
+        msg->m_websocket.m_account = account;
+        msg->m_event_stream.m_account = account;
+        msg->m_binary.m_account = account;
+        char prefix[64];
+        auto end = notice == notice_kind::none ? fmt::format_to_n(prefix, sizeof(prefix), "message {} {} ", room, seq)
+            : fmt::format_to_n(prefix, sizeof(prefix), "{} {} ", notice_name(notice), room);
+        char header[10];
+        size_t header_len = websocket_frame_header(header, websocket_opcode::text, end.size + body.size());
+        msg->m_websocket.append_packed(bytes_const_view{header, header_len});
+        msg->m_websocket.append_packed(bytes_const_view{prefix, end.size});
+        //正文紧跟在帧头后面写进共用块，整个帧通常就是一段，很多条小消息共用一个块
+        msg->m_body.append_packed(body);
+        msg->m_websocket.append(msg->m_body);
+        return msg;
+    }
+};
+
+//一条订阅者连接的发送队列：排着的条数和字节数，连上以来一共丢了多少条
+struct queue_report {
+    std::string_view m_protocol;
+    uint32_t m_user = 0;
+    size_t m_queued_messages = 0;
+    size_t m_queued_bytes = 0;
+    uint64_t m_dropped = 0;
+};
+
+//房间成员，不同的连接各自决定怎么把消息发出去
+//房间里只记裸指针，成员销毁前要自己退出所有房间
+struct room_subscriber {
+    virtual void on_room_message(room_message const &msg) = 0;
+    virtual queue_report report_queue() const = 0;
+    virtual ~room_subscriber() = default;
+};
+
+//所有连接的发送队列的统计，每个线程一份，只有本线程写，查的时候加起来
+struct output_queue_stats {
+    std::atomic<int64_t> m_queued_bytes{0};
+    std::atomic<int64_t> m_queued_messages{0};
+    std::atomic<uint64_t> m_dropped{0};         // 队列满了丢掉的消息
+    std::atomic<uint64_t> m_disconnected{0};    // 队列满了断开的连接
+
+    static std::mutex &_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<output_queue_stats *> &_all() {
+        static std::vector<output_queue_stats *> all;
+        return all;
+    }
+
+    //线程不会退出，登记进去的一直有效
+    static output_queue_stats &local() {
+        static thread_local output_queue_stats *stats = [] {
+            auto *p = new output_queue_stats;
+            std::lock_guard lock(_mutex());
+            _all().push_back(p);
+            return p;
+        }();
+        return *stats;
+    }
+
+    struct totals {
+        int64_t m_queued_bytes = 0;
+        int64_t m_queued_messages = 0;
+        uint64_t m_dropped = 0;
+        uint64_t m_disconnected = 0;
+    };
+
+    static totals total() {
+        totals sum;
+        std::lock_guard lock(_mutex());
+        for (output_queue_stats *p : _all()) {
+            sum.m_queued_bytes += p->m_queued_bytes.load(std::memory_order_relaxed);
+            sum.m_queued_messages += p->m_queued_messages.load(std::memory_order_relaxed);
+            sum.m_dropped += p->m_dropped.load(std::memory_order_relaxed);
+            sum.m_disconnected += p->m_disconnected.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    void add(int64_t bytes, int64_t messages) {
+        m_queued_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        m_queued_messages.fetch_add(messages, std::memory_order_relaxed);
+    }
+};
+
+//订阅者连接的发送队列
+//正在写的一批在 m_outbuf 里，写的过程中 iovec 指着它，不能动；之后来的排在 m_entries 里，上一批写完再整批挪过去
+//排队的条数和字节数有上限，超了按策略处理：丢最早的、每个房间只留最新的一条、或者断开
+//控制帧（ack、pong 之类）和消息按先后排在一起，也算在上限里；控制帧不丢，超了先丢消息腾地方，光控制帧就超了只能断开
+struct output_queue {
+    enum class overflow_policy : uint8_t {
+        drop_oldest,
+        coalesce,       // 先丢后面还有同一个房间更新消息的，客户端看到序号跳了再去取历史；通知不参与合并
+        disconnect,
+    };
+
+    struct _entry {
+        room_message::const_pointer m_message;  // 为空就是 m_control 里接下来 m_size 字节的控制帧
+        iobuf const *m_encoded = nullptr;   // 这个连接用的编码，在 m_message 里
+        size_t m_size = 0;
+    };
+
+    std::deque<_entry> m_entries;
+    iobuf m_control;
+    iobuf m_outbuf;
+    size_t m_queued_bytes = 0;
+    size_t m_queued_messages = 0;
+    size_t m_max_bytes = 1024 * 1024;
+    size_t m_max_messages = 1024;
+    overflow_policy m_policy = overflow_policy::drop_oldest;
+    uint64_t m_dropped = 0;
+
+    explicit output_queue(memory_account *account)
+        : m_control(std::pmr::get_default_resource(), account), m_outbuf(std::pmr::get_default_resource(), account) {}
+
+    static bool parse_policy(std::string_view name, overflow_policy &policy) {
+        if (name == "drop") {
+            policy = overflow_policy::drop_oldest;
+        } else if (name == "coalesce") {
+            policy = overflow_policy::coalesce;
+        } else if (name == "disconnect") {
+            policy = overflow_policy::disconnect;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    //攒到上限的一半就不等这一轮结束了，免得一轮里的突发把快的订阅者也挤得丢消息
+    bool half_full() const noexcept {
+        return m_queued_bytes * 2 > m_max_bytes || m_queued_messages * 2 > m_max_messages;
+    }
+
+    //还有没写完或者没开始写的
+    bool empty() const noexcept {
+        return m_entries.empty() && m_outbuf.empty();
+    }
+
+    queue_report report(std::string_view protocol, uint32_t user) const {
+        return {protocol, user, m_queued_messages, m_queued_bytes, m_dropped};
+    }
+
+    void release() {
+        output_queue_stats::local().add(-static_cast<int64_t>(m_queued_bytes), -static_cast<int64_t>(m_queued_messages));
+        m_entries.clear();
+        m_control.release();
+        m_outbuf.release();
+        m_queued_bytes = 0;
+        m_queued_messages = 0;
+        m_policy = overflow_policy::drop_oldest;
+        m_dropped = 0;
+    }
+
+    //排上一条消息；超了上限、策略是断开时返回 false
+    [[nodiscard]] bool push(room_message const &msg, iobuf const &encoded) {
+        m_entries.push_back({room_message::const_pointer(&msg), &encoded, encoded.size()});
+        _account(static_cast<int64_t>(encoded.size()), 1);
+        return _make_room();
+    }
+
+    //排上一个控制帧；腾不出地方时返回 false，调用的断开连接
+    [[nodiscard]] bool push_control(bytes_const_view header, bytes_const_view payload = {}) {
+        m_control.append(header);
+        m_control.append(payload);
+        m_entries.push_back({room_message::const_pointer(), nullptr, header.size() + payload.size()});
+        _account(static_cast<int64_t>(header.size() + payload.size()), 1);
+        return _make_room();
+    }
+
+    //超了上限就按策略丢消息，刚排上的这一条总是留着
+    bool _make_room() {
+        if (!_over_limit())
+            return true;
+        if (m_policy != overflow_policy::disconnect) {
+            if (m_policy == overflow_policy::coalesce) {
+                _coalesce();
+            }
+            auto last = std::prev(m_entries.end());
+            for (auto it = m_entries.begin(); _over_limit() && it != last;) {
+                if (it->m_message) {
+                    it = _drop(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (!_over_limit())
+                return true;
+        }
+        output_queue_stats::local().m_disconnected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    //上一批写完了，把排着的整批挪进 m_outbuf；有东西要写返回 true
+    bool take_batch() {
+        if (m_outbuf.empty()) {
+            for (auto &entry : m_entries) {
+                if (entry.m_message) {
+                    m_outbuf.append(*entry.m_encoded);
+                } else {
+                    m_outbuf.append_prefix(m_control, entry.m_size);
+                    m_control.consume(entry.m_size);
+                }
+            }
+            m_entries.clear();
+            _account(-static_cast<int64_t>(m_queued_bytes), -static_cast<int64_t>(m_queued_messages));
+        }
+        return !m_outbuf.empty();
+    }
+
+    bool _over_limit() const noexcept {
+        return m_queued_bytes > m_max_bytes || m_queued_messages > m_max_messages;
+    }
+
+    void _account(int64_t bytes, int64_t messages) {
+        m_queued_bytes += bytes;
+        m_queued_messages += messages;
+        output_queue_stats::local().add(bytes, messages);
+    }
+
+    std::deque<_entry>::iterator _drop(std::deque<_entry>::iterator it) {
+        _account(-static_cast<int64_t>(it->m_size), -1);
+        ++m_dropped;
+        output_queue_stats::local().m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return m_entries.erase(it);
+    }
+
+    //从后往前扫，记下见过的房间；前面同一个房间的旧消息都丢掉
+    void _coalesce() {
+        std::vector<uint64_t> seen;
+        auto keep = m_entries.end();
+        for (auto it = m_entries.end(); it != m_entries.begin();) {
+            --it;
+            //通知不定序，丢了也没法从历史里补，不和房间的消息合并
+            if (it->m_message && it->m_message->m_notice == notice_kind::none) {
+                uint64_t room = it->m_message->m_room;
+                if (std::find(seen.begin(), seen.end(), room) != seen.end()) {
+                    _account(-static_cast<int64_t>(it->m_size), -1);
+                    ++m_dropped;
+                    output_queue_stats::local().m_dropped.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                seen.push_back(room);
+            }
+            if (--keep != it)
+                *keep = std::move(*it);
+        }
+        m_entries.erase(m_entries.begin(), keep);
+    }
+};
+
+//发布带上的客户端身份：哪个客户端、它自己编的消息号，重试时消息号不变；消息号是 0 就不去重
+struct publish_id {
+    uint64_t m_client = 0;
+    uint64_t m_message = 0;
+
+    //客户端自报的名字散列成 64 位，只在内存里比较
+    static uint64_t client_key(std::string_view name) {
+        return std::hash<std::string_view>()(name);
+    }
+};
+
+//在线程之间传递的消息：发布的线程把正文拷一份，交给房间的所有者线程定序、进历史，再投给有成员的线程各自编码
+//启动时恢复的消息正文直接指着映射进来的快照和日志，不拷贝
+//计数是原子的；序号只由所有者线程写，别的线程经过收件箱拿到以后才读
+struct shared_message : atomic_ref_counted<shared_message> {
+    uint64_t m_room = 0;
+    uint64_t m_seq = 0;
+    notice_kind m_notice = notice_kind::none;
+    uint32_t m_origin = 0;              // 通知最早是在哪个节点上发的
+    publish_id m_from;
+    bytes_const_view m_body{};
+    std::string m_storage;              // 发布时拷进来的正文
+    log_mailbox *m_mailbox = nullptr;   // 落盘后通知发布的线程
+    uint64_t m_ticket = 0;
+    using pointer = intrusive_ptr<shared_message>;
+
+    static void _destroy(shared_message *p) {
+        memory_stats::global().uncharge(p->m_storage.size());
+        p->m_storage.clear();
+        p->m_body = {};
+        p->m_seq = 0;
+        p->m_notice = notice_kind::none;
+        p->m_origin = 0;
+        p->m_from = {};
+        p->m_mailbox = nullptr;
+        object_pool<shared_message>::instance().release(p);
+    }
+
+    static void _assign(std::string &out, bytes_const_view body) {
+        out.assign(body.data(), body.size());
+    }
+
+    static void _assign(std::string &out, iobuf const &body) {
+        out.clear();
+        out.reserve(body.size());
+        body.for_each([&] (bytes_const_view chunk) {
+            out.append(chunk.data(), chunk.size());
+        });
+    }
+
+    template <class Body>
+    static pointer make(uint64_t room, Body const &body) {
+        pointer msg(object_pool<shared_message>::instance().acquire());
+        msg->m_room = room;
+        _assign(msg->m_storage, body);
+        msg->m_body = {msg->m_storage.data(), msg->m_storage.size()};
+        memory_stats::global().charge(msg->m_storage.size());
+        return msg;
+    }
+
+    //正文在别处一直有效，直接引用
+    static pointer make_external(uint64_t room, uint64_t seq, bytes_const_view body) {
+        pointer msg(object_pool<shared_message>::instance().acquire());
+        msg->m_room = room;
+        msg->m_seq = seq;
+        msg->m_body = body;
+        return msg;
+    }
+};
+
+//房间最近的消息，容量固定的环形缓冲区
+//序号是连续的，序号 seq 的消息就在 seq % 容量 这个槽里，按序号定位是 O(1)
+//条数和正文总字节数都有上限，超了就丢最早的
+struct room_history {
+    std::vector<shared_message::pointer> m_ring;
+    size_t m_capacity = 256;
+    size_t m_max_bytes = 1024 * 1024;
+    uint64_t m_first_seq = 1;   // 最早还留着的消息
+    uint64_t m_end_seq = 1;     // 最后一条消息的下一个序号
+    size_t m_bytes = 0;
+
+    void configure(size_t capacity, size_t max_bytes) {
+        m_capacity = std::max<size_t>(capacity, 1);
+        m_max_bytes = max_bytes;
+    }
+
+    size_t size() const noexcept {
+        return m_end_seq - m_first_seq;
+    }
+
+    shared_message::pointer const &_slot(uint64_t seq) const noexcept {
+        return m_ring[seq % m_capacity];
+    }
+
+    void _pop_front() {
+        auto &slot = m_ring[m_first_seq % m_capacity];
+        m_bytes -= slot->m_body.size();
+        slot = shared_message::pointer();
+        ++m_first_seq;
+    }
+
+    void push(shared_message::pointer msg) {
+        if (m_ring.empty()) {
+            //没发过消息的房间不占环的内存
+            m_ring.resize(m_capacity);
+            m_first_seq = m_end_seq = msg->m_seq;
+        }
+        assert(msg->m_seq == m_end_seq);
+        if (size() == m_capacity) {
+            _pop_front();
+        }
+        m_bytes += msg->m_body.size();
+        m_ring[m_end_seq % m_capacity] = std::move(msg);
+        ++m_end_seq;
+        while (m_bytes > m_max_bytes && size() > 1) {
+            _pop_front();
+        }
+    }
+
+    //房间交给别的线程以后，这里的环整个放掉
+    void clear() {
+        m_ring.clear();
+        m_ring.shrink_to_fit();
+        m_first_seq = m_end_seq = 1;
+        m_bytes = 0;
+    }
+
+    //序号在 after 之后的最多 limit 条，太早的已经丢了就从最早留着的开始
+    template <class F>
+    void for_each_since(uint64_t after, size_t limit, F &&f) const {
+        uint64_t seq = std::max(after + 1, m_first_seq);
+        for (; seq < m_end_seq && limit != 0; ++seq, --limit) {
+            f(_slot(seq));
+        }
+    }
+};
+
+//一个事件循环线程：自己的 epoll、定时器和房间表，和别的线程一起监听同一个端口（SO_REUSEPORT）
+//别的线程往收件箱里放要分发的消息和要在这个线程上跑的任务，用 eventfd 叫醒它；两种按放进来的先后处理
+struct reactor {
+    struct _item {
+        shared_message::pointer m_message;  // 有消息就分发消息，没有就跑任务
+        callback<> m_task;
+    };
+    size_t m_index;
+    int m_eventfd;
+    async_file m_event;     // 在自己的线程里才包装进 epoll
+    uint64_t m_counter = 0;
+    std::atomic<uint64_t> m_load{0};    // 上个统计周期本线程定序的消息条数，均衡房间时看
+    std::mutex m_mutex;
+    std::vector<_item> m_inbox;
+    std::vector<_item> m_receiving;
+
+    explicit reactor(size_t index) : m_index(index), m_eventfd(CHECK_CALL(eventfd, 0, EFD_CLOEXEC)) {}
+
+    //启动时建好，之后只读
+    static std::vector<std::unique_ptr<reactor>> &all() {
+        static std::vector<std::unique_ptr<reactor>> reactors;
+        return reactors;
+    }
+
+    static reactor *&current() {
+        static thread_local reactor *self = nullptr;
+        return self;
+    }
+
+    void _wake() {
+        uint64_t one = 1;
+        CHECK_CALL(write, m_eventfd, &one, sizeof(one));
+    }
+
+    void _push(_item item) {
+        bool was_empty;
+        {
+            std::lock_guard lock(m_mutex);
+            was_empty = m_inbox.empty();
+            m_inbox.push_back(std::move(item));
+        }
+        if (was_empty) {
+            _wake();
+        }
+    }
+
+    //哪个线程都能调用
+    void post(shared_message::pointer msg) {
+        return _push({std::move(msg), {}});
+    }
+
+    void post(callback<> task) {
+        return _push({{}, std::move(task)});
+    }
+
+    //投给 owner 指的线程；owner 只在原来的所有者的收件箱锁里改，拿着锁再核对一遍，就不会投给已经交出去的线程
+    static void post_to_owner(std::atomic<uint32_t> &owner, callback<> task) {
+        while (true) {
+            uint32_t index = owner.load(std::memory_order_acquire);
+            reactor &r = *all()[index];
+            std::unique_lock lock(r.m_mutex);
+            if (owner.load(std::memory_order_relaxed) != index)
+                continue;
+            bool was_empty = r.m_inbox.empty();
+            r.m_inbox.push_back({{}, std::move(task)});
+            lock.unlock();
+            if (was_empty) {
+                r._wake();
+            }
+            return;
+        }
+    }
+
+    //在本线程调用：锁里把 owner 改成 target，同时往自己的收件箱放一个记号
+    //记号之前投进来的任务都还在本线程跑，之后的都去了 target
+    void hand_over(std::atomic<uint32_t> &owner, uint32_t target, callback<> marker) {
+        bool was_empty;
+        {
+            std::lock_guard lock(m_mutex);
+            owner.store(target, std::memory_order_release);
+            was_empty = m_inbox.empty();
+            m_inbox.push_back({{}, std::move(marker)});
+        }
+        if (was_empty) {
+            _wake();
+        }
+    }
+
+    template <class F>
+    void do_receive(F on_message) {
+        if (m_event.m_fd == -1) {
+            m_event = async_file::async_wrap(m_eventfd);
+        }
+        return m_event.async_read({reinterpret_cast<char *>(&m_counter), sizeof(m_counter)}, [this, on_message] (ssize_t) {
+            {
+                std::lock_guard lock(m_mutex);
+                m_receiving.swap(m_inbox);
+            }
+            for (auto &item : m_receiving) {
+                if (item.m_message) {
+                    on_message(*item.m_message);
+                } else {
+                    item.m_task();
+                }
+            }
+            m_receiving.clear();
+            return do_receive(on_message);
+        });
+    }
+};
+
+//房间归哪个线程管，所有线程共用
+struct room_route {
+    std::atomic<uint32_t> m_owner{0};
+    std::atomic<bool> m_moving{false};          // 交接中：新的所有者还没收到房间状态
+    std::atomic<uint64_t> m_subscribers{0};     // 第 i 位：第 i 个线程里有这个房间的成员
+    std::atomic<uint64_t> m_head{0};            // 最新定好的序号，哪个线程都能读，算未读数用
+
+    //家在别的节点的房间由各线程的链路收到序号，谁大留谁
+    void advance_head(uint64_t seq) {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        while (head < seq && !m_head.compare_exchange_weak(head, seq, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+//所有房间的归属，哪个线程都能查；只增不删，查到的引用一直有效
+//房间按编号散列到一个线程，均衡时才改
+//只有发布和进房间才建房间，查历史这类只读的请求碰到没有的房间直接当空的，不留下任何东西
+struct room_directory {
+    static constexpr size_t max_rooms = 1 << 20;    // 房间只增不删，到了上限就不再建新的
+
+    std::shared_mutex m_mutex;
+    std::unordered_map<uint64_t, std::unique_ptr<room_route>> m_rooms;
+    std::atomic<size_t> m_moving_rooms{0};  // 正在交接的房间数
+    std::atomic<uint64_t> m_moves{0};       // 开始过的交接次数，快照用来判断收集期间有没有房间换过线程
+
+    static room_directory &instance() {
+        static room_directory directory;
+        return directory;
+    }
+
+    static uint32_t default_owner(uint64_t id) {
+        //房间号往往是连着的，先打散
+        id *= 0x9E3779B97F4A7C15ull;
+        return static_cast<uint32_t>((id >> 32) % reactor::all().size());
+    }
+
+    //发布、进房间时建房间，房间数到了上限返回空；启动时恢复的房间不受上限限制
+    room_route *create(uint64_t id, bool restoring = false) {
+        if (room_route *route = find(id))
+            return route;
+        std::unique_lock lock(m_mutex);
+        auto it = m_rooms.find(id);
+        if (it != m_rooms.end())
+            return it->second.get();
+        if (!restoring && m_rooms.size() >= max_rooms)
+            return nullptr;
+        auto &p = m_rooms[id];
+        p = std::make_unique<room_route>();
+        p->m_owner.store(default_owner(id), std::memory_order_relaxed);
+        return p.get();
+    }
+
+    //已经建好的房间
+    room_route &route(uint64_t id) {
+        room_route *route = find(id);
+        assert(route);
+        return *route;
+    }
+
+    //只查不建，没有返回空
+    room_route *find(uint64_t id) {
+        std::shared_lock lock(m_mutex);
+        auto it = m_rooms.find(id);
+        return it == m_rooms.end() ? nullptr : it->second.get();
+    }
+};
+
+//一个房间里每个客户端最近定过序的消息号，客户端重试发布时用来去重
+//先查布隆过滤器，新的消息号绝大多数在这里就放过了；过滤器说可能有，再查精确的散列表
+//过滤器删不掉东西，所以分新旧两代，环转满一圈就清掉旧的那代、新的变旧的，两代合起来总能盖住环里的消息号
+//散列表按消息号找到环里的位置，线性探测、最多半满；环覆盖掉旧的消息号时把它从表里删掉，删的时候把后面的往回挪，不留墓碑
+struct publish_dedup {
+    static constexpr size_t window = 64;        // 每个客户端记住最近多少个消息号
+    static constexpr size_t max_clients = 256;  // 每个房间记住多少个客户端，多了就丢掉最久没发的
+    static constexpr size_t filter_words = 16;  // 每代 1024 位
+    static constexpr size_t index_size = window * 2;
+    static_assert(window < 256 && (index_size & (index_size - 1)) == 0);
+
+    struct _client {
+        uint64_t m_filters[2][filter_words] = {};
+        int m_current = 0;
+        std::pair<uint64_t, uint64_t> m_recent[window] = {};    // (消息号, 序号)
+        uint8_t m_index[index_size] = {};                       // m_recent 的下标加一，0 是空槽
+        size_t m_next = 0;
+        uint64_t m_last_used = 0;
+    };
+
+    std::unordered_map<uint64_t, _client> m_clients;
+    uint64_t m_clock = 0;
+
+    //一个消息号在过滤器里占三位
+    static void _bits(uint64_t message, size_t (&bits)[3]) {
+        message *= 0x9E3779B97F4A7C15ull;
+        for (size_t i = 0; i < 3; ++i) {
+            bits[i] = (message >> (64 - 10 * (i + 1))) & (filter_words * 64 - 1);
+        }
+    }
+
+    static bool _maybe_has(uint64_t const (&filter)[filter_words], size_t const (&bits)[3]) {
+        for (size_t bit : bits) {
+            if (!(filter[bit / 64] >> (bit % 64) & 1))
+                return false;
+        }
+        return true;
+    }
+
+    //消息号在散列表里本来该放的槽，取乘法散列的低位，和过滤器用的高位错开
+    static size_t _home(uint64_t message) {
+        return static_cast<size_t>(message * 0x9E3779B97F4A7C15ull >> 16) & (index_size - 1);
+    }
+
+    static size_t _next(size_t i) {
+        return (i + 1) & (index_size - 1);
+    }
+
+    //这个消息号在散列表里的槽，没有返回 index_size
+    static size_t _lookup(_client const &client, uint64_t message) {
+        for (size_t i = _home(message); client.m_index[i] != 0; i = _next(i)) {
+            if (client.m_recent[client.m_index[i] - 1].first == message)
+                return i;
+        }
+        return index_size;
+    }
+
+    //删掉槽 hole，后面同一串里能往回挪的挪过来补上，查找时就不会在空槽处提前停下
+    static void _erase(_client &client, size_t hole) {
+        for (size_t i = _next(hole); client.m_index[i] != 0; i = _next(i)) {
+            size_t home = _home(client.m_recent[client.m_index[i] - 1].first);
+            if (((i - home) & (index_size - 1)) >= ((i - hole) & (index_size - 1))) {
+                client.m_index[hole] = client.m_index[i];
+                hole = i;
+            }
+        }
+        client.m_index[hole] = 0;
+    }
+
+    //这个客户端的这个消息号定过序就返回当时的序号，没有返回 0
+    uint64_t find(publish_id const &from) {
+        auto it = m_clients.find(from.m_client);
+        if (it == m_clients.end())
+            return 0;
+        _client &client = it->second;
+        size_t bits[3];
+        _bits(from.m_message, bits);
+        if (!_maybe_has(client.m_filters[0], bits) && !_maybe_has(client.m_filters[1], bits))
+            return 0;
+        size_t i = _lookup(client, from.m_message);
+        return i == index_size ? 0 : client.m_recent[client.m_index[i] - 1].second;
+    }
+
+    void remember(publish_id const &from, uint64_t seq) {
+        auto it = m_clients.find(from.m_client);
+        if (it == m_clients.end()) {
+            if (m_clients.size() >= max_clients) {
+                auto oldest = std::min_element(m_clients.begin(), m_clients.end(), [] (auto const &a, auto const &b) {
+                    return a.second.m_last_used < b.second.m_last_used;
+                });
+                m_clients.erase(oldest);
+            }
+            it = m_clients.try_emplace(from.m_client).first;
+        }
+        _client &client = it->second;
+        client.m_last_used = ++m_clock;
+        size_t bits[3];
+        _bits(from.m_message, bits);
+        auto &filter = client.m_filters[client.m_current];
+        for (size_t bit : bits) {
+            filter[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+        auto &slot = client.m_recent[client.m_next];
+        if (slot.second != 0) {
+            size_t old = _lookup(client, slot.first);
+            if (old != index_size)
+                _erase(client, old);
+        }
+        slot = {from.m_message, seq};
+        size_t i = _home(from.m_message);
+        while (client.m_index[i] != 0) {
+            i = _next(i);
+        }
+        client.m_index[i] = static_cast<uint8_t>(client.m_next + 1);
+        if (++client.m_next == window) {
+            client.m_next = 0;
+            client.m_current ^= 1;
+            std::fill(std::begin(client.m_filters[client.m_current]), std::end(client.m_filters[client.m_current]), 0);
+        }
+    }
+};
+
+struct chat_room {
+    room_route *m_route = nullptr;
+    //本线程里的成员
+    std::vector<room_subscriber *> m_members;
+    int m_publishing = 0;       // 正在分发时退出的成员先置空，分发完再收拾
+    bool m_has_holes = false;
+    //下面这些只有所有者线程用
+    bool m_owned = false;
+    uint64_t m_last_seq = 0;
+    room_history m_history;
+    publish_dedup m_dedup;
+    uint64_t m_recent_publishes = 0;    // 这个统计周期里定序的条数
+    size_t m_undelivered = 0;           // 定了序、还没落盘分发的条数，交接要等它归零
+    std::vector<callback<>> m_waiting;  // 房间状态还在交接的路上，先到的任务攒在这里
+};
+
+//一个房间的序号和历史，交接房间和写快照时从所有者线程带出来
+struct room_state {
+    uint64_t m_room = 0;
+    uint64_t m_last_seq = 0;
+    std::vector<shared_message::pointer> m_history;
+    publish_dedup m_dedup;      // 只在交接时带过去，快照不写
+};
+
+//从所有者线程取回来的一段历史
+struct history_page {
+    uint64_t m_first_seq = 1;   // 环里最早还留着的序号
+    uint64_t m_after = 0;       // 实际从哪个序号之后取的
+    std::vector<shared_message::pointer> m_messages;
+};
+
+//集群里每个房间有一个家节点，定序、写日志、留历史都在家节点上
+//一致性散列：每个节点按地址在环上放 virtual_nodes 个点，房间落在顺时针第一个点的节点上；加减节点只挪走一小部分房间
+//所有节点按同样的节点列表算，结果一样；列表只有一个节点就是不开集群
+struct cluster_ring {
+    static constexpr size_t virtual_nodes = 64;
+
+    struct node {
+        std::string m_host;
+        std::string m_port;     // 二进制协议的端口，节点之间的链路连这个
+        //启动时解析好，重连时不在事件循环里查地址
+        address_resolver::address m_address;
+        int m_family = 0;
+        int m_socktype = 0;
+        int m_protocol = 0;
+    };
+    std::vector<node> m_nodes;
+    uint32_t m_self = 0;
+    std::string m_secret;   // --cluster-secret，别的节点连过来的 node_hello 要带上它
+    std::vector<std::pair<uint64_t, uint32_t>> m_ring;  // 按散列值排好序的 (点, 节点下标)
+
+    static cluster_ring &instance() {
+        static cluster_ring ring;
+        return ring;
+    }
+
+    //不同的编译结果也要散列出同样的环，不用 std::hash
+    static uint64_t _hash(std::string_view key) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (char c : key) {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+        }
+        return _mix(h);
+    }
+
+    static uint64_t _mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    //启动时在开线程之前配好，之后只读；节点的地址在这里解析，解析不了就起不来
+    void configure(std::vector<node> nodes, uint32_t self, std::string secret) {
+        m_nodes = std::move(nodes);
+        m_self = self;
+        m_secret = std::move(secret);
+        m_ring.clear();
+        for (auto &n : m_nodes) {
+            _resolve(n);
+        }
+        for (uint32_t i = 0; i < m_nodes.size(); ++i) {
+            for (size_t v = 0; v < virtual_nodes; ++v) {
+                auto key = fmt::format("{}:{}#{}", m_nodes[i].m_host, m_nodes[i].m_port, v);
+                m_ring.emplace_back(_hash(key), i);
+            }
+        }
+        std::sort(m_ring.begin(), m_ring.end());
+    }
+
+    static void _resolve(node &n) {
+        address_resolver resolver;
+        auto entry = resolver.resolve(n.m_host, n.m_port);
+        while (entry.m_curr->ai_socktype != SOCK_STREAM) {
+            if (!entry.next_entry())
+                throw std::invalid_argument(n.m_host + ":" + n.m_port);
+        }
+        n.m_family = entry.m_curr->ai_family;
+        n.m_socktype = entry.m_curr->ai_socktype;
+        n.m_protocol = entry.m_curr->ai_protocol;
+        memcpy(&n.m_address.m_addr_storage, entry.m_curr->ai_addr, entry.m_curr->ai_addrlen);
+        n.m_address.m_addrlen = entry.m_curr->ai_addrlen;
+    }
+
+    bool enabled() const noexcept {
+        return m_nodes.size() > 1;
+    }
+
+    //node_hello 里报的节点下标和密钥都对得上才当节点的链路；逐字节比完，不因为前缀对了多少而快慢不同
+    bool admit_node(uint64_t node, bytes_const_view secret) const {
+        if (!enabled() || m_secret.empty() || node >= m_nodes.size() || node == m_self || secret.size() != m_secret.size())
+            return false;
+        unsigned char diff = 0;
+        for (size_t i = 0; i < secret.size(); ++i) {
+            diff |= static_cast<unsigned char>(secret.data()[i] ^ m_secret[i]);
+        }
+        return diff == 0;
+    }
+
+    uint32_t home(uint64_t room) const {
+        if (!enabled())
+            return m_self;
+        auto it = std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(_mix(room), uint32_t(0)));
+        if (it == m_ring.end())
+            it = m_ring.begin();
+        return it->second;
+    }
+
+    bool is_remote(uint64_t room) const {
+        return enabled() && home(room) != m_self;
+    }
+};
+
+//到另一个节点的一条长连接，每个事件循环线程对每个别的节点各连一条，只在本线程里用
+//说的就是二进制协议：连上先发带集群密钥的 node_hello，再替本线程的成员 join 家在那边的房间，收到的 message 帧交给 m_on_message 分发
+//短命事件两个方向都走：本节点合并好的一批用 ephemeral_batch 帧发给家节点，家节点转来的别的节点的交给 m_on_ephemeral
+//转发的发布是 send 帧，对面落盘以后回 ack；帧都排进输出队列，和订阅者一样一轮攒下来一次 writev 发出去
+struct cluster_link {
+    static constexpr auto reconnect_delay = std::chrono::seconds(1);
+    static constexpr size_t max_queued_bytes = 64 * 1024 * 1024;    // 链路上一轮要转的帧比一个订阅者多得多
+    static constexpr size_t max_queued_frames = 64 * 1024;
+
+    uint32_t m_node = 0;
+    std::string m_host;
+    std::string m_port;
+    async_file m_conn;
+    memory_account m_account;
+    bytes_arena m_arena{&m_account};
+    adaptive_read_size m_read_size;
+    binary_frame_parser m_parser{&m_arena};
+    output_queue m_queue{&m_account};
+    bool m_connecting = false;  // 发起过连接，还没断；这期间排进队列的帧连上以后按顺序发
+    bool m_connected = false;
+    bool m_writing = false;
+    bool m_flush_scheduled = false;
+    bool m_reconnect_scheduled = false;
+    std::vector<uint64_t> m_rooms;  // 本线程有成员、经这条连接订阅的房间
+    //每个房间等 ack 的发布；对面一个房间的 ack 按定序的顺序回来，不同房间之间不保证
+    std::unordered_map<uint64_t, std::deque<callback<uint64_t>>> m_pending;
+    callback<uint64_t, uint64_t, bytes_const_view> m_on_message;   // 房间、序号、正文
+    callback<uint64_t, bytes_const_view> m_on_ephemeral;            // 房间、合并好的一批事件
+
+    //链路上的帧都是控制帧，一个也不能丢，排不下了就断开重连
+    cluster_link() {
+        m_queue.m_policy = output_queue::overflow_policy::disconnect;
+        m_queue.m_max_bytes = max_queued_bytes;
+        m_queue.m_max_messages = max_queued_frames;
+    }
+
+    void join(uint64_t room) {
+        m_rooms.push_back(room);
+        if (!m_connecting)
+            return do_connect();
+        return _send(binary_opcode::join, room, 0);
+    }
+
+    void leave(uint64_t room) {
+        m_rooms.erase(std::remove(m_rooms.begin(), m_rooms.end(), room), m_rooms.end());
+        if (m_connecting)
+            _send(binary_opcode::leave, room, 0);
+    }
+
+    //带 from 的发布，客户端的名字放在载荷最前面 8 个字节，家节点照样去重
+    //on_ack 拿到家节点定的序号；连接断了拿到 0
+    void publish(uint64_t room, bytes_const_view body, publish_id from, callback<uint64_t> on_ack) {
+        m_pending[room].push_back(std::move(on_ack));
+        if (!m_connecting) {
+            do_connect();
+            if (!m_connecting)
+                return;
+        }
+        char header[sizeof(binary_frame_header) + sizeof(uint64_t)];
+        size_t header_len = sizeof(binary_frame_header);
+        if (from.m_message != 0) {
+            memcpy(header + header_len, &from.m_client, sizeof(uint64_t));
+            header_len += sizeof(uint64_t);
+        }
+        auto frame = binary_frame_header_of(binary_opcode::send, room, from.m_message, header_len - sizeof(binary_frame_header) + body.size());
+        memcpy(header, &frame, sizeof(frame));
+        if (!m_queue.push_control(bytes_const_view{header, header_len}, body))
+            return _fail();
+        return schedule_write();
+    }
+
+    //短命事件丢了也无所谓：没连着就不发，也不为它发起连接
+    void send_ephemeral(uint64_t room, bytes_const_view batch) {
+        if (!m_connecting)
+            return;
+        return _send(binary_opcode::ephemeral_batch, room, 0, batch);
+    }
+
+    void _send(binary_opcode opcode, uint64_t room, uint64_t seq, bytes_const_view payload = {}) {
+        auto header = binary_frame_header_of(opcode, room, seq, payload.size());
+        if (!m_queue.push_control(bytes_const_view{reinterpret_cast<char const *>(&header), sizeof(header)}, payload))
+            return _fail();
+        return schedule_write();
+    }
+
+    //地址是启动时解析好的，这里只建套接字发起非阻塞连接
+    void do_connect() {
+        auto &ring = cluster_ring::instance();
+        m_connecting = true;
+        _send(binary_opcode::node_hello, 0, ring.m_self, {ring.m_secret.data(), ring.m_secret.size()});
+        for (uint64_t room : m_rooms) {
+            _send(binary_opcode::join, room, 0);
+        }
+        if (!m_connecting)
+            return;
+        auto &peer = ring.m_nodes[m_node];
+        m_conn = async_file::async_wrap(CHECK_CALL(socket, peer.m_family, peer.m_socktype, peer.m_protocol));
+        //一轮攒下的帧已经是整批写的，不用再等 Nagle 凑包
+        int on = 1;
+        setsockopt(m_conn.m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        return m_conn.async_connect(peer.m_address, [this] (int err) {
+            if (err != 0) {
+                fmt::println("连不上节点 {} {}:{}: {}", m_node, m_host, m_port, strerror(err));
+                return _fail();
+            }
+            m_connected = true;
+            do_read();
+            return schedule_write();
+        });
+    }
+
+    //连接断了：等 ack 的发布都回 0；还有成员在的话过一会儿重连，重新订阅，断开期间的消息只能去家节点的历史里找
+    void _fail() {
+        m_conn.close_file();
+        m_connecting = false;
+        m_connected = false;
+        m_writing = false;
+        m_queue.release();
+        m_queue.m_policy = output_queue::overflow_policy::disconnect;
+        m_parser.reset_state();
+        m_arena.reset();
+        auto pending = std::move(m_pending);
+        m_pending.clear();
+        for (auto &[room, callbacks] : pending) {
+            for (auto &on_ack : callbacks) {
+                on_ack(0);
+            }
+        }
+        if (!m_rooms.empty() && !m_reconnect_scheduled) {
+            m_reconnect_scheduled = true;
+            timer_queue::instance().add(reconnect_delay, [this] {
+                m_reconnect_scheduled = false;
+                if (!m_connecting && !m_rooms.empty())
+                    do_connect();
+            });
+        }
+    }
+
+    void do_read() {
+        io_vectors bufs;
+        bufs.push(m_parser.prepare(m_read_size.size()));
+        size_t requested = bufs.total_size();
+        return m_conn.async_read_overflow(bufs, [this, requested] (ssize_t n, bytes_const_view overflow) {
+            if (n <= 0)
+                return _fail();
+            m_read_size.on_read(requested, n);
+            m_parser.commit(n - overflow.size());
+            if (overflow.size() != 0) {
+                m_parser.push_chunk(overflow);
+            }
+            binary_frame frame;
+            while (m_parser.next_frame(frame)) {
+                on_frame(frame);
+            }
+            if (m_parser.error())
+                return _fail();
+            m_parser.discard_consumed();
+            return do_read();
+        });
+    }
+
+    void on_frame(binary_frame const &frame) {
+        auto const &header = frame.m_header;
+        switch (header.m_opcode) {
+        case binary_opcode::message:
+            return m_on_message(header.m_room, header.m_seq, frame.m_payload);
+        case binary_opcode::ephemeral_batch:
+            return m_on_ephemeral(header.m_room, frame.m_payload);
+        case binary_opcode::ack:
+            return _acked(header.m_room, header.m_seq);
+        case binary_opcode::error:
+            //只有回 send 的 error 对应一个等 ack 的发布；进房间被拒这类的记一笔就算了
+            if (header.m_answers == binary_opcode::send)
+                return _acked(header.m_room, 0);
+            fmt::println("节点 {} 回了错误，房间 {}: {}", m_node, header.m_room, std::string_view(frame.m_payload.data(), frame.m_payload.size()));
+            return;
+        default:
+            return;
+        }
+    }
+
+    void _acked(uint64_t room, uint64_t seq) {
+        auto it = m_pending.find(room);
+        if (it == m_pending.end())
+            return;
+        callback<uint64_t> on_ack = std::move(it->second.front());
+        it->second.pop_front();
+        if (it->second.empty())
+            m_pending.erase(it);
+        return on_ack(seq);
+    }
+
+    void schedule_write() {
+        if (!m_connected || m_writing)
+            return;
+        if (m_queue.half_full())
+            return do_write();
+        if (m_flush_scheduled)
+            return;
+        m_flush_scheduled = true;
+        write_batcher::instance().schedule([this] {
+            m_flush_scheduled = false;
+            if (m_connected && !m_writing)
+                do_write();
+        });
+    }
+
+    void do_write() {
+        if (!m_queue.take_batch()) {
+            m_writing = false;
+            return;
+        }
+        m_writing = true;
+        io_vectors bufs;
+        m_queue.m_outbuf.to_iovecs(bufs);
+        return m_conn.async_writev(bufs, [this] (ssize_t n) {
+            if (n < 0)
+                return _fail();
+            m_queue.m_outbuf.consume(n);
+            return do_write();
+        });
+    }
+};
+
+//每个事件循环线程一份：本线程的房间成员，以及归本线程管的房间的序号和历史
+//发布先转给所有者线程定序、写日志、进历史，再投给有成员的线程，各自编码一次挂到成员的输出队列上
+//一个房间的数据只在一个线程里改，不用加锁，也一直待在那个核的缓存里
+struct room_registry {
+    static constexpr auto rebalance_interval = std::chrono::seconds(1);
+    static constexpr uint64_t rebalance_min_load = 1000;    // 一个周期里本线程定序不到这么多条就不挪
+    static constexpr size_t max_joined_rooms = 256;         // 一条连接最多进多少个房间
+
+    std::unordered_map<uint64_t, chat_room> m_rooms;
+    memory_account m_account;   // 编码好的消息记在这里，不算在发布者的连接上
+    size_t m_history_capacity = 256;            // 每个房间留多少条历史
+    size_t m_history_max_bytes = 1024 * 1024;   // 每个房间历史正文最多占多少字节
+    std::vector<std::unique_ptr<cluster_link>> m_links;     // 按节点下标，第一次用到时才连
+    std::vector<shared_message::pointer> m_undurable;       // 这一轮定了序的消息，等落盘以后才进历史、分发
+    bool m_durable_barrier_scheduled = false;
+
+    room_registry() {
+        m_account.m_limit = memory_stats::global().m_limit;
+    }
+
+    static room_registry &instance() {
+        static thread_local room_registry registry;
+        return registry;
+    }
+
+    static uint32_t _self() {
+        return static_cast<uint32_t>(reactor::current()->m_index);
+    }
+
+    //发布和进房间之前先建好房间；房间数到了上限返回 false，调用的回错误
+    static bool open_room(uint64_t id) {
+        return room_directory::instance().create(id) != nullptr;
+    }
+
+    //房间要已经建好
+    chat_room &_room(uint64_t id) {
+        auto [it, inserted] = m_rooms.try_emplace(id);
+        chat_room &room = it->second;
+        if (inserted) {
+            room.m_history.configure(m_history_capacity, m_history_max_bytes);
+            room.m_route = &room_directory::instance().route(id);
+            //第一次见到的房间：归本线程而且不在交接中，就是还没换过线程、本来就归本线程的
+            room.m_owned = room.m_route->m_owner.load(std::memory_order_acquire) == _self()
+                && !room.m_route->m_moving.load(std::memory_order_acquire);
+        }
+        return room;
+    }
+
+    //在房间的所有者线程上跑 task：归本线程就直接跑；正在交接给本线程就先攒着；否则转给所有者
+    //房间要已经建好；本线程不是所有者就不在本线程的房间表里留东西
+    void _run_on_owner(uint64_t id, callback<> task) {
+        auto it = m_rooms.find(id);
+        if (it != m_rooms.end() && it->second.m_owned)
+            return task();
+        room_route &route = it != m_rooms.end() ? *it->second.m_route : room_directory::instance().route(id);
+        if (route.m_owner.load(std::memory_order_acquire) == _self()) {
+            //第一次见到、本来就归本线程的房间这里才建，建好就是本线程的
+            chat_room &room = _room(id);
+            if (room.m_owned)
+                return task();
+            room.m_waiting.push_back(std::move(task));
+            return;
+        }
+        reactor::post_to_owner(route.m_owner, [id, task = std::move(task)] () mutable {
+            instance()._run_on_owner(id, std::move(task));
+        });
+    }
+
+    cluster_link &_link(uint32_t node) {
+        auto &ring = cluster_ring::instance();
+        if (m_links.size() < ring.m_nodes.size()) {
+            m_links.resize(ring.m_nodes.size());
+        }
+        auto &link = m_links[node];
+        if (!link) {
+            link = std::make_unique<cluster_link>();
+            link->m_node = node;
+            link->m_host = ring.m_nodes[node].m_host;
+            link->m_port = ring.m_nodes[node].m_port;
+            link->m_on_message = [this] (uint64_t id, uint64_t seq, bytes_const_view body) {
+                chat_room &room = _room(id);
+                room.m_route->advance_head(seq);
+                _fan_out(room, id, seq, body);
+            };
+            //家节点转来的，经这条链路 join 的只有本线程的成员
+            link->m_on_ephemeral = [this, node] (uint64_t id, bytes_const_view batch) {
+                _fan_out(_room(id), id, 0, batch, notice_kind::ephemeral, node);
+            };
+        }
+        return *link;
+    }
+
+    static bool _has_members(chat_room const &room) {
+        return std::any_of(room.m_members.begin(), room.m_members.end(), [] (room_subscriber *s) {
+            return s != nullptr;
+        });
+    }
+
+    bool join(uint64_t id, room_subscriber *s) {
+        chat_room &room = _room(id);
+        auto &members = room.m_members;
+        if (std::find(members.begin(), members.end(), s) != members.end())
+            return false;
+        if (!_has_members(room)) {
+            room.m_route->m_subscribers.fetch_or(uint64_t(1) << _self(), std::memory_order_acq_rel);
+            //家在别的节点：本线程第一个成员进来时经链路去那边订阅，消息从链路回来直接分发
+            auto &ring = cluster_ring::instance();
+            if (ring.is_remote(id))
+                _link(ring.home(id)).join(id);
+        }
+        members.push_back(s);
+        return true;
+    }
+
+    bool leave(uint64_t id, room_subscriber *s) {
+        auto it = m_rooms.find(id);
+        if (it == m_rooms.end())
+            return false;
+        chat_room &room = it->second;
+        auto pos = std::find(room.m_members.begin(), room.m_members.end(), s);
+        if (pos == room.m_members.end())
+            return false;
+        if (room.m_publishing != 0) {
+            *pos = nullptr;
+            room.m_has_holes = true;
+        } else {
+            *pos = room.m_members.back();
+            room.m_members.pop_back();
+        }
+        if (!_has_members(room)) {
+            room.m_route->m_subscribers.fetch_and(~(uint64_t(1) << _self()), std::memory_order_acq_rel);
+            auto &ring = cluster_ring::instance();
+            if (ring.is_remote(id))
+                _link(ring.home(id)).leave(id);
+        }
+        return true;
+    }
+
+    //启动时从快照或者日志里恢复一条消息，只进历史，不分发也不再写日志；只恢复归本线程的房间
+    void restore(uint64_t id, uint64_t seq, bytes_const_view body) {
+        if (room_directory::default_owner(id) != _self())
+            return;
+        room_directory::instance().create(id, true);
+        chat_room &room = _room(id);
+        if (seq <= room.m_last_seq)
+            return;
+        room.m_last_seq = seq;
+        room.m_route->advance_head(seq);
+        room.m_history.push(shared_message::make_external(id, seq, body));
+    }
+
+    //快照里的房间可能历史已经丢光了，序号单独恢复
+    void restore_last_seq(uint64_t id, uint64_t seq) {
+        if (room_directory::default_owner(id) != _self())
+            return;
+        room_directory::instance().create(id, true);
+        chat_room &room = _room(id);
+        room.m_last_seq = std::max(room.m_last_seq, seq);
+        room.m_route->advance_head(seq);
+    }
+
+    //转给所有者线程定序；on_durable 在日志落盘之后才在本线程回调，带着定好的序号
+    //带着 from 的是可以重试的发布，同一个消息号再来只回第一次定的序号
+    //家在别的节点的房间经本线程的链路转过去，序号是家节点定的；链路断了回调拿到 0
+    //from_node 为真的是别的节点转来的，不管环怎么算都在本节点定序，不会再转出去
+    template <class Body>
+    void publish(uint64_t id, Body const &body, callback<uint64_t> on_durable = {}, publish_id from = {}, bool from_node = false) {
+        auto &ring = cluster_ring::instance();
+        if (!from_node && ring.is_remote(id)) {
+            std::string storage;
+            return _link(ring.home(id)).publish(id, _flatten(body, storage), from, std::move(on_durable));
+        }
+        auto msg = shared_message::make(id, body);
+        msg->m_from = from;
+        if (on_durable.m_base) {
+            msg->m_mailbox = &log_mailbox::instance();
+            msg->m_ticket = msg->m_mailbox->enqueue([msg, on_durable = std::move(on_durable)] {
+                on_durable(msg->m_seq);
+            });
+        }
+        _run_on_owner(id, [msg = std::move(msg)] () mutable {
+            instance()._sequence(std::move(msg));
+        });
+    }
+
+    //不定序、不进历史也不写日志的通知，序号是 0，直接投给有成员的线程；在线状态这种只关心眼下的用
+    //哪个线程都能调用
+    //origin 是通知最早发出的节点，别的节点经链路转来的要带上
+    void broadcast(uint64_t id, notice_kind notice, bytes_const_view body, uint32_t origin = cluster_ring::instance().m_self) {
+        room_route *route = room_directory::instance().find(id);
+        if (!route)
+            return;
+        auto msg = shared_message::make(id, body);
+        msg->m_notice = notice;
+        msg->m_origin = origin;
+        auto &reactors = reactor::all();
+        uint64_t threads = route->m_subscribers.load(std::memory_order_acquire);
+        for (; threads != 0; threads &= threads - 1) {
+            reactors[__builtin_ctzll(threads)]->post(msg);
+        }
+    }
+
+    //本线程合并好的一批短命事件经本线程的链路发给家节点，家节点再转给别的节点；房间的家要在别的节点
+    void relay_ephemeral(uint64_t id, bytes_const_view batch) {
+        return _link(cluster_ring::instance().home(id)).send_ephemeral(id, batch);
+    }
+
+    static bytes_const_view _flatten(bytes_const_view body, std::string &) {
+        return body;
+    }
+
+    static bytes_const_view _flatten(iobuf const &body, std::string &storage) {
+        shared_message::_assign(storage, body);
+        return {storage.data(), storage.size()};
+    }
+
+    //在所有者线程上：定序、写日志、进历史，投给有成员的别的线程，再分发给本线程的成员
+    void _sequence(shared_message::pointer msg) {
+        chat_room &room = _room(msg->m_room);
+        assert(room.m_owned);
+        auto &log = message_log::instance();
+        if (msg->m_from.m_message != 0) {
+            if (uint64_t seq = room.m_dedup.find(msg->m_from)) {
+                //重试：不再定序也不分发，等第一次的那条落盘以后回它的序号
+                msg->m_seq = seq;
+                if (!msg->m_mailbox)
+                    return;
+                if (log.enabled()) {
+                    log.append_barrier(msg->m_mailbox, msg->m_ticket);
+                } else {
+                    msg->m_mailbox->complete(&msg->m_ticket, 1);
+                }
+                return;
+            }
+        }
+        msg->m_seq = ++room.m_last_seq;
+        ++room.m_recent_publishes;
+        if (msg->m_from.m_message != 0) {
+            room.m_dedup.remember(msg->m_from, msg->m_seq);
+        }
+        if (!log.enabled()) {
+            if (msg->m_mailbox)
+                msg->m_mailbox->complete(&msg->m_ticket, 1);
+            return _deliver_durable(room, msg);
+        }
+        //落盘之前谁也看不到这条：崩溃后重启会从日志里恢复序号，没落盘的序号会再用一次，不能已经发出去过
+        log.append(msg->m_room, msg->m_seq, msg->m_body, msg->m_mailbox, msg->m_ticket);
+        ++room.m_undelivered;
+        m_undurable.push_back(std::move(msg));
+        //一轮里定序的消息共用一个屏障，落盘以后按定序的顺序分发
+        if (!m_durable_barrier_scheduled) {
+            m_durable_barrier_scheduled = true;
+            write_batcher::instance().schedule([this] {
+                _flush_undurable();
+            });
+        }
+    }
+
+    void _flush_undurable() {
+        m_durable_barrier_scheduled = false;
+        if (m_undurable.empty())
+            return;
+        auto &mailbox = log_mailbox::instance();
+        uint64_t ticket = mailbox.enqueue([this, batch = std::move(m_undurable)] {
+            for (auto const &msg : batch) {
+                chat_room &room = _room(msg->m_room);
+                --room.m_undelivered;
+                _deliver_durable(room, msg);
+            }
+        });
+        m_undurable.clear();
+        message_log::instance().append_barrier(&mailbox, ticket);
+    }
+
+    //落了盘的消息：进历史，投给有成员的别的线程，再分发给本线程的成员
+    void _deliver_durable(chat_room &room, shared_message::pointer const &msg) {
+        room.m_route->m_head.store(msg->m_seq, std::memory_order_relaxed);
+        room.m_history.push(msg);
+        auto &reactors = reactor::all();
+        uint64_t others = room.m_route->m_subscribers.load(std::memory_order_acquire) & ~(uint64_t(1) << _self());
+        for (; others != 0; others &= others - 1) {
+            reactors[__builtin_ctzll(others)]->post(msg);
+        }
+        _fan_out(room, msg->m_room, msg->m_seq, msg->m_body);
+    }
+
+    //收件箱里别的线程投来的消息，同一个房间的按序号到达
+    void deliver(shared_message const &msg) {
+        return _fan_out(_room(msg.m_room), msg.m_room, msg.m_seq, msg.m_body, msg.m_notice, msg.m_origin);
+    }
+
+    //分发给每个成员只是把编码好的块挂到它的输出队列上
+    void _fan_out(chat_room &room, uint64_t id, uint64_t seq, bytes_const_view body, notice_kind notice = notice_kind::none, uint32_t origin = 0) {
+        if (room.m_members.empty())
+            return;
+        auto msg = room_message::make(id, seq, body, &m_account, notice);
+        msg->m_origin = origin;
+        ++room.m_publishing;
+        //成员在回调里断开会改动 m_members，所以按下标走
+        for (size_t i = 0; i < room.m_members.size(); ++i) {
+            if (room_subscriber *s = room.m_members[i])
+                s->on_room_message(*msg);
+        }
+        if (--room.m_publishing == 0 && room.m_has_holes) {
+            room.m_members.erase(std::remove(room.m_members.begin(), room.m_members.end(), nullptr), room.m_members.end());
+            room.m_has_holes = false;
+        }
+    }
+
+    //取历史：after 之后最多 limit 条，last 为真时取最后 limit 条
+    //在所有者线程上取，回到本线程再回调；所有者就是本线程时直接回调
+    //没建过的房间就是空的，直接回空页，不为它建房间
+    void query_history(uint64_t id, uint64_t after, size_t limit, bool last, callback<history_page &> done) {
+        if (!room_directory::instance().find(id)) {
+            history_page page;
+            page.m_after = after;
+            return done(page);
+        }
+        reactor *origin = reactor::current();
+        _run_on_owner(id, [id, after, limit, last, origin, done = std::move(done)] () mutable {
+            //已经回了确认的消息可能还在等分发，等它们进了历史再取，发完马上来取的能看到自己发的
+            instance()._after_delivered(id, [id, after, limit, last, origin, done = std::move(done)] () mutable {
+                history_page page = instance()._read_history(id, after, limit, last);
+                if (origin == reactor::current())
+                    return done(page);
+                //done 拿着发起者线程里对象的引用，只能挪来挪去，回到原来的线程再调用和销毁
+                origin->post([page = std::move(page), done = std::move(done)] () mutable {
+                    done(page);
+                });
+            });
+        });
+    }
+
+    //在所有者线程上：这个房间到目前定了序的消息都分发完以后调用 f，没有等着的就直接调用
+    //屏障按顺序完成，后面接着定序的消息不会让 f 一直等下去
+    template <class F>
+    void _after_delivered(uint64_t id, F f) {
+        if (_room(id).m_undelivered == 0)
+            return f();
+        _flush_undurable();
+        auto &mailbox = log_mailbox::instance();
+        uint64_t ticket = mailbox.enqueue(std::move(f));
+        message_log::instance().append_barrier(&mailbox, ticket);
+    }
+
+    history_page _read_history(uint64_t id, uint64_t after, size_t limit, bool last) {
+        room_history const &h = _room(id).m_history;
+        history_page page;
+        page.m_first_seq = h.m_first_seq;
+        page.m_after = !last ? after : h.m_end_seq - 1 > limit ? h.m_end_seq - 1 - limit : 0;
+        h.for_each_since(page.m_after, limit, [&] (shared_message::pointer const &msg) {
+            page.m_messages.push_back(msg);
+        });
+        return page;
+    }
+
+    room_state _take_state(uint64_t id, chat_room const &room) const {
+        room_state state{id, room.m_last_seq, {}, {}};
+        room.m_history.for_each_since(0, room.m_history.size(), [&] (shared_message::pointer const &msg) {
+            state.m_history.push_back(msg);
+        });
+        return state;
+    }
+
+    //归本线程、发过消息的房间，写快照用；序号只算到已经分发的，还没落盘的不进快照
+    std::vector<room_state> owned_states() const {
+        std::vector<room_state> states;
+        for (auto const &[id, room] : m_rooms) {
+            if (room.m_owned && room.m_last_seq != 0) {
+                states.push_back(_take_state(id, room));
+                states.back().m_last_seq -= room.m_undelivered;
+            }
+        }
+        return states;
+    }
+
+    //本线程进了房间的连接，每条一份发送队列的情况
+    std::vector<queue_report> queue_reports() const {
+        std::vector<room_subscriber const *> members;
+        for (auto const &[id, room] : m_rooms) {
+            for (room_subscriber const *s : room.m_members) {
+                if (s)
+                    members.push_back(s);
+            }
+        }
+        std::sort(members.begin(), members.end());
+        members.erase(std::unique(members.begin(), members.end()), members.end());
+        std::vector<queue_report> reports;
+        reports.reserve(members.size());
+        for (room_subscriber const *s : members) {
+            reports.push_back(s->report_queue());
+        }
+        return reports;
+    }
+
+    //到每个线程收集 queue_reports，到齐了回到本线程调用 done
+    //done 只在本线程移动和调用，别的线程拿着的 collection 里已经是空的了
+    static void collect_queue_reports(callback<std::vector<queue_report> &> done) {
+        struct collection {
+            std::mutex m_mutex;
+            std::vector<queue_report> m_reports;
+            size_t m_remaining;
+            callback<std::vector<queue_report> &> m_done;
+        };
+        auto &reactors = reactor::all();
+        auto c = std::make_shared<collection>();
+        c->m_remaining = reactors.size();
+        c->m_done = std::move(done);
+        reactor *origin = reactor::current();
+        for (auto &r : reactors) {
+            r->post([c, origin] {
+                auto reports = instance().queue_reports();
+                std::unique_lock lock(c->m_mutex);
+                c->m_reports.insert(c->m_reports.end(), reports.begin(), reports.end());
+                if (--c->m_remaining != 0)
+                    return;
+                lock.unlock();
+                origin->post([c] {
+                    auto done = std::move(c->m_done);
+                    done(c->m_reports);
+                });
+            });
+        }
+    }
+
+    //先等本线程这之前定序的消息落盘、进了历史，再把归本线程的房间交给 f
+    template <class F>
+    void collect_durable_states(F f) {
+        _flush_undurable();
+        auto &mailbox = log_mailbox::instance();
+        uint64_t ticket = mailbox.enqueue([this, f = std::move(f)] {
+            f(owned_states());
+        });
+        message_log::instance().append_barrier(&mailbox, ticket);
+    }
+
+    //在所有者线程上把房间交给 target：先在收件箱锁里改掉所有者，同时放一个记号
+    //记号之前投来的任务还在这里跑完，跑到记号时把序号和历史打包给 target；target 收到之前先到它那里的任务攒着
+    void migrate(uint64_t id, uint32_t target) {
+        chat_room &room = _room(id);
+        if (!room.m_owned || target == _self() || room.m_route->m_moving.load(std::memory_order_acquire))
+            return;
+        auto &directory = room_directory::instance();
+        directory.m_moving_rooms.fetch_add(1, std::memory_order_acq_rel);
+        directory.m_moves.fetch_add(1, std::memory_order_acq_rel);
+        room.m_route->m_moving.store(true, std::memory_order_release);
+        reactor::current()->hand_over(room.m_route->m_owner, target, [id, target] {
+            instance()._send_state(id, target);
+        });
+    }
+
+    void _send_state(uint64_t id, uint32_t target) {
+        chat_room &room = _room(id);
+        //还有定了序没分发的，先等它们落盘分发完，不然新所有者定的序可能先发出去
+        if (room.m_undelivered != 0) {
+            _flush_undurable();
+            auto &mailbox = log_mailbox::instance();
+            uint64_t ticket = mailbox.enqueue([id, target] {
+                instance()._send_state(id, target);
+            });
+            return message_log::instance().append_barrier(&mailbox, ticket);
+        }
+        room_state state = _take_state(id, room);
+        state.m_dedup = std::move(room.m_dedup);
+        room.m_dedup = publish_dedup();
+        room.m_owned = false;
+        room.m_last_seq = 0;
+        room.m_history.clear();
+        room.m_recent_publishes = 0;
+        reactor::all()[target]->post([state = std::move(state)] () mutable {
+            instance()._adopt(state);
+        });
+    }
+
+    void _adopt(room_state &state) {
+        chat_room &room = _room(state.m_room);
+        room.m_owned = true;
+        room.m_last_seq = state.m_last_seq;
+        for (auto &msg : state.m_history) {
+            room.m_history.push(std::move(msg));
+        }
+        room.m_dedup = std::move(state.m_dedup);
+        room.m_route->m_moving.store(false, std::memory_order_release);
+        room_directory::instance().m_moving_rooms.fetch_sub(1, std::memory_order_acq_rel);
+        std::vector<callback<>> waiting = std::move(room.m_waiting);
+        room.m_waiting.clear();
+        for (auto &task : waiting) {
+            task();
+        }
+    }
+
+    void schedule_rebalance() {
+        timer_queue::instance().add(rebalance_interval, [this] {
+            _rebalance();
+            return schedule_rebalance();
+        });
+    }
+
+    //每个周期统计本线程定序的条数；比最闲的线程多出很多，就把一个房间交给它
+    //只挪比差距小的房间，挪过去两边才会更接近，单独一个很热的房间不会被来回挪
+    void _rebalance() {
+        uint64_t load = 0;
+        for (auto const &[id, room] : m_rooms) {
+            load += room.m_recent_publishes;
+        }
+        auto &reactors = reactor::all();
+        reactors[_self()]->m_load.store(load, std::memory_order_relaxed);
+        uint32_t idle = _self();
+        uint64_t idle_load = load;
+        for (auto const &r : reactors) {
+            uint64_t l = r->m_load.load(std::memory_order_relaxed);
+            if (l < idle_load) {
+                idle = static_cast<uint32_t>(r->m_index);
+                idle_load = l;
+            }
+        }
+        uint64_t candidate = 0, candidate_load = 0;
+        for (auto &[id, room] : m_rooms) {
+            uint64_t n = std::exchange(room.m_recent_publishes, 0);
+            if (room.m_owned && n > candidate_load && n < load - idle_load) {
+                candidate = id;
+                candidate_load = n;
+            }
+        }
+        if (load >= rebalance_min_load && idle != _self() && candidate_load != 0) {
+            migrate(candidate, idle);
+        }
+    }
+};
+
+//启动时从快照和日志读出来的房间状态，先攒在这里，每个事件循环线程再挑出归自己的房间恢复
+//正文指着映射进来的快照和日志段，这两样都一直映射着
+struct room_restore_list {
+    struct _entry {
+        uint64_t m_room;
+        uint64_t m_seq;
+        bytes_const_view m_body;
+        bool m_last_seq_only;
+    };
+    std::vector<_entry> m_entries;
+
+    void restore(uint64_t id, uint64_t seq, bytes_const_view body) {
+        m_entries.push_back({id, seq, body, false});
+    }
+
+    void restore_last_seq(uint64_t id, uint64_t seq) {
+        m_entries.push_back({id, seq, {}, true});
+    }
+
+    void apply(room_registry &registry) const {
+        for (auto const &e : m_entries) {
+            if (e.m_last_seq_only) {
+                registry.restore_last_seq(e.m_room, e.m_seq);
+            } else {
+                registry.restore(e.m_room, e.m_seq, e.m_body);
+            }
+        }
+    }
+};
+
+//房间状态的快照：每个房间的最新序号、历史环里的消息，再加上快照对应的日志位置
+//平铺的格式，启动时整个映射进来就地使用，历史消息的正文直接指着映射，不拷贝
+//重启时先读快照，日志只需要从记下的位置往后回放
+//写的时候先写临时文件，落盘后再改名，所以读到的快照总是完整的；crc 只校验表，不校验正文
+//房间成员是连接，重启后本来就不在了，不进快照
+struct room_snapshot {
+    struct header {
+        char m_magic[8];
+        uint32_t m_crc;
+        uint32_t m_version;
+        uint64_t m_log_position;
+        uint64_t m_room_count;
+        uint64_t m_message_count;
+        uint64_t m_size;
+    };
+    struct room_entry {
+        uint64_t m_room;
+        uint64_t m_last_seq;
+        uint64_t m_first_message;   // 在消息表里的下标
+        uint64_t m_message_count;
+    };
+    struct message_entry {
+        uint64_t m_seq;
+        uint64_t m_offset;  // 正文在文件里的位置
+        uint64_t m_size;
+    };
+    static constexpr char magic[8] = {'C', 'H', 'A', 'T', 'S', 'N', 'P', '1'};
+    static constexpr auto interval = std::chrono::seconds(60);
+
+    std::string m_path;
+    char *m_map = nullptr;      // 启动时读进来的快照，历史消息还指着它，一直映射着
+    size_t m_map_size = 0;
+    std::thread m_writer;
+    std::atomic<bool> m_writing{false};
+    uint64_t m_saved_position = 0;  // 上次快照的日志位置，没有新消息就不再写
+    bool m_collecting = false;      // 在等各个线程交房间
+
+    static room_snapshot &instance() {
+        static room_snapshot snapshot;
+        return snapshot;
+    }
+
+    //返回快照对应的日志位置；没有快照或者快照坏了返回 0，日志从头回放
+    uint64_t load(std::string path, room_restore_list &registry) {
+        m_path = std::move(path);
+        int fd = CHECK_CALL_EXCEPT(ENOENT, ::open, m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return 0;
+        size_t size = CHECK_CALL(lseek, fd, 0, SEEK_END);
+        if (size < sizeof(header)) {
+            close(fd);
+            return 0;
+        }
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            check_error(SOURCE_INFO() "mmap", -1);
+        }
+        m_map = static_cast<char *>(p);
+        m_map_size = size;
+        header h;
+        memcpy(&h, m_map, sizeof(h));
+        size_t tables = h.m_room_count * sizeof(room_entry) + h.m_message_count * sizeof(message_entry);
+        if (memcmp(h.m_magic, magic, sizeof(magic)) != 0 || h.m_version != 1 || h.m_size != size
+            || tables > size - sizeof(h) || h.m_crc != crc32({m_map + sizeof(h), tables})) {
+            fmt::println("快照 {} 损坏，忽略", m_path);
+            munmap(m_map, m_map_size);
+            m_map = nullptr;
+            return 0;
+        }
+        auto const *rooms = reinterpret_cast<room_entry const *>(m_map + sizeof(h));
+        auto const *messages = reinterpret_cast<message_entry const *>(rooms + h.m_room_count);
+        for (uint64_t i = 0; i < h.m_room_count; ++i) {
+            room_entry const &room = rooms[i];
+            for (uint64_t j = 0; j < room.m_message_count && room.m_first_message + j < h.m_message_count; ++j) {
+                message_entry const &msg = messages[room.m_first_message + j];
+                if (msg.m_offset > size || msg.m_size > size - msg.m_offset)
+                    continue;
+                registry.restore(room.m_room, msg.m_seq, bytes_const_view{m_map + msg.m_offset, msg.m_size});
+            }
+            registry.restore_last_seq(room.m_room, room.m_last_seq);
+        }
+        m_saved_position = h.m_log_position;
+        return h.m_log_position;
+    }
+
+    //各个线程交上来的房间拼成快照，交给后台线程写盘；上一份还没写完就跳过这次
+    void save(std::vector<room_state> const &rooms, uint64_t log_position) {
+        if (m_writing.load(std::memory_order_acquire))
+            return;
+        if (m_writer.joinable()) {
+            m_writer.join();
+        }
+        header h{};
+        memcpy(h.m_magic, magic, sizeof(magic));
+        h.m_version = 1;
+        h.m_log_position = log_position;
+        h.m_room_count = rooms.size();
+        for (auto const &room : rooms) {
+            h.m_message_count += room.m_history.size();
+        }
+        size_t tables = h.m_room_count * sizeof(room_entry) + h.m_message_count * sizeof(message_entry);
+        //正文接在表后面，data 会一直变长，表项按偏移写
+        std::vector<char> data(sizeof(h) + tables);
+        size_t room_pos = sizeof(h);
+        size_t message_pos = sizeof(h) + h.m_room_count * sizeof(room_entry);
+        uint64_t message_index = 0;
+        for (auto const &room : rooms) {
+            room_entry entry{room.m_room, room.m_last_seq, message_index, room.m_history.size()};
+            memcpy(data.data() + room_pos, &entry, sizeof(entry));
+            room_pos += sizeof(entry);
+            for (auto const &msg : room.m_history) {
+                message_entry entry{msg->m_seq, data.size(), msg->m_body.size()};
+                memcpy(data.data() + message_pos, &entry, sizeof(entry));
+                message_pos += sizeof(entry);
+                ++message_index;
+                data.insert(data.end(), msg->m_body.begin(), msg->m_body.end());
+            }
+        }
+        h.m_size = data.size();
+        h.m_crc = crc32({data.data() + sizeof(h), tables});
+        memcpy(data.data(), &h, sizeof(h));
+        m_saved_position = log_position;
+        m_writing.store(true, std::memory_order_release);
+        m_writer = std::thread([this, data = std::move(data)] {
+            std::string tmp = m_path + ".tmp";
+            int fd = CHECK_CALL(::open, tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            for (size_t done = 0; done < data.size();) {
+                done += CHECK_CALL(write, fd, data.data() + done, data.size() - done);
+            }
+            CHECK_CALL(fdatasync, fd);
+            close(fd);
+            CHECK_CALL(rename, tmp.c_str(), m_path.c_str());
+            std::string dir = m_path.substr(0, m_path.rfind('/'));
+            int dirfd = CHECK_CALL(::open, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            CHECK_CALL(fsync, dirfd);
+            close(dirfd);
+            m_writing.store(false, std::memory_order_release);
+        });
+    }
+
+    //定时检查，有新消息落了盘就让每个线程交出归它的房间，到齐了在本线程拼好写盘
+    //日志位置取落了盘的位置，在收集之前取：每个线程等它之前定序的消息落盘分发完才交房间，这个位置之前的记录一定已经在历史里了
+    //取写进去还没落盘的位置不行：崩溃后日志尾巴截短，重启从快照位置接着写，这中间的新记录下次重启会被跳过
+    //收集期间有房间换了线程，交上来的可能缺了它，这次作废
+    void schedule() {
+        timer_queue::instance().add(interval, [this] {
+            auto &directory = room_directory::instance();
+            uint64_t position = message_log::instance().durable_position();
+            if (position != m_saved_position && !m_collecting && directory.m_moving_rooms.load(std::memory_order_acquire) == 0) {
+                _collect(position, directory.m_moves.load(std::memory_order_acquire));
+            }
+            return schedule();
+        });
+    }
+
+    struct _collection {
+        std::mutex m_mutex;
+        std::vector<room_state> m_rooms;
+        size_t m_remaining;
+    };
+
+    void _collect(uint64_t position, uint64_t moves) {
+        m_collecting = true;
+        auto &reactors = reactor::all();
+        auto collection = std::make_shared<_collection>();
+        collection->m_remaining = reactors.size();
+        reactor *origin = reactor::current();
+        for (auto &r : reactors) {
+            r->post([this, collection, origin, position, moves] {
+                room_registry::instance().collect_durable_states([this, collection, origin, position, moves] (std::vector<room_state> states) {
+                    std::unique_lock lock(collection->m_mutex);
+                    std::move(states.begin(), states.end(), std::back_inserter(collection->m_rooms));
+                    if (--collection->m_remaining != 0)
+                        return;
+                    lock.unlock();
+                    origin->post([this, collection, position, moves] {
+                        m_collecting = false;
+                        if (room_directory::instance().m_moves.load(std::memory_order_acquire) == moves) {
+                            save(collection->m_rooms, position);
+                        }
+                    });
+                });
+            });
+        }
+    }
+
+    ~room_snapshot() {
+        if (m_writer.joinable()) {
+            m_writer.join();
+        }
+        if (m_map) {
+            munmap(m_map, m_map_size);
+        }
+    }
+};
+
+//在线状态用的压缩位图，照着 roaring 的做法：32 位整数按高 16 位分桶
+//桶里个数不多就存有序的低 16 位数组，多了换成 65536 位的位图；稀疏的省内存，稠密的按字做交集
+struct presence_bitmap {
+    static constexpr size_t array_limit = 4096;     // 这么多个 uint16 和位图一样大，再多就换位图
+
+    struct _container {
+        uint16_t m_key = 0;
+        uint32_t m_count = 0;
+        std::vector<uint16_t> m_array;  // 稀疏：有序
+        std::vector<uint64_t> m_bits;   // 稠密：1024 个字，不空就用它
+
+        bool dense() const noexcept {
+            return !m_bits.empty();
+        }
+
+        bool contains(uint16_t low) const {
+            if (dense())
+                return m_bits[low >> 6] >> (low & 63) & 1;
+            return std::binary_search(m_array.begin(), m_array.end(), low);
+        }
+
+        bool add(uint16_t low) {
+            if (dense()) {
+                uint64_t bit = uint64_t(1) << (low & 63);
+                if (m_bits[low >> 6] & bit)
+                    return false;
+                m_bits[low >> 6] |= bit;
+            } else {
+                auto it = std::lower_bound(m_array.begin(), m_array.end(), low);
+                if (it != m_array.end() && *it == low)
+                    return false;
+                m_array.insert(it, low);
+            }
+            ++m_count;
+            _normalize();
+            return true;
+        }
+
+        bool remove(uint16_t low) {
+            if (dense()) {
+                uint64_t bit = uint64_t(1) << (low & 63);
+                if (!(m_bits[low >> 6] & bit))
+                    return false;
+                m_bits[low >> 6] &= ~bit;
+            } else {
+                auto it = std::lower_bound(m_array.begin(), m_array.end(), low);
+                if (it == m_array.end() || *it != low)
+                    return false;
+                m_array.erase(it);
+            }
+            --m_count;
+            _normalize();
+            return true;
+        }
+
+        //按个数在数组和位图之间换；换回数组留一半余量，边界上来回进出不会反复换
+        void _normalize() {
+            if (!dense() && m_count > array_limit) {
+                m_bits.assign(1024, 0);
+                for (uint16_t low : m_array) {
+                    m_bits[low >> 6] |= uint64_t(1) << (low & 63);
+                }
+                m_array = std::vector<uint16_t>();
+            } else if (dense() && m_count <= array_limit / 2) {
+                m_array.reserve(m_count);
+                for_each([&] (uint16_t low) {
+                    m_array.push_back(low);
+                });
+                m_bits = std::vector<uint64_t>();
+            }
+        }
+
+        template <class F>
+        void for_each(F &&f) const {
+            if (!dense()) {
+                for (uint16_t low : m_array) {
+                    f(low);
+                }
+                return;
+            }
+            for (size_t i = 0; i < m_bits.size(); ++i) {
+                for (uint64_t word = m_bits[i]; word != 0; word &= word - 1) {
+                    f(static_cast<uint16_t>(i * 64 + __builtin_ctzll(word)));
+                }
+            }
+        }
+    };
+
+    std::vector<_container> m_containers;   // 按 m_key 排好序
+    size_t m_count = 0;
+
+    size_t size() const noexcept {
+        return m_count;
+    }
+
+    template <class Containers>
+    static auto _lower_bound(Containers &containers, uint16_t key) {
+        return std::lower_bound(containers.begin(), containers.end(), key, [] (_container const &c, uint16_t key) {
+            return c.m_key < key;
+        });
+    }
+
+    bool add(uint32_t x) {
+        uint16_t key = static_cast<uint16_t>(x >> 16);
+        auto it = _lower_bound(m_containers, key);
+        if (it == m_containers.end() || it->m_key != key) {
+            it = m_containers.insert(it, _container());
+            it->m_key = key;
+        }
+        if (!it->add(static_cast<uint16_t>(x)))
+            return false;
+        ++m_count;
+        return true;
+    }
+
+    bool remove(uint32_t x) {
+        uint16_t key = static_cast<uint16_t>(x >> 16);
+        auto it = _lower_bound(m_containers, key);
+        if (it == m_containers.end() || it->m_key != key || !it->remove(static_cast<uint16_t>(x)))
+            return false;
+        if (it->m_count == 0)
+            m_containers.erase(it);
+        --m_count;
+        return true;
+    }
+
+    bool contains(uint32_t x) const {
+        uint16_t key = static_cast<uint16_t>(x >> 16);
+        auto it = _lower_bound(m_containers, key);
+        return it != m_containers.end() && it->m_key == key && it->contains(static_cast<uint16_t>(x));
+    }
+
+    template <class F>
+    void for_each(F &&f) const {
+        for (auto const &c : m_containers) {
+            c.for_each([&] (uint16_t low) {
+                f(static_cast<uint32_t>(c.m_key) << 16 | low);
+            });
+        }
+    }
+
+    //两个桶：intersect 为真取交集，否则取 a 去掉 b
+    //两边都是位图就按字算；否则从数组那边逐个挑，结果按个数再决定存成什么
+    static _container _combine(_container const &a, _container const &b, bool intersect) {
+        _container out;
+        out.m_key = a.m_key;
+        if (a.dense() && b.dense()) {
+            out.m_bits.resize(a.m_bits.size());
+            for (size_t i = 0; i < a.m_bits.size(); ++i) {
+                out.m_bits[i] = intersect ? a.m_bits[i] & b.m_bits[i] : a.m_bits[i] & ~b.m_bits[i];
+                out.m_count += __builtin_popcountll(out.m_bits[i]);
+            }
+        } else if (!intersect && a.dense()) {
+            out = a;
+            for (uint16_t low : b.m_array) {
+                if (out.contains(low)) {
+                    out.m_bits[low >> 6] &= ~(uint64_t(1) << (low & 63));
+                    --out.m_count;
+                }
+            }
+        } else {
+            _container const &from = intersect && a.dense() ? b : a;
+            _container const &other = &from == &a ? b : a;
+            from.for_each([&] (uint16_t low) {
+                if (other.contains(low) == intersect) {
+                    out.m_array.push_back(low);
+                    ++out.m_count;
+                }
+            });
+        }
+        if (out.dense() && out.m_count == 0) {
+            out.m_bits.clear();
+        }
+        out._normalize();
+        return out;
+    }
+
+    static presence_bitmap _merge(presence_bitmap const &a, presence_bitmap const &b, bool intersect) {
+        presence_bitmap out;
+        auto j = b.m_containers.begin();
+        for (auto const &c : a.m_containers) {
+            while (j != b.m_containers.end() && j->m_key < c.m_key) {
+                ++j;
+            }
+            if (j == b.m_containers.end() || j->m_key != c.m_key) {
+                if (!intersect) {
+                    out.m_containers.push_back(c);
+                    out.m_count += c.m_count;
+                }
+                continue;
+            }
+            auto combined = _combine(c, *j, intersect);
+            if (combined.m_count != 0) {
+                out.m_count += combined.m_count;
+                out.m_containers.push_back(std::move(combined));
+            }
+        }
+        return out;
+    }
+
+    static presence_bitmap intersect(presence_bitmap const &a, presence_bitmap const &b) {
+        return _merge(a, b, true);
+    }
+
+    static presence_bitmap difference(presence_bitmap const &a, presence_bitmap const &b) {
+        return _merge(a, b, false);
+    }
+};
+
+//把名字或者房间号换成从 1 开始的连续整数，位图里存的是这个；号不回收，反查只是取下标
+//号不回收，所以总数有上限：满了以后新的键拿到 0，当作没有
+template <class Key>
+struct dense_ids {
+    std::shared_mutex m_mutex;
+    std::unordered_map<Key, uint32_t> m_ids;
+    std::vector<Key> m_keys{Key()};     // 0 号不用，表示没有
+    size_t m_max_size;
+
+    explicit dense_ids(size_t max_size) : m_max_size(max_size) {}
+
+    uint32_t intern(Key const &key) {
+        if (uint32_t id = find(key))
+            return id;
+        std::unique_lock lock(m_mutex);
+        auto it = m_ids.find(key);
+        if (it != m_ids.end())
+            return it->second;
+        if (m_ids.size() >= m_max_size)
+            return 0;
+        m_ids.emplace(key, static_cast<uint32_t>(m_keys.size()));
+        m_keys.push_back(key);
+        return static_cast<uint32_t>(m_keys.size() - 1);
+    }
+
+    uint32_t find(Key const &key) {
+        std::shared_lock lock(m_mutex);
+        auto it = m_ids.find(key);
+        return it == m_ids.end() ? 0 : it->second;
+    }
+
+    Key key(uint32_t id) {
+        std::shared_lock lock(m_mutex);
+        return m_keys[id];
+    }
+};
+
+//谁在哪个房间在线：房间 -> 在线用户的位图，用户 -> 所在房间的位图，按编号分片各自加锁
+//同一个用户在一个房间开了几个连接只算一次，连接数减到 0 才算离开；两张表在房间分片的锁里一起改
+//变化不是一个连接发一条：房间记成脏的，每 notify_interval 每个脏房间只广播一条，带上这段时间里进来和离开的人
+//只管本节点的连接，集群里别的节点各算各的
+struct presence {
+    static constexpr size_t shard_count = 64;
+    static constexpr auto notify_interval = std::chrono::milliseconds(100);
+    static constexpr size_t max_listed = 32;    // 一次进出的人多于这些就只报人数
+    //名字是客户端自报的，没有认证，编号又不回收：太长的不记，记满了的新名字也不记，这样的连接不算在线状态
+    static constexpr size_t max_name_size = 64;
+    static constexpr size_t max_users = 1 << 20;
+
+    struct _room {
+        presence_bitmap m_online;
+        presence_bitmap m_notified;     // 上次通知时在线的人
+        std::unordered_map<uint32_t, uint32_t> m_connections;   // 每个用户在这个房间的连接数
+        bool m_dirty = false;
+    };
+    struct _room_shard {
+        std::mutex m_mutex;
+        std::unordered_map<uint32_t, _room> m_rooms;
+        std::vector<uint32_t> m_dirty;
+    };
+    struct _user_shard {
+        std::mutex m_mutex;
+        std::unordered_map<uint32_t, presence_bitmap> m_rooms;
+    };
+    dense_ids<std::string> m_users{max_users};
+    dense_ids<uint64_t> m_room_ids{room_directory::max_rooms};
+    _room_shard m_room_shards[shard_count];
+    _user_shard m_user_shards[shard_count];
+
+    static presence &instance() {
+        static presence p;
+        return p;
+    }
+
+    //没见过的名字返回 0；查的键放在线程自己的缓冲里，不用每次分配
+    uint32_t find_user(std::string_view name) {
+        static thread_local std::string key;
+        key.assign(name);
+        return m_users.find(key);
+    }
+
+    //记不下的名字返回 0
+    uint32_t intern_user(std::string_view name) {
+        if (name.empty() || name.size() > max_name_size)
+            return 0;
+        return m_users.intern(std::string(name));
+    }
+
+    //user 为 0 是没报过名字的连接，不算在线状态
+    void join(uint64_t room, uint32_t user) {
+        if (user == 0)
+            return;
+        uint32_t r = m_room_ids.intern(room);
+        if (r == 0)
+            return;
+        auto &shard = m_room_shards[r % shard_count];
+        std::lock_guard lock(shard.m_mutex);
+        auto &state = shard.m_rooms[r];
+        if (state.m_connections[user]++ != 0)
+            return;
+        state.m_online.add(user);
+        _mark_dirty(shard, r, state);
+        auto &users = m_user_shards[user % shard_count];
+        std::lock_guard user_lock(users.m_mutex);
+        users.m_rooms[user].add(r);
+    }
+
+    void leave(uint64_t room, uint32_t user) {
+        if (user == 0)
+            return;
+        uint32_t r = m_room_ids.find(room);
+        if (r == 0)
+            return;
+        auto &shard = m_room_shards[r % shard_count];
+        std::lock_guard lock(shard.m_mutex);
+        auto it = shard.m_rooms.find(r);
+        if (it == shard.m_rooms.end())
+            return;
+        auto &state = it->second;
+        auto count = state.m_connections.find(user);
+        if (count == state.m_connections.end() || --count->second != 0)
+            return;
+        state.m_connections.erase(count);
+        state.m_online.remove(user);
+        _mark_dirty(shard, r, state);
+        auto &users = m_user_shards[user % shard_count];
+        std::lock_guard user_lock(users.m_mutex);
+        auto rooms = users.m_rooms.find(user);
+        if (rooms != users.m_rooms.end()) {
+            rooms->second.remove(r);
+            if (rooms->second.size() == 0)
+                users.m_rooms.erase(rooms);
+        }
+    }
+
+    static void _mark_dirty(_room_shard &shard, uint32_t r, _room &state) {
+        if (!state.m_dirty) {
+            state.m_dirty = true;
+            shard.m_dirty.push_back(r);
+        }
+    }
+
+    //房间里在线的人
+    presence_bitmap online(uint64_t room) {
+        uint32_t r = m_room_ids.find(room);
+        if (r == 0)
+            return {};
+        auto &shard = m_room_shards[r % shard_count];
+        std::lock_guard lock(shard.m_mutex);
+        auto it = shard.m_rooms.find(r);
+        return it == shard.m_rooms.end() ? presence_bitmap() : it->second.m_online;
+    }
+
+    //一串名字对应的位图，没见过的名字不会在线，直接跳过
+    presence_bitmap users(std::vector<std::string_view> const &names) {
+        presence_bitmap set;
+        for (auto name : names) {
+            if (uint32_t id = find_user(name))
+                set.add(id);
+        }
+        return set;
+    }
+
+    std::vector<uint64_t> rooms_of(std::string_view name) {
+        std::vector<uint64_t> rooms;
+        uint32_t user = find_user(name);
+        if (user == 0)
+            return rooms;
+        presence_bitmap set;
+        {
+            auto &shard = m_user_shards[user % shard_count];
+            std::lock_guard lock(shard.m_mutex);
+            auto it = shard.m_rooms.find(user);
+            if (it == shard.m_rooms.end())
+                return rooms;
+            set = it->second;
+        }
+        set.for_each([&] (uint32_t r) {
+            rooms.push_back(m_room_ids.key(r));
+        });
+        return rooms;
+    }
+
+    std::string name(uint32_t user) {
+        return m_users.key(user);
+    }
+
+    //只在第一个事件循环线程上排
+    void schedule() {
+        timer_queue::instance().add(notify_interval, [this] {
+            _notify();
+            return schedule();
+        });
+    }
+
+    //每个脏房间和上次通知时比，算出进来和离开的人，拼成一条 "<人数> +进来的 -离开的" 的 presence 通知广播出去
+    void _notify() {
+        std::vector<std::pair<uint64_t, std::string>> notices;
+        for (auto &shard : m_room_shards) {
+            std::lock_guard lock(shard.m_mutex);
+            for (uint32_t r : shard.m_dirty) {
+                auto it = shard.m_rooms.find(r);
+                auto &state = it->second;
+                state.m_dirty = false;
+                auto joined = presence_bitmap::difference(state.m_online, state.m_notified);
+                auto left = presence_bitmap::difference(state.m_notified, state.m_online);
+                if (joined.size() != 0 || left.size() != 0) {
+                    notices.emplace_back(m_room_ids.key(r), _describe(state.m_online.size(), joined, left));
+                    state.m_notified = state.m_online;
+                }
+                if (state.m_online.size() == 0) {
+                    shard.m_rooms.erase(it);
+                }
+            }
+            shard.m_dirty.clear();
+        }
+        auto &registry = room_registry::instance();
+        for (auto const &[room, text] : notices) {
+            registry.broadcast(room, notice_kind::presence, bytes_const_view{text.data(), text.size()});
+        }
+    }
+
+    std::string _describe(size_t count, presence_bitmap const &joined, presence_bitmap const &left) {
+        std::string text = fmt::format("{}", count);
+        if (joined.size() + left.size() > max_listed)
+            return text;
+        joined.for_each([&] (uint32_t user) {
+            text += " +";
+            text += m_users.key(user);
+        });
+        left.for_each([&] (uint32_t user) {
+            text += " -";
+            text += m_users.key(user);
+        });
+        return text;
     }
 };
 
-template <class HeaderWriter = http11_header_writer>
-struct http_request_writer : _http_base_writer<HeaderWriter> {
-    void begin_header(int status) {
-        this->_begin_header("HTTP/1.1", std::to_string(status), "OK");
+//已读回执：每个 (房间, 用户) 只记一个水位，就是读到的最大序号，不按消息一条条记；未读数是房间最新的序号减水位
+//按用户分片，每个用户一个按房间号排好的小数组，路由的指针也存在里面，算一个人所有房间的未读就是顺着扫一遍读几个原子量
+//水位只往前走，也不会超过房间最新的序号；第一次进房间时从当时最新的序号算起，之前的不算未读
+//回执走 ephemeral 事件（种类 read，值是序号），周期内同一个人同一个房间只留最后一个，刷出去时一批写进来
+//开集群时水位只记在房间的家节点上，那里的最新序号才一直是准的：别的节点合并好的一批转到家节点再记，查未读数也要问家节点
+//每 save_interval 有改动就整个写进数据目录里的一个文件，先写临时文件再改名；重启时读回来，最多丢最后一个周期的
+struct read_receipts {
+    static constexpr size_t shard_count = 64;
+    static constexpr auto save_interval = std::chrono::seconds(10);
+    static constexpr char magic[8] = {'C', 'H', 'A', 'T', 'R', 'C', 'P', '1'};
+
+    struct mark {
+        uint64_t m_room;
+        room_route *m_route;
+        uint64_t m_seq;
+
+        uint64_t unread() const noexcept {
+            uint64_t head = m_route->m_head.load(std::memory_order_relaxed);
+            return head > m_seq ? head - m_seq : 0;
+        }
+    };
+    struct update {
+        uint32_t m_user;
+        uint64_t m_room;
+        uint64_t m_seq;
+    };
+    struct _shard {
+        std::mutex m_mutex;
+        std::unordered_map<uint32_t, std::vector<mark>> m_users;
+    };
+    //文件里先是头，后面一项一项：房间、水位、名字的字节数、名字；名字重启后编号会变，所以存名字
+    struct _file_header {
+        char m_magic[8];
+        uint32_t m_crc;
+        uint32_t m_version;
+        uint64_t m_count;
+    };
+    struct _file_entry {
+        uint64_t m_room;
+        uint64_t m_seq;
+        uint64_t m_name_size;
+    };
+    _shard m_shards[shard_count];
+    std::string m_path;
+    std::atomic<uint64_t> m_changes{0};     // 水位往前走一次加一，没变过就不用再写
+    uint64_t m_saved_changes = 0;
+    std::thread m_writer;
+    std::atomic<bool> m_writing{false};
+
+    static read_receipts &instance() {
+        static read_receipts receipts;
+        return receipts;
+    }
+
+    //找到或者插入这个房间的水位，新插入的从 seq 和 head 里小的算起；只查房间不建房间，没建过的房间返回空
+    //进房间时 seq 不给，就是从 head 算；别的节点上的人没在这里进过房间，第一个回执就是水位
+    //插入了新的水位也算改动，要写进文件
+    mark *_mark(std::vector<mark> &marks, uint64_t room, uint64_t seq = std::numeric_limits<uint64_t>::max()) {
+        auto it = std::lower_bound(marks.begin(), marks.end(), room, [] (mark const &m, uint64_t room) {
+            return m.m_room < room;
+        });
+        if (it == marks.end() || it->m_room != room) {
+            room_route *route = room_directory::instance().find(room);
+            if (!route)
+                return nullptr;
+            it = marks.insert(it, {room, route, std::min(seq, route->m_head.load(std::memory_order_relaxed))});
+            m_changes.fetch_add(1, std::memory_order_relaxed);
+        }
+        return &*it;
+    }
+
+    //家在别的节点的房间不在这里记，那边收到第一个回执时才开始算
+    void track(uint64_t room, uint32_t user) {
+        if (user == 0 || cluster_ring::instance().is_remote(room))
+            return;
+        auto &shard = m_shards[user % shard_count];
+        std::lock_guard lock(shard.m_mutex);
+        _mark(shard.m_users[user], room);
+    }
+
+    //排好序，一个分片只拿一次锁
+    void apply(std::vector<update> &updates) {
+        std::sort(updates.begin(), updates.end(), [] (update const &a, update const &b) {
+            return std::pair(a.m_user % shard_count, a.m_user) < std::pair(b.m_user % shard_count, b.m_user);
+        });
+        for (size_t i = 0; i < updates.size();) {
+            auto &shard = m_shards[updates[i].m_user % shard_count];
+            std::lock_guard lock(shard.m_mutex);
+            do {
+                if (mark *m = _mark(shard.m_users[updates[i].m_user], updates[i].m_room, updates[i].m_seq)) {
+                    uint64_t seq = std::min(updates[i].m_seq, m->m_route->m_head.load(std::memory_order_relaxed));
+                    if (seq > m->m_seq) {
+                        m->m_seq = seq;
+                        m_changes.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                ++i;
+            } while (i < updates.size() && &m_shards[updates[i].m_user % shard_count] == &shard);
+        }
+    }
+
+    std::vector<mark> marks(uint32_t user) {
+        auto &shard = m_shards[user % shard_count];
+        std::lock_guard lock(shard.m_mutex);
+        auto it = shard.m_users.find(user);
+        return it == shard.m_users.end() ? std::vector<mark>() : it->second;
+    }
+
+    //在第一个事件循环线程恢复完房间以后调用：文件里的房间按恢复时的规矩建出来，水位原样放回去
+    //家已经不在本节点的房间丢掉；文件不存在或者坏了就当没有
+    void load(std::string path) {
+        m_path = std::move(path);
+        int fd = CHECK_CALL_EXCEPT(ENOENT, ::open, m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return;
+        std::vector<char> data(CHECK_CALL(lseek, fd, 0, SEEK_END));
+        for (size_t done = 0; done < data.size();) {
+            done += CHECK_CALL(pread, fd, data.data() + done, data.size() - done, done);
+        }
+        close(fd);
+        _file_header header;
+        if (data.size() < sizeof(header))
+            return;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.m_magic, magic, sizeof(magic)) != 0 || header.m_version != 1
+            || header.m_crc != crc32({data.data() + sizeof(header), data.size() - sizeof(header)})) {
+            fmt::println("已读水位 {} 损坏，忽略", m_path);
+            return;
+        }
+        auto &online = presence::instance();
+        auto &ring = cluster_ring::instance();
+        size_t pos = sizeof(header);
+        for (uint64_t i = 0; i < header.m_count; ++i) {
+            _file_entry entry;
+            if (data.size() - pos < sizeof(entry))
+                break;
+            memcpy(&entry, data.data() + pos, sizeof(entry));
+            pos += sizeof(entry);
+            if (data.size() - pos < entry.m_name_size)
+                break;
+            uint32_t user = online.intern_user({data.data() + pos, entry.m_name_size});
+            pos += entry.m_name_size;
+            if (user == 0 || ring.is_remote(entry.m_room))
+                continue;
+            room_route *route = room_directory::instance().create(entry.m_room, true);
+            auto &shard = m_shards[user % shard_count];
+            std::lock_guard lock(shard.m_mutex);
+            auto &marks = shard.m_users[user];
+            auto it = std::lower_bound(marks.begin(), marks.end(), entry.m_room, [] (mark const &m, uint64_t room) {
+                return m.m_room < room;
+            });
+            if (it == marks.end() || it->m_room != entry.m_room) {
+                marks.insert(it, {entry.m_room, route, entry.m_seq});
+            }
+        }
+    }
+
+    //只在第一个事件循环线程上排；各分片锁着拷出来，后台线程写盘，上一次还没写完就等下一个周期
+    void schedule() {
+        timer_queue::instance().add(save_interval, [this] {
+            uint64_t changes = m_changes.load(std::memory_order_relaxed);
+            if (changes != m_saved_changes && !m_writing.load(std::memory_order_acquire)) {
+                m_saved_changes = changes;
+                _save();
+            }
+            return schedule();
+        });
+    }
+
+    void _save() {
+        if (m_writer.joinable()) {
+            m_writer.join();
+        }
+        auto &online = presence::instance();
+        std::vector<char> data(sizeof(_file_header));
+        uint64_t count = 0;
+        std::string name;
+        for (auto &shard : m_shards) {
+            std::lock_guard lock(shard.m_mutex);
+            for (auto const &[user, marks] : shard.m_users) {
+                name = online.name(user);
+                for (auto const &m : marks) {
+                    _file_entry entry{m.m_room, m.m_seq, name.size()};
+                    auto const *p = reinterpret_cast<char const *>(&entry);
+                    data.insert(data.end(), p, p + sizeof(entry));
+                    data.insert(data.end(), name.begin(), name.end());
+                    ++count;
+                }
+            }
+        }
+        _file_header header{};
+        memcpy(header.m_magic, magic, sizeof(magic));
+        header.m_version = 1;
+        header.m_count = count;
+        header.m_crc = crc32({data.data() + sizeof(header), data.size() - sizeof(header)});
+        memcpy(data.data(), &header, sizeof(header));
+        m_writing.store(true, std::memory_order_release);
+        m_writer = std::thread([this, data = std::move(data)] {
+            std::string tmp = m_path + ".tmp";
+            int fd = CHECK_CALL(::open, tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            for (size_t done = 0; done < data.size();) {
+                done += CHECK_CALL(write, fd, data.data() + done, data.size() - done);
+            }
+            CHECK_CALL(fdatasync, fd);
+            close(fd);
+            CHECK_CALL(rename, tmp.c_str(), m_path.c_str());
+            //改名也要落盘，不然崩溃后可能还是旧文件
+            std::string dir = m_path.substr(0, m_path.rfind('/'));
+            int dirfd = CHECK_CALL(::open, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            CHECK_CALL(fsync, dirfd);
+            close(dirfd);
+            m_writing.store(false, std::memory_order_release);
+        });
+    }
+
+    ~read_receipts() {
+        if (m_writer.joinable()) {
+            m_writer.join();
+        }
+    }
+};
+
+//打字中、读到哪了这类短命的事件：不定序、不进历史也不写日志，丢了也无所谓
+//按 (房间, 用户, 种类) 只留最新的值；每个事件循环线程自己攒，flush_interval 一到每个房间合成一条广播出去
+//一个房间里再多人在打字，一个周期也只分发一次，不像普通消息那样一条事件一次
+//种类只有固定的几个，一个人在一个房间里一个周期最多占几项；按 (用户, 种类) 查表，合并是 O(1)
+//广播的是 ephemeral 通知，正文每行 "<用户> <种类> <值>"
+//开集群时家在别的节点的房间，合并好的一批也发给家节点，家节点再转给别的节点，本节点的成员在这里已经收到了
+struct ephemeral_events {
+    static constexpr auto flush_interval = std::chrono::milliseconds(100);
+    static constexpr size_t max_value_size = 256;
+
+    enum class kind : uint8_t {
+        typing,
+        read,   // 值是读到的序号，也是已读回执
+    };
+    static constexpr std::string_view kind_names[] = {"typing", "read"};
+
+    //所有线程加起来，收到多少个事件、其中多少个被同一个键后来的值盖掉、广播了多少条
+    struct totals {
+        std::atomic<uint64_t> m_received{0};
+        std::atomic<uint64_t> m_replaced{0};
+        std::atomic<uint64_t> m_flushed{0};
+    };
+
+    struct _entry {
+        uint32_t m_user;
+        kind m_kind;
+        std::string m_value;
+    };
+    struct _room {
+        std::vector<_entry> m_entries;
+        std::unordered_map<uint64_t, uint32_t> m_index;     // (用户, 种类) -> m_entries 里的下标
+    };
+    std::unordered_map<uint64_t, _room> m_rooms;  // 这一周期攒下的，一个房间里同一个 (用户, 种类) 只有一项
+    bool m_timer_armed = false;
+
+    static ephemeral_events &instance() {
+        static thread_local ephemeral_events events;
+        return events;
+    }
+
+    static totals &stats() {
+        static totals t;
+        return t;
+    }
+
+    //种类是固定的几个词之一，值是一行
+    static bool parse(std::string_view name, std::string_view value, kind &k) {
+        if (value.size() > max_value_size || value.find('\n') != std::string_view::npos)
+            return false;
+        for (size_t i = 0; i < std::size(kind_names); ++i) {
+            if (kind_names[i] == name) {
+                k = static_cast<kind>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void post(uint64_t room, uint32_t user, kind k, std::string_view value) {
+        auto &t = stats();
+        t.m_received.fetch_add(1, std::memory_order_relaxed);
+        auto &state = m_rooms[room];
+        uint64_t key = uint64_t(user) << 8 | static_cast<uint8_t>(k);
+        auto [it, inserted] = state.m_index.try_emplace(key, static_cast<uint32_t>(state.m_entries.size()));
+        if (!inserted) {
+            state.m_entries[it->second].m_value.assign(value);
+            t.m_replaced.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            state.m_entries.push_back({user, k, std::string(value)});
+        }
+        //空闲时不挂定时器，有事件进来才排一次
+        if (!m_timer_armed) {
+            m_timer_armed = true;
+            timer_queue::instance().add(flush_interval, [this] {
+                m_timer_armed = false;
+                _flush();
+            });
+        }
+    }
+
+    void _flush() {
+        auto &online = presence::instance();
+        auto &registry = room_registry::instance();
+        auto &ring = cluster_ring::instance();
+        std::string text;
+        std::vector<read_receipts::update> receipts;
+        for (auto const &[room, state] : m_rooms) {
+            text.clear();
+            bool remote = ring.is_remote(room);
+            for (auto const &e : state.m_entries) {
+                uint64_t seq;
+                if (!remote && e.m_kind == kind::read && parse_uint64(e.m_value, seq))
+                    receipts.push_back({e.m_user, room, seq});
+                if (!text.empty())
+                    text += '\n';
+                text += online.name(e.m_user);
+                text += ' ';
+                text += kind_names[static_cast<size_t>(e.m_kind)];
+                text += ' ';
+                text += e.m_value;
+            }
+            bytes_const_view batch{text.data(), text.size()};
+            registry.broadcast(room, notice_kind::ephemeral, batch);
+            if (remote)
+                registry.relay_ephemeral(room, batch);
+        }
+        stats().m_flushed.fetch_add(m_rooms.size(), std::memory_order_relaxed);
+        m_rooms.clear();
+        if (!receipts.empty())
+            read_receipts::instance().apply(receipts);
+    }
+
+    //别的节点转来的一批，本节点是房间的家：里面的已读回执在这里记
+    static void apply_relayed(uint64_t room, std::string_view batch) {
+        auto &online = presence::instance();
+        std::vector<read_receipts::update> receipts;
+        while (!batch.empty()) {
+            auto end = batch.find('\n');
+            auto line = batch.substr(0, end);
+            batch = end == std::string_view::npos ? std::string_view() : batch.substr(end + 1);
+            auto first = line.find(' ');
+            auto second = first == std::string_view::npos ? first : line.find(' ', first + 1);
+            uint64_t seq;
+            if (second == std::string_view::npos || line.substr(first + 1, second - first - 1) != kind_names[static_cast<size_t>(kind::read)]
+                || !parse_uint64(line.substr(second + 1), seq))
+                continue;
+            if (uint32_t user = online.intern_user(line.substr(0, first)))
+                receipts.push_back({user, room, seq});
+        }
+        if (!receipts.empty())
+            read_receipts::instance().apply(receipts);
+    }
+};
+
+struct websocket_connection_handler : ref_counted<websocket_connection_handler>, room_subscriber {
+    async_file m_conn;
+    memory_account m_account;
+    bytes_arena m_arena{&m_account};
+    adaptive_read_size m_read_size;
+    websocket_frame_parser m_parser{&m_arena};
+    bytes_buffer m_message{&m_arena};   // 分片消息拼到这里
+    websocket_opcode m_message_opcode = websocket_opcode::text;
+    bool m_in_message = false;
+    output_queue m_queue{&m_account};
+    size_t m_max_message_size = 1024 * 1024;
+    bool m_writing = false;
+    bool m_flush_scheduled = false;
+    bool m_closing = false;
+    struct _joined {
+        uint64_t m_room;
+        uint64_t m_first_live;  // 进房间以后收到的第一条实时消息，还没收到是 0
+        uint64_t m_last_seq;    // 这个房间已经发出去的最后一条，实时消息按它去重
+    };
+    std::vector<_joined> m_rooms;
+    uint64_t m_client = 0;      // 升级请求里带的客户端，sendid 用它去重
+    uint32_t m_user = 0;        // 同一个名字在在线状态里的编号，没报名字是 0
+    uint64_t m_peer = 0;        // 对端地址，限流用
+    using pointer = intrusive_ptr<websocket_connection_handler>;
+    static pointer make() {
+        return pointer(object_pool<websocket_connection_handler>::instance().acquire());
+    }
+    static void _destroy(websocket_connection_handler *p) {
+        p->m_conn.close_file();
+        for (auto const &joined : p->m_rooms) {
+            room_registry::instance().leave(joined.m_room, p);
+            presence::instance().leave(joined.m_room, p->m_user);
+        }
+        p->m_rooms.clear();
+        p->_release_read_buffers();
+        p->m_arena.shrink();
+        p->m_queue.release();
+        p->m_account.m_peak = 0;
+        p->m_read_size = adaptive_read_size();
+        p->m_in_message = false;
+        p->m_writing = false;
+        p->m_flush_scheduled = false;
+        p->m_closing = false;
+        p->m_client = 0;
+        p->m_user = 0;
+        p->m_peer = 0;
+        object_pool<websocket_connection_handler>::instance().release(p);
+    }
+    void _release_read_buffers() {
+        m_parser.reset_state();
+        m_message.release();
+        m_arena.release_idle();
+    }
+    void do_start(async_file conn) {
+        m_conn = std::move(conn);
+        return do_read();
+    }
+    void do_read() {
+        if (m_closing)
+            return;
+        if (m_parser.empty() && !m_in_message) {
+            //没有读到一半的帧，空闲时不占读缓冲区
+            _release_read_buffers();
+            return m_conn.async_wait_readable([self = ref_from_this()] {
+                return self->do_read_some();
+            });
+        }
+        return do_read_some();
+    }
+    void do_read_some() {
+        io_vectors bufs;
+        bufs.push(m_parser.prepare(m_read_size.size()));
+        size_t requested = bufs.total_size();
+        return m_conn.async_read_overflow(bufs, [self = ref_from_this(), requested] (ssize_t n, bytes_const_view overflow) {
+            if (n <= 0) {
+                self->m_conn.close_file();
+                return;
+            }
+            self->m_read_size.on_read(requested, n);
+            self->m_parser.commit(n - overflow.size());
+            if (overflow.size() != 0) {
+                self->m_parser.push_chunk(overflow);
+            }
+            return self->do_process();
+        });
+    }
+    void do_process() {
+        websocket_frame frame;
+        while (!m_closing && m_parser.next_frame(frame)) {
+            on_frame(frame);
+        }
+        if (m_parser.error()) {
+            return do_close(m_parser.error());
+        }
+        if (m_account.over_budget()) {
+            return do_close(1009);
+        }
+        m_parser.discard_consumed();
+        return do_read();
+    }
+    void on_frame(websocket_frame const &frame) {
+        switch (frame.m_opcode) {
+        case websocket_opcode::ping:
+            return send_frame(websocket_opcode::pong, frame.m_payload);
+        case websocket_opcode::pong:
+            return;
+        case websocket_opcode::close: {
+            //没有状态码回 1000；只有一个字节、状态码不合法回 1002；原因不是 UTF-8 回 1007
+            uint16_t code = 1000;
+            if (frame.m_payload.size() == 1) {
+                return do_close(1002);
+            }
+            if (frame.m_payload.size() >= 2) {
+                auto const *p = reinterpret_cast<unsigned char const *>(frame.m_payload.data());
+                code = static_cast<uint16_t>(p[0] << 8 | p[1]);
+                if (!websocket_close_code_valid(code))
+                    return do_close(1002);
+                if (!utf8_valid({frame.m_payload.data() + 2, frame.m_payload.size() - 2}))
+                    return do_close(1007);
+            }
+            return do_close(code);
+        }
+        case websocket_opcode::text:
+        case websocket_opcode::binary:
+            if (m_in_message) {
+                return do_close(1002);
+            }
+            if (frame.m_payload.size() > m_max_message_size) {
+                return do_close(1009);
+            }
+            if (frame.m_fin) {
+                //没分片的消息直接用解析缓冲区里的数据，不拷贝
+                return on_message(frame.m_opcode, frame.m_payload);
+            }
+            m_in_message = true;
+            m_message_opcode = frame.m_opcode;
+            m_message.append(frame.m_payload);
+            return;
+        case websocket_opcode::continuation:
+            if (!m_in_message) {
+                return do_close(1002);
+            }
+            if (m_message.size() + frame.m_payload.size() > m_max_message_size) {
+                return do_close(1009);
+            }
+            m_message.append(frame.m_payload);
+            if (frame.m_fin) {
+                m_in_message = false;
+                on_message(m_message_opcode, m_message);
+                m_message.release();
+            }
+            return;
+        default:
+            return do_close(1002);
+        }
+    }
+    //文本消息是命令：join <房间>、leave <房间>、send <房间> <正文>、history <房间> <条数>
+    //sendid <房间> <消息号> <正文> 是可以重试的 send，要在升级请求里带 ?client=
+    //ephemeral <房间> <种类> <值> 是打字中这类不保证送达的事件，也要带 ?client=，不回复
+    //send 在消息落盘后回 ack <房间> <序号>
+    void on_message(websocket_opcode opcode, bytes_const_view payload) {
+        if (opcode != websocket_opcode::text) {
+            return do_close(1003);
+        }
+        std::string_view text(payload.data(), payload.size());
+        if (!utf8_valid(text)) {
+            return do_close(1007);
+        }
+        size_t space = text.find(' ');
+        std::string_view command = text.substr(0, space);
+        std::string_view rest = space == std::string_view::npos ? std::string_view() : text.substr(space + 1);
+        std::string_view body;
+        if (command == "send" || command == "history" || command == "sendid" || command == "ephemeral") {
+            space = rest.find(' ');
+            body = space == std::string_view::npos ? std::string_view() : rest.substr(space + 1);
+            rest = rest.substr(0, space);
+        }
+        uint64_t room;
+        if (!parse_uint64(rest, room)) {
+            return send_text("error bad room id");
+        }
+        publish_id from;
+        if (command == "sendid") {
+            space = body.find(' ');
+            if (m_client == 0 || !parse_uint64(body.substr(0, space), from.m_message) || from.m_message == 0) {
+                return send_text("error bad message id");
+            }
+            from.m_client = m_client;
+            body = space == std::string_view::npos ? std::string_view() : body.substr(space + 1);
+            command = "send";
+        }
+        auto &registry = room_registry::instance();
+        if (command == "join") {
+            if (!_find_joined(room)) {
+                if (m_rooms.size() >= room_registry::max_joined_rooms)
+                    return send_text("error too many joined rooms");
+                if (!room_registry::open_room(room))
+                    return send_text("error too many rooms");
+            }
+            if (registry.join(room, this)) {
+                m_rooms.push_back({room, 0, 0});
+                presence::instance().join(room, m_user);
+                read_receipts::instance().track(room, m_user);
+            }
+            return send_reply("joined", room);
+        }
+        if (command == "leave") {
+            if (registry.leave(room, this)) {
+                m_rooms.erase(std::remove_if(m_rooms.begin(), m_rooms.end(), [room] (_joined const &joined) {
+                    return joined.m_room == room;
+                }), m_rooms.end());
+                presence::instance().leave(room, m_user);
+            }
+            return send_reply("left", room);
+        }
+        if (command == "send") {
+            if (!rate_limiter::instance().admit_publish(m_peer, m_client, room)) {
+                return send_text("error rate limited");
+            }
+            if (!room_registry::open_room(room)) {
+                return send_text("error too many rooms");
+            }
+            //落盘以后回 ack <房间> <序号>
+            registry.publish(room, bytes_const_view{body.data(), body.size()}, [self = ref_from_this(), room] (uint64_t seq) {
+                char text[64];
+                auto end = seq == 0 ? fmt::format_to_n(text, sizeof(text), "error home node unreachable {}", room)
+                    : fmt::format_to_n(text, sizeof(text), "ack {} {}", room, seq);
+                return self->send_text({text, end.size});
+            }, from);
+            return;
+        }
+        if (command == "ephemeral") {
+            space = body.find(' ');
+            std::string_view kind = body.substr(0, space);
+            std::string_view value = space == std::string_view::npos ? std::string_view() : body.substr(space + 1);
+            ephemeral_events::kind k;
+            if (m_user == 0 || !ephemeral_events::parse(kind, value, k)) {
+                return send_text("error bad ephemeral event");
+            }
+            //只能往自己在的房间里发，和发消息一样过地址的桶
+            if (!_find_joined(room)) {
+                return send_text("error not in room");
+            }
+            if (!rate_limiter::instance().admit(rate_limiter::by_address, m_peer)) {
+                return send_text("error rate limited");
+            }
+            return ephemeral_events::instance().post(room, m_user, k, value);
+        }
+        if (command == "history") {
+            //历史在房间的所有者线程上，取回来以后和实时消息一样编码发出去
+            uint64_t n;
+            if (!parse_uint64(body, n)) {
+                return send_text("error bad count");
+            }
+            if (cluster_ring::instance().is_remote(room)) {
+                return send_text("error history is on the home node");
+            }
+            return registry.query_history(room, 0, n, true, [self = ref_from_this()] (history_page &page) {
+                auto &registry = room_registry::instance();
+                for (auto const &shared : page.m_messages) {
+                    self->on_history_message(*room_message::make(shared->m_room, shared->m_seq, shared->m_body, &registry.m_account));
+                }
+            });
+        }
+        return send_text("error unknown command");
+    }
+    _joined *_find_joined(uint64_t room) {
+        auto it = std::find_if(m_rooms.begin(), m_rooms.end(), [room] (_joined const &joined) {
+            return joined.m_room == room;
+        });
+        return it == m_rooms.end() ? nullptr : &*it;
+    }
+    queue_report report_queue() const override {
+        return m_queue.report("websocket", m_user);
+    }
+    //进了的房间按序号去重：history 发过的实时消息再来就不发了
+    void on_room_message(room_message const &msg) override {
+        if (msg.m_seq != 0) {
+            if (_joined *joined = _find_joined(msg.m_room)) {
+                if (msg.m_seq <= joined->m_last_seq)
+                    return;
+                if (joined->m_first_live == 0)
+                    joined->m_first_live = msg.m_seq;
+                joined->m_last_seq = msg.m_seq;
+            }
+        }
+        return _push(msg);
+    }
+    //history 取回来的：只跳过实时发过的那一段，从第一条实时消息到最后发出去的；比它早的照发
+    void on_history_message(room_message const &msg) {
+        if (_joined *joined = _find_joined(msg.m_room)) {
+            if (joined->m_first_live != 0 && msg.m_seq >= joined->m_first_live && msg.m_seq <= joined->m_last_seq)
+                return;
+            joined->m_last_seq = std::max(joined->m_last_seq, msg.m_seq);
+        }
+        return _push(msg);
+    }
+    void _push(room_message const &msg) {
+        if (m_closing || m_conn.m_fd == -1)
+            return;
+        if (!m_queue.push(msg, msg.m_websocket)) {
+            //对面一直不收，关闭帧也发不出去，直接断开
+            auto self = ref_from_this();
+            m_closing = true;
+            return m_conn.close_file();
+        }
+        return schedule_write();
+    }
+    //这一轮攒下的帧等一轮结束一起写
+    void schedule_write() {
+        if (m_writing)
+            return;
+        if (m_queue.half_full() && m_conn.m_fd != -1)
+            return do_write();
+        if (m_flush_scheduled)
+            return;
+        m_flush_scheduled = true;
+        write_batcher::instance().schedule([self = ref_from_this()] {
+            self->m_flush_scheduled = false;
+            if (!self->m_writing && self->m_conn.m_fd != -1)
+                self->do_write();
+        });
+    }
+    void send_text(std::string_view text) {
+        return send_frame(websocket_opcode::text, {text.data(), text.size()});
+    }
+    void send_reply(std::string_view what, uint64_t room) {
+        char text[64];
+        auto end = fmt::format_to_n(text, sizeof(text), "{} {}", what, room);
+        return send_text({text, end.size});
+    }
+    void send_frame(websocket_opcode opcode, bytes_const_view payload) {
+        if (m_conn.m_fd == -1)
+            return;
+        char header[10];
+        size_t header_len = websocket_frame_header(header, opcode, payload.size());
+        if (!m_queue.push_control(bytes_const_view{header, header_len}, payload)) {
+            //对面连自己请求的回复都不收，排不下了直接断开
+            auto self = ref_from_this();
+            m_closing = true;
+            return m_conn.close_file();
+        }
+        return schedule_write();
+    }
+    //回一个关闭帧，发完就断开
+    void do_close(uint16_t code) {
+        if (m_closing)
+            return;
+        char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code)};
+        send_frame(websocket_opcode::close, {payload, sizeof(payload)});
+        m_closing = true;
+        //关闭帧不用等这一轮结束，写完就断开
+        if (!m_writing && m_conn.m_fd != -1) {
+            do_write();
+        }
+    }
+    void do_write() {
+        if (!m_queue.take_batch()) {
+            m_writing = false;
+            if (m_closing) {
+                m_conn.close_file();
+            }
+            return;
+        }
+        m_writing = true;
+        io_vectors bufs;
+        m_queue.m_outbuf.to_iovecs(bufs);
+        return m_conn.async_writev(bufs, [self = ref_from_this()] (ssize_t n) {
+            if (n < 0) {
+                self->m_writing = false;
+                self->m_conn.close_file();
+                return;
+            }
+            self->m_queue.m_outbuf.consume(n);
+            return self->do_write();
+        });
+    }
+};
+
+//二进制协议的连接：一次读进来的帧全部处理完再读，载荷直接用解析缓冲区里的数据
+//协议出错回一个 error 帧（载荷是原因），发完就断开
+struct binary_connection_handler : ref_counted<binary_connection_handler>, room_subscriber {
+    static constexpr size_t max_ping_size = 125;
+    async_file m_conn;
+    memory_account m_account;
+    bytes_arena m_arena{&m_account};
+    adaptive_read_size m_read_size;
+    binary_frame_parser m_parser{&m_arena};
+    output_queue m_queue{&m_account};
+    bool m_writing = false;
+    bool m_flush_scheduled = false;
+    bool m_closing = false;
+    struct _joined {
+        uint64_t m_room;
+        uint64_t m_first_live;  // 进房间以后收到的第一条实时消息，还没收到是 0
+        uint64_t m_last_seq;    // 这个房间已经发出去的最后一条，实时消息按它去重
+    };
+    std::vector<_joined> m_rooms;
+    uint64_t m_client = 0;
+    uint32_t m_user = 0;
+    uint64_t m_peer = 0;
+    bool m_node = false;    // 集群里别的节点的链路
+    uint32_t m_node_index = 0;  // 是哪个节点，node_hello 里报的
+    using pointer = intrusive_ptr<binary_connection_handler>;
+    static pointer make() {
+        return pointer(object_pool<binary_connection_handler>::instance().acquire());
+    }
+    static void _destroy(binary_connection_handler *p) {
+        p->m_conn.close_file();
+        for (auto const &joined : p->m_rooms) {
+            room_registry::instance().leave(joined.m_room, p);
+            presence::instance().leave(joined.m_room, p->m_user);
+        }
+        p->m_rooms.clear();
+        p->_release_read_buffers();
+        p->m_arena.shrink();
+        p->m_queue.release();
+        p->m_account.m_peak = 0;
+        p->m_read_size = adaptive_read_size();
+        p->m_writing = false;
+        p->m_flush_scheduled = false;
+        p->m_closing = false;
+        p->m_client = 0;
+        p->m_user = 0;
+        p->m_peer = 0;
+        p->m_node = false;
+        p->m_node_index = 0;
+        object_pool<binary_connection_handler>::instance().release(p);
+    }
+    void _release_read_buffers() {
+        m_parser.reset_state();
+        m_arena.release_idle();
+    }
+    void do_start(int connfd) {
+        m_conn = async_file::async_wrap(connfd);
+        return do_read();
+    }
+    void do_read() {
+        if (m_closing)
+            return;
+        if (m_parser.empty()) {
+            //没有读到一半的帧，空闲时不占读缓冲区
+            _release_read_buffers();
+            return m_conn.async_wait_readable([self = ref_from_this()] {
+                return self->do_read_some();
+            });
+        }
+        return do_read_some();
+    }
+    void do_read_some() {
+        io_vectors bufs;
+        bufs.push(m_parser.prepare(m_read_size.size()));
+        size_t requested = bufs.total_size();
+        return m_conn.async_read_overflow(bufs, [self = ref_from_this(), requested] (ssize_t n, bytes_const_view overflow) {
+            if (n <= 0) {
+                self->m_conn.close_file();
+                return;
+            }
+            self->m_read_size.on_read(requested, n);
+            self->m_parser.commit(n - overflow.size());
+            if (overflow.size() != 0) {
+                self->m_parser.push_chunk(overflow);
+            }
+            return self->do_process();
+        });
+    }
+    void do_process() {
+        binary_frame frame;
+        while (!m_closing && m_parser.next_frame(frame)) {
+            on_frame(frame);
+        }
+        if (m_parser.error()) {
+            return do_close("frame too large");
+        }
+        if (m_account.over_budget()) {
+            return do_close("over memory budget");
+        }
+        m_parser.discard_consumed();
+        return do_read();
+    }
+    void on_frame(binary_frame const &frame) {
+        uint64_t room = frame.m_header.m_room;
+        auto &registry = room_registry::instance();
+        switch (frame.m_header.m_opcode) {
+        case binary_opcode::join:
+            if (!_find_joined(room)) {
+                std::string_view reason;
+                //节点的链路替那边一个线程的所有成员订阅，不受一条连接的房间数限制
+                if (!m_node && m_rooms.size() >= room_registry::max_joined_rooms) {
+                    reason = "too many joined rooms";
+                } else if (!room_registry::open_room(room)) {
+                    reason = "too many rooms";
+                }
+                if (!reason.empty())
+                    return send_error(binary_opcode::join, room, 0, reason);
+            }
+            if (registry.join(room, this)) {
+                m_rooms.push_back({room, 0, 0});
+                presence::instance().join(room, m_user);
+                read_receipts::instance().track(room, m_user);
+            }
+            return send_frame(binary_opcode::joined, room, 0, {});
+        case binary_opcode::leave:
+            if (registry.leave(room, this)) {
+                m_rooms.erase(std::remove_if(m_rooms.begin(), m_rooms.end(), [room] (_joined const &joined) {
+                    return joined.m_room == room;
+                }), m_rooms.end());
+                presence::instance().leave(room, m_user);
+            }
+            return send_frame(binary_opcode::left, room, 0, {});
+        case binary_opcode::hello: {
+            //改名字：已经在的房间里按新名字重新算在线
+            auto &online = presence::instance();
+            uint32_t user = online.intern_user({frame.m_payload.data(), frame.m_payload.size()});
+            for (auto const &joined : m_rooms) {
+                online.join(joined.m_room, user);
+                online.leave(joined.m_room, m_user);
+                read_receipts::instance().track(joined.m_room, user);
+            }
+            m_user = user;
+            m_client = publish_id::client_key({frame.m_payload.data(), frame.m_payload.size()});
+            if (frame.m_header.m_seq != 0) {
+                m_queue.m_policy = static_cast<output_queue::overflow_policy>(std::min<uint64_t>(frame.m_header.m_seq - 1, 2));
+            }
+            return;
+        }
+        case binary_opcode::node_hello:
+            //只有带着集群密钥的才是节点的链路，节点之间互相信任：发布在对面已经限过速，这边不再限
+            //客户端冒充节点就能绕过限速、替别人的名字去重，对不上一律断开
+            if (m_node || !m_rooms.empty() || !cluster_ring::instance().admit_node(frame.m_header.m_seq, frame.m_payload))
+                return do_close("bad node hello");
+            m_node = true;
+            m_node_index = static_cast<uint32_t>(frame.m_header.m_seq);
+            {
+                int on = 1;
+                setsockopt(m_conn.m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            return;
+        case binary_opcode::send: {
+            publish_id from;
+            bytes_const_view body = frame.m_payload;
+            if (frame.m_header.m_seq != 0 && m_node) {
+                //节点转来的发布，客户端的名字在载荷最前面
+                if (body.size() < sizeof(uint64_t))
+                    return do_close("send from node without client");
+                memcpy(&from.m_client, body.data(), sizeof(uint64_t));
+                from.m_message = frame.m_header.m_seq;
+                body = body.subspan(sizeof(uint64_t));
+            } else if (frame.m_header.m_seq != 0) {
+                if (m_client == 0)
+                    return do_close("send with message id before hello");
+                from = {m_client, frame.m_header.m_seq};
+            }
+            //超限只回 error 帧，连接不断
+            if (!m_node && !rate_limiter::instance().admit_publish(m_peer, m_client, room))
+                return send_error(binary_opcode::send, room, frame.m_header.m_seq, "rate limited");
+            if (!room_registry::open_room(room))
+                return send_error(binary_opcode::send, room, frame.m_header.m_seq, "too many rooms");
+            //落盘以后回 ack，m_seq 是消息序号；家在别的节点而链路断了回 error
+            registry.publish(room, body, [self = ref_from_this(), room] (uint64_t seq) {
+                if (seq == 0)
+                    return self->send_error(binary_opcode::send, room, 0, "home node unreachable");
+                return self->send_frame(binary_opcode::ack, room, seq, {});
+            }, from, m_node);
+            return;
+        }
+        case binary_opcode::ephemeral: {
+            std::string_view text(frame.m_payload.data(), frame.m_payload.size());
+            auto space = text.find(' ');
+            std::string_view kind = text.substr(0, space);
+            std::string_view value = space == std::string_view::npos ? std::string_view() : text.substr(space + 1);
+            ephemeral_events::kind k;
+            std::string_view reason;
+            if (m_user == 0 || !ephemeral_events::parse(kind, value, k)) {
+                reason = "bad ephemeral event";
+            } else if (!_find_joined(room)) {
+                reason = "not in room";
+            } else if (!m_node && !rate_limiter::instance().admit(rate_limiter::by_address, m_peer)) {
+                reason = "rate limited";
+            }
+            if (!reason.empty())
+                return send_error(binary_opcode::ephemeral, room, 0, reason);
+            return ephemeral_events::instance().post(room, m_user, k, value);
+        }
+        case binary_opcode::ephemeral_batch:
+            //别的节点合并好的一批：这边是家节点，发给本节点的成员，再转给除了它以外的节点
+            if (!m_node)
+                return do_close("unknown opcode");
+            ephemeral_events::apply_relayed(room, {frame.m_payload.data(), frame.m_payload.size()});
+            return registry.broadcast(room, notice_kind::ephemeral, frame.m_payload, m_node_index);
+        case binary_opcode::history:
+            if (cluster_ring::instance().is_remote(room))
+                return send_error(binary_opcode::history, room, 0, "history is on the home node");
+            return registry.query_history(room, 0, frame.m_header.m_seq, true, [self = ref_from_this()] (history_page &page) {
+                auto &registry = room_registry::instance();
+                for (auto const &shared : page.m_messages) {
+                    self->on_history_message(*room_message::make(shared->m_room, shared->m_seq, shared->m_body, &registry.m_account));
+                }
+            });
+        case binary_opcode::ping:
+            //回显的载荷和 WebSocket 的 ping 一样有上限，也要过地址的桶，不然一条连接就能让服务器不停地回大包
+            if (frame.m_payload.size() > max_ping_size)
+                return do_close("ping too large");
+            if (!m_node && !rate_limiter::instance().admit(rate_limiter::by_address, m_peer))
+                return send_error(binary_opcode::ping, room, frame.m_header.m_seq, "rate limited");
+            return send_frame(binary_opcode::pong, room, frame.m_header.m_seq, frame.m_payload);
+        default:
+            return do_close("unknown opcode");
+        }
     }
-};
-
-
-template<class HeaderWriter = http11_header_writer>
-struct http_response_writer : _http_base_writer<HeaderWriter>{
-    void begin_header(int status) {
-        this->_begin_header("HTTP/1.1", std::to_string(status), "OK");
+    _joined *_find_joined(uint64_t room) {
+        auto it = std::find_if(m_rooms.begin(), m_rooms.end(), [room] (_joined const &joined) {
+            return joined.m_room == room;
+        });
+        return it == m_rooms.end() ? nullptr : &*it;
     }
-};
-
-//构造回调
-template <class ...Args>
-struct callback {
-    struct _callback_base {
-        virtual void _call(Args... args) = 0;
-        virtual ~_callback_base() = default;
-    };
-    template <class F>
-    struct _callback_impl final : _callback_base {
-        F m_func;
-        template <class ...Ts, class = std::enable_if_t<std::is_constructible_v<F, Ts...>>>
-        _callback_impl(Ts &&...ts) : m_func(std::forward<Ts>(ts)...) {}
-        void _call(Args... args) override {
-            m_func(std::forward<Args>(args)...);
+    queue_report report_queue() const override {
+        return m_queue.report("binary", m_user);
+    }
+    //进了的房间按序号去重：history 发过的实时消息再来就不发了
+    void on_room_message(room_message const &msg) override {
+        if (msg.m_seq != 0) {
+            if (_joined *joined = _find_joined(msg.m_room)) {
+                if (msg.m_seq <= joined->m_last_seq)
+                    return;
+                if (joined->m_first_live == 0)
+                    joined->m_first_live = msg.m_seq;
+                joined->m_last_seq = msg.m_seq;
+            }
         }
-    };
-    std::unique_ptr<_callback_base> m_base;
-    template <class F, class = std::enable_if_t<std::is_invocable_v<F, Args...> && !std::is_same_v<std::decay_t<F>, callback>>>
-    callback(F &&f) : m_base(std::make_unique<_callback_impl<std::decay_t<F>>>(std::forward<F>(f))) {}
-    callback() = default;
-    callback(callback const &) = delete;
-    callback &operator=(callback const &) = delete;
-    callback(callback &&) = default;
-    callback &operator=(callback &&) = default;
-    void operator()(Args... args) const {
-        assert(m_base);
-        return m_base->_call(std::forward<Args>(args)...);
+        return _push(msg);
     }
-
-    template <class F>
-    F &target() const {
-        assert(m_base);
-        return static_cast<_callback_impl<F> &>(*m_base);
+    //history 取回来的：只跳过实时发过的那一段，从第一条实时消息到最后发出去的；比它早的照发
+    void on_history_message(room_message const &msg) {
+        if (_joined *joined = _find_joined(msg.m_room)) {
+            if (joined->m_first_live != 0 && msg.m_seq >= joined->m_first_live && msg.m_seq <= joined->m_last_seq)
+                return;
+            joined->m_last_seq = std::max(joined->m_last_seq, msg.m_seq);
+        }
+        return _push(msg);
     }
-    void *leak_address() {
-        return static_cast<void *>(m_base.release());
+    void _push(room_message const &msg) {
+        if (m_closing || m_conn.m_fd == -1)
+            return;
+        //在线状态各节点只报自己的连接，不经节点之间的链路转出去，免得和那边自己算的混在一起
+        //短命事件要转，但不转回最早发它的节点
+        if (m_node && (msg.m_notice == notice_kind::presence || (msg.m_notice == notice_kind::ephemeral && msg.m_origin == m_node_index)))
+            return;
+        if (!m_queue.push(msg, msg.binary_frame())) {
+            auto self = ref_from_this();
+            m_closing = true;
+            return m_conn.close_file();
+        }
+        return schedule_write();
     }
-    static callback from_address(void *addr) {
-        callback cb;
-        cb.m_base = std::unique_ptr<_callback_base>(static_cast<_callback_base *>(addr));
-        return cb;
+    void schedule_write() {
+        if (m_writing)
+            return;
+        if (m_queue.half_full() && m_conn.m_fd != -1)
+            return do_write();
+        if (m_flush_scheduled)
+            return;
+        m_flush_scheduled = true;
+        write_batcher::instance().schedule([self = ref_from_this()] {
+            self->m_flush_scheduled = false;
+            if (!self->m_writing && self->m_conn.m_fd != -1)
+                self->do_write();
+        });
     }
-};
-
-int epollfd;
-
-struct async_file {
-    int m_fd = -1;
-    async_file() = default;
-    explicit async_file(int fd) : m_fd(fd) {}
-    static async_file async_wrap(int fd) {
-        int flags = CHECK_CALL(fcntl, fd, F_GETFL);
-        flags |= O_NONBLOCK;
-        CHECK_CALL(fcntl, fd, F_SETFL, flags);
-        struct epoll_event event;
-        event.events = EPOLLET;
-        event.data.ptr = nullptr;
-        CHECK_CALL(epoll_ctl, epollfd, EPOLL_CTL_ADD, fd, &event);
-        return async_file{fd};
+    void send_frame(binary_opcode opcode, uint64_t room, uint64_t seq, bytes_const_view payload) {
+        return _send(binary_frame_header_of(opcode, room, seq, payload.size()), payload);
     }
-    ssize_t sync_read(bytes_view buf) {
-        return CHECK_CALL(read, m_fd, buf.data(), buf.size());
+    //answers 是出错的请求的操作码，放在头里带回去
+    void send_error(binary_opcode answers, uint64_t room, uint64_t seq, std::string_view reason) {
+        auto header = binary_frame_header_of(binary_opcode::error, room, seq, reason.size());
+        header.m_answers = answers;
+        return _send(header, {reason.data(), reason.size()});
     }
-    ssize_t sync_write(bytes_const_view buf) {
-        return CHECK_CALL(write, m_fd, buf.data(), buf.size());
+    void _send(binary_frame_header const &header, bytes_const_view payload) {
+        if (m_conn.m_fd == -1)
+            return;
+        if (!m_queue.push_control(bytes_const_view{reinterpret_cast<char const *>(&header), sizeof(header)}, payload)) {
+            auto self = ref_from_this();
+            m_closing = true;
+            return m_conn.close_file();
+        }
+        return schedule_write();
     }
-    int sync_accept(address_resolver::address &addr) {
-        return CHECK_CALL(accept, m_fd, &addr.m_addr, &addr.m_addrlen);
+    void do_close(std::string_view reason) {
+        if (m_closing)
+            return;
+        send_frame(binary_opcode::error, 0, 0, {reason.data(), reason.size()});
+        m_closing = true;
+        if (!m_writing && m_conn.m_fd != -1) {
+            do_write();
+        }
     }
-    void async_read(bytes_view buf, callback<ssize_t> cb) {
-        ssize_t ret = CHECK_CALL_EXCEPT(EAGAIN, read, m_fd, buf.data(), buf.size());
-        if (ret != -1) {
-            cb(ret);
+    void do_write() {
+        if (!m_queue.take_batch()) {
+            m_writing = false;
+            if (m_closing) {
+                m_conn.close_file();
+            }
             return;
         }
+        m_writing = true;
+        io_vectors bufs;
+        m_queue.m_outbuf.to_iovecs(bufs);
+        return m_conn.async_writev(bufs, [self = ref_from_this()] (ssize_t n) {
+            if (n < 0) {
+                self->m_writing = false;
+                self->m_conn.close_file();
+                return;
+            }
+            self->m_queue.m_outbuf.consume(n);
+            return self->do_write();
+        });
+    }
+};
 
-        // 如果 read 可以读了，请操作系统，调用，我这个回调
-        callback<> resume = [this, buf, cb = std::move(cb)] () mutable {
-            return async_read(buf, std::move(cb));
-        };
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        epoll_ctl(epollfd, EPOLL_CTL_MOD, m_fd, &event);
+//SSE 推送：HTTP 响应头写完后连接交给它，响应一直不结束，房间的消息按分块传输一条条发出去
+struct event_stream_handler : ref_counted<event_stream_handler>, room_subscriber {
+    static constexpr auto heartbeat_interval = std::chrono::seconds(15);
+    async_file m_conn;
+    memory_account m_account;
+    output_queue m_queue{&m_account};
+    uint64_t m_room = 0;
+    uint64_t m_last_seq = 0;    // 已经发出去的最后一条
+    bool m_replaying = false;   // 在等补发的历史，这期间的实时消息都会在历史里
+    bool m_writing = false;
+    bool m_flush_scheduled = false;
+    using pointer = intrusive_ptr<event_stream_handler>;
+    static pointer make() {
+        return pointer(object_pool<event_stream_handler>::instance().acquire());
     }
-    void async_write(bytes_const_view buf, callback<ssize_t> cb) {
-        ssize_t ret = CHECK_CALL_EXCEPT(EAGAIN, write, m_fd, buf.data(), buf.size());
-        if (ret != -1) {
-            cb(ret);
-            return;
+    static void _destroy(event_stream_handler *p) {
+        p->do_close();
+        p->m_queue.release();
+        p->m_account.m_peak = 0;
+        p->m_last_seq = 0;
+        p->m_replaying = false;
+        p->m_writing = false;
+        p->m_flush_scheduled = false;
+        object_pool<event_stream_handler>::instance().release(p);
+    }
+    //resume 为真时先补发 last_event_id 之后还留在房间里的消息
+    //先加入房间再去所有者线程取历史：所有者按先后处理，取历史之前定序的都在历史里，之后的会投过来
+    //历史回来之前收到的实时消息丢掉，历史回来之后按序号去重
+    void do_start(async_file conn, uint64_t room, bool resume, uint64_t last_event_id, output_queue::overflow_policy policy) {
+        m_conn = std::move(conn);
+        m_room = room;
+        m_queue.m_policy = policy;
+        auto &registry = room_registry::instance();
+        registry.join(room, this);
+        do_watch_close();
+        do_heartbeat();
+        if (resume) {
+            m_replaying = true;
+            m_last_seq = last_event_id;
+            return registry.query_history(room, last_event_id, std::numeric_limits<size_t>::max(), false, [self = ref_from_this()] (history_page &page) {
+                self->m_replaying = false;
+                auto &registry = room_registry::instance();
+                for (auto const &shared : page.m_messages) {
+                    self->on_room_message(*room_message::make(shared->m_room, shared->m_seq, shared->m_body, &registry.m_account));
+                }
+            });
         }
-        // 如果 write 可以写了，请操作系统，调用，我这个回调
-        callback<> resume = [this, buf, cb = std::move(cb)] () mutable {
-            return async_write(buf, std::move(cb));
-        };
-        struct epoll_event event;
-        event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        epoll_ctl(epollfd, EPOLL_CTL_MOD, m_fd, &event);
     }
-    void async_accept(address_resolver::address &addr, callback<int> cb) {
-        ssize_t ret = CHECK_CALL_EXCEPT(EAGAIN, accept, m_fd, &addr.m_addr, &addr.m_addrlen);
-        if (ret != -1) {
-            cb(ret);
+    //客户端不会再发东西，读到 EOF 或者任何数据都当作断开
+    void do_watch_close() {
+        return m_conn.async_read_overflow(io_vectors(), [self = ref_from_this()] (ssize_t, bytes_const_view) {
+            return self->do_close();
+        });
+    }
+    //定时发一行注释，免得中间的代理把空闲连接断掉
+    //定时器里的回调拿着引用，连接断开后最多再多活一个周期
+    void do_heartbeat() {
+        timer_queue::instance().add(heartbeat_interval, [self = ref_from_this()] {
+            if (self->m_conn.m_fd == -1)
+                return;
+            if (self->m_queue.empty()) {
+                static constexpr std::string_view heartbeat = "8\r\n: ping\n\n\r\n";
+                if (!self->m_queue.push_control({heartbeat.data(), heartbeat.size()}))
+                    return self->do_close();
+                self->do_write();
+            }
+            return self->do_heartbeat();
+        });
+    }
+    void do_close() {
+        if (m_conn.m_fd == -1)
             return;
-        }
-        // 如果 accept 到请求了，请操作系统，调用，我这个回调
-        callback<> resume = [this, &addr, cb = std::move(cb)] () mutable {
-            return async_accept(addr, std::move(cb));
-        };
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        CHECK_CALL(epoll_ctl, epollfd, EPOLL_CTL_MOD, m_fd, &event);
+        room_registry::instance().leave(m_room, this);
+        m_conn.close_file();
     }
-    async_file(async_file &&that) noexcept : m_fd(that.m_fd) {
-        that.m_fd = -1;
+    queue_report report_queue() const override {
+        return m_queue.report("sse", 0);
     }
-    async_file &operator=(async_file &&that) noexcept {
-        std::swap(m_fd, that.m_fd);
-        return *this;
+    void on_room_message(room_message const &msg) override {
+        if (m_conn.m_fd == -1 || m_replaying)
+            return;
+        //序号为 0 的是不进历史的通知，不算在 Last-Event-ID 里
+        if (msg.m_seq != 0) {
+            if (msg.m_seq <= m_last_seq)
+                return;
+            m_last_seq = msg.m_seq;
+        }
+        if (!m_queue.push(msg, msg.event_stream_chunk())) {
+            //断开以后客户端带着 Last-Event-ID 重连，从历史里补
+            auto self = ref_from_this();
+            return do_close();
+        }
+        if (m_writing)
+            return;
+        if (m_queue.half_full())
+            return do_write();
+        if (m_flush_scheduled)
+            return;
+        m_flush_scheduled = true;
+        write_batcher::instance().schedule([self = ref_from_this()] {
+            self->m_flush_scheduled = false;
+            if (!self->m_writing)
+                self->do_write();
+        });
     }
-    ~async_file() {
-        if (m_fd == -1)
+    void do_write() {
+        if (m_conn.m_fd == -1 || !m_queue.take_batch()) {
+            m_writing = false;
             return;
-        epoll_ctl(epollfd, EPOLL_CTL_DEL, m_fd, nullptr);
-        close(m_fd);
+        }
+        m_writing = true;
+        io_vectors bufs;
+        m_queue.m_outbuf.to_iovecs(bufs);
+        return m_conn.async_writev(bufs, [self = ref_from_this()] (ssize_t n) {
+            if (n < 0) {
+                self->m_writing = false;
+                return self->do_close();
+            }
+            self->m_queue.m_outbuf.consume(n);
+            return self->do_write();
+        });
     }
 };
 
-struct http_connection_handler : std::enable_shared_from_this<http_connection_handler> {
+struct http_connection_handler : ref_counted<http_connection_handler> {
     async_file m_conn;
-    bytes_buffer m_readbuf{1024};
-    http_request_parser<> m_req_parser;
-    http_response_writer<> m_res_writer;
-    using pointer = std::shared_ptr<http_connection_handler>;
+    memory_account m_account;
+    bytes_arena m_arena{&m_account};
+    adaptive_read_size m_read_size;
+    http_request_parser<> m_req_parser{&m_arena, &m_account};
+    http_response_writer<> m_res_writer{&m_arena, &m_account};
+    bool m_close_after_write = false;
+    callback<async_file> m_handoff;   // 响应写完后把连接交给 WebSocket 或 SSE
+    std::vector<shared_message::pointer> m_pinned;  // 响应里直接引用了正文的消息
+    uint64_t m_peer = 0;    // 对端地址，限流用
+    using pointer = intrusive_ptr<http_connection_handler>;
     static pointer make() {
-        return std::make_shared<pointer::element_type>();
+        return pointer(object_pool<http_connection_handler>::instance().acquire());
+    }
+    //连接结束后不释放，清空状态放回池子里等下一个连接复用
+    static void _destroy(http_connection_handler *p) {
+        p->m_conn = async_file();
+        p->m_req_parser.reset_state();
+        p->m_res_writer.reset_state();
+        p->m_arena.reset();
+        p->m_arena.shrink();
+        p->m_account.m_peak = 0;
+        p->m_read_size = adaptive_read_size();
+        p->m_close_after_write = false;
+        p->m_handoff = callback<async_file>();
+        p->m_pinned.clear();
+        p->m_peer = 0;
+        object_pool<http_connection_handler>::instance().release(p);
     }
     void do_start(int connfd) {
         m_conn = async_file::async_wrap(connfd);
         return do_read();
     }
     void do_read() {
+        if (m_req_parser.buffered_size() == 0 && memory_stats::global().over_budget()) {
+            //全局内存超出预算，先不接新的请求，等内存降下来再继续
+            //读到一半的请求不暂停，它占的内存有单连接预算兜着，暂停反而可能谁也等不到
+            return memory_stats::wait_for_budget([self = ref_from_this()] {
+                return self->do_read();
+            });
+        }
+        if (m_req_parser.buffered_size() == 0) {
+            //下一个请求还没来，空闲的连接不占读缓冲区，可读了再分配
+            return m_conn.async_wait_readable([self = ref_from_this()] {
+                return self->do_read_some();
+            });
+        }
+        return do_read_some();
+    }
+    void do_read_some() {
         // fmt::println("开始读取...");
         // 注意：TCP 基于流，可能粘包
-        return m_conn.async_read(m_readbuf, [self = this->shared_from_this()] (size_t n) {
-            // 如果读到 EOF，说明对面，关闭了连接
-            if (n == 0) {
+        // 直接读进解析器缓冲区末尾的空闲区
+        io_vectors bufs;
+        m_req_parser.prepare(m_read_size.size(), bufs);
+        size_t requested = bufs.total_size();
+        return m_conn.async_read_overflow(bufs, [self = ref_from_this(), requested] (ssize_t n, bytes_const_view overflow) {
+            // 如果读到 EOF，说明对面，关闭了连接（-1 是连接被重置）
+            if (n <= 0) {
                 // fmt::println("收到对面关闭了连接");
                 return;
             }
             // fmt::println("读取到了 {} 个字节: {}", n, std::string_view{m_buf.data(), n});
             // 成功读取，则推入解析
-            self->m_req_parser.push_chunk(self->m_readbuf.subspan(0, n));
-            if (!self->m_req_parser.request_finished()) {
+            self->m_read_size.on_read(requested, n);
+            auto &parser = self->m_req_parser;
+            parser.commit(n - overflow.size());
+            if (overflow.size() != 0 && !parser.request_finished() && !parser.error()) {
+                parser.push_chunk(overflow);
+            }
+            if (!parser.error() && self->m_account.over_budget()) {
+                parser.m_error = parser.header_finished() ? 413 : 431;
+            }
+            if (parser.error()) {
+                return self->do_reject(parser.error());
+            }
+            if (!parser.request_finished()) {
                 return self->do_read();
-            } else {
-                return self->do_handle();
             }
+            //路径只查一次路由，限流和处理用同一个结果
+            std::string_view query;
+            http_route_params params;
+            auto route = _routes().find(parser.method(), http_split_query(parser.url(), query), params);
+            if (!self->_admit(route, params)) {
+                return self->do_respond(429, "text/plain");
+            }
+            return self->do_handle(route, params, query);
         });
     }
-    void do_handle() {
-        std::string body = std::move(m_req_parser.body());
-        m_req_parser.reset_state();
-        if (body.empty()) {
-            body = "你好，你的请求正文为空哦";
+    using router = http_router<http_connection_handler>;
+    //发布限流时要多过房间的桶，房间是第一个参数
+    static constexpr uint32_t route_publish = 1;
+    //解析完、交给处理之前限流：每个请求过地址和客户端身份的桶，发布再过房间的桶
+    bool _admit(router::match const &route, http_route_params const &params) {
+        auto &limiter = rate_limiter::instance();
+        auto &headers = m_req_parser.headers();
+        auto client_id = headers.find("x-client-id");
+        uint64_t client = client_id == headers.end() ? 0 : publish_id::client_key(client_id->second);
+        if (route.m_tag == route_publish)
+            return limiter.admit_publish(m_peer, client, params.number(0));
+        return limiter.admit(rate_limiter::by_address, m_peer) && (client == 0 || limiter.admit(rate_limiter::by_client, client));
+    }
+    void do_handle(router::match const &route, http_route_params const &params, std::string_view query) {
+        iobuf &req_body = m_req_parser.body();
+        m_read_size.on_request(m_req_parser.buffered_size());
+        if (_is_websocket_upgrade()) {
+            return do_websocket_upgrade(query);
+        }
+        if (route.m_handler) {
+            return route.m_handler(*this, params, query);
+        }
+        if (route.m_path_found) {
+            return do_method_not_allowed(route.m_allow);
+        }
+        //没注册的路径把请求正文原样回显
+        if (req_body.empty()) {
+            m_res_writer.write_body("你好，你的请求正文为空哦");
         } else {
-            body = fmt::format("你好，你的请求是: [{}]，共 {} 字节", body, body.size());
+            // 请求正文的块直接共享给响应，不拷贝
+            char suffix[64];
+            auto end = fmt::format_to_n(suffix, sizeof(suffix), "]，共 {} 字节", req_body.size());
+            m_res_writer.write_body("你好，你的请求是: [");
+            m_res_writer.write_body(req_body);
+            m_res_writer.write_body(std::string_view{suffix, end.size});
         }
         m_res_writer.begin_header(200);
         m_res_writer.write_header("Server", "co_http");
         m_res_writer.write_header("Content-type", "text/html;charset=utf-8");
         m_res_writer.write_header("Connection", "keep-alive");
-        m_res_writer.write_header("Content-length", std::to_string(body.size()));
+        fmt::format_int content_length(m_res_writer.body().size());
+        m_res_writer.write_header("Content-length", {content_length.data(), content_length.size()});
         m_res_writer.end_header();
         // fmt::println("我的响应头: {}", buffer);
         // fmt::println("我的响应正文: {}", body);
         // fmt::println("正在响应");
+        return do_write();
+    }
+    static router const &_routes() {
+        static router const routes = [] {
+            router r;
+            r.add("GET", "/stats/memory", [] (auto &self, auto const &, std::string_view) {
+                return self.do_memory_stats();
+            });
+            r.add("GET", "/stats/queues", [] (auto &self, auto const &, std::string_view query) {
+                return self.do_queue_stats(query);
+            });
+            r.add("GET", "/stats/ephemeral", [] (auto &self, auto const &, std::string_view) {
+                return self.do_ephemeral_stats();
+            });
+            r.add("GET", "/stats/search", [] (auto &self, auto const &, std::string_view) {
+                return self.do_search_stats();
+            });
+            r.add("GET", "/rooms/{room:int}/messages", [] (auto &self, auto const &params, std::string_view query) {
+                return self.do_history(params.number(0), query);
+            });
+            r.add("POST", "/rooms/{room:int}/messages", [] (auto &self, auto const &params, std::string_view) {
+                return self.do_publish(params.number(0));
+            }, route_publish);
+            r.add("GET", "/rooms/{room:int}/events", [] (auto &self, auto const &params, std::string_view query) {
+                return self.do_event_stream(params.number(0), query);
+            });
+            r.add("GET", "/rooms/{room:int}/presence", [] (auto &self, auto const &params, std::string_view query) {
+                return self.do_presence(params.number(0), query);
+            });
+            r.add("GET", "/rooms/{room:int}/search", [] (auto &self, auto const &params, std::string_view query) {
+                return self.do_search(params.number(0), query);
+            });
+            r.add("GET", "/users/{name:slug}/rooms", [] (auto &self, auto const &params, std::string_view) {
+                return self.do_user_rooms(params.text(0));
+            });
+            r.add("GET", "/users/{name:slug}/unread", [] (auto &self, auto const &params, std::string_view) {
+                return self.do_unread(params.text(0));
+            });
+            return r;
+        }();
+        return routes;
+    }
+    void do_memory_stats() {
+        auto &global = memory_stats::global();
+        char body[320];
+        auto end = fmt::format_to_n(body, sizeof(body),
+            "global_used {}\nglobal_peak {}\nglobal_limit {}\nconnection_used {}\nconnection_peak {}\nconnection_limit {}\nsearch_index_bytes {}\n",
+            global.used(), global.peak(), global.m_limit, m_account.m_used, m_account.m_peak, m_account.m_limit,
+            search_index::instance().get_stats().m_bytes);
+        m_res_writer.write_body(std::string_view{body, end.size});
+        return do_respond(200, "text/plain");
+    }
+    //房间里在线的人：第一行 "online <人数>"，后面一行一个名字
+    //?friends=a,b,c 只看这些人里谁在线，是两张位图的交集
+    void do_presence(uint64_t room, std::string_view query) {
+        auto &online = presence::instance();
+        presence_bitmap users = online.online(room);
+        std::string_view friends;
+        if (http_query_value(query, "friends", friends)) {
+            std::vector<std::string_view> names;
+            while (!friends.empty()) {
+                auto comma = friends.find(',');
+                names.push_back(friends.substr(0, comma));
+                friends = comma == std::string_view::npos ? std::string_view() : friends.substr(comma + 1);
+            }
+            users = presence_bitmap::intersect(users, online.users(names));
+        }
+        std::string body = fmt::format("online {}\n", users.size());
+        users.for_each([&] (uint32_t user) {
+            body += online.name(user);
+            body += '\n';
+        });
+        m_res_writer.write_body(body);
+        return do_respond(200, "text/plain");
+    }
+    //这个名字在哪些房间里在线，一行一个房间号
+    void do_user_rooms(std::string_view user) {
+        std::string body;
+        for (uint64_t room : presence::instance().rooms_of(user)) {
+            body += fmt::format("{}\n", room);
+        }
         m_res_writer.write_body(body);
-        return do_write(m_res_writer.buffer());
+        return do_respond(200, "text/plain");
+    }
+    //所有订阅者连接的发送队列加起来：排着的字节数和条数，满了丢掉的条数和断开的连接数
+    //先是所有线程加起来的总数，再一行一条连接 "connection <协议> <用户> <排着的条数> <排着的字节数> <丢了的条数>"
+    //连接按丢的条数、再按排着的字节数从多到少排，最多列 ?top= 条，默认 100
+    void do_queue_stats(std::string_view query) {
+        uint64_t top = 100;
+        http_query_uint64(query, "top", top);
+        room_registry::collect_queue_reports([self = ref_from_this(), top] (std::vector<queue_report> &reports) {
+            auto total = output_queue_stats::total();
+            char body[256];
+            auto end = fmt::format_to_n(body, sizeof(body), "queued_bytes {}\nqueued_messages {}\ndropped_messages {}\ndisconnected {}\nconnections {}\n",
+                total.m_queued_bytes, total.m_queued_messages, total.m_dropped, total.m_disconnected, reports.size());
+            self->m_res_writer.write_body(std::string_view{body, end.size});
+            size_t n = std::min<size_t>(reports.size(), top);
+            std::partial_sort(reports.begin(), reports.begin() + n, reports.end(), [] (queue_report const &a, queue_report const &b) {
+                return std::pair(a.m_dropped, a.m_queued_bytes) > std::pair(b.m_dropped, b.m_queued_bytes);
+            });
+            auto &online = presence::instance();
+            std::string lines;
+            for (size_t i = 0; i < n; ++i) {
+                auto const &r = reports[i];
+                fmt::format_to(std::back_inserter(lines), "connection {} {} {} {} {}\n", r.m_protocol,
+                    r.m_user == 0 ? std::string("-") : online.name(r.m_user), r.m_queued_messages, r.m_queued_bytes, r.m_dropped);
+            }
+            self->m_res_writer.write_body(lines);
+            return self->do_respond(200, "text/plain");
+        });
+    }
+    //第一行 "unread <总数>"，后面一行一个房间 "<房间> <未读数> <读到的序号>"
+    //开集群时只有家在本节点的房间
+    void do_unread(std::string_view name) {
+        uint32_t user = presence::instance().find_user(name);
+        auto marks = user == 0 ? std::vector<read_receipts::mark>() : read_receipts::instance().marks(user);
+        uint64_t total = 0;
+        std::string rooms;
+        for (auto const &m : marks) {
+            uint64_t unread = m.unread();
+            total += unread;
+            fmt::format_to(std::back_inserter(rooms), "{} {} {}\n", m.m_room, unread, m.m_seq);
+        }
+        m_res_writer.write_body(fmt::format("unread {}\n", total));
+        m_res_writer.write_body(rooms);
+        return do_respond(200, "text/plain");
+    }
+    //收到的短命事件、被后来的值盖掉的、合并以后实际广播的条数
+    void do_ephemeral_stats() {
+        auto &t = ephemeral_events::stats();
+        char body[128];
+        auto end = fmt::format_to_n(body, sizeof(body), "received {}\nreplaced {}\nflushed {}\n",
+            t.m_received.load(std::memory_order_relaxed), t.m_replaced.load(std::memory_order_relaxed), t.m_flushed.load(std::memory_order_relaxed));
+        m_res_writer.write_body(std::string_view{body, end.size});
+        return do_respond(200, "text/plain");
+    }
+    //indexed 追到 durable 说明落了盘的消息都能搜到了
+    void do_search_stats() {
+        auto t = search_index::instance().get_stats();
+        char body[256];
+        auto end = fmt::format_to_n(body, sizeof(body), "indexed {}\ndurable {}\nmessages {}\nterms {}\npostings {}\nbytes {}\nevictions {}\n",
+            t.m_indexed, t.m_durable, t.m_messages, t.m_terms, t.m_postings, t.m_bytes, t.m_evictions);
+        m_res_writer.write_body(std::string_view{body, end.size});
+        return do_respond(200, "text/plain");
+    }
+    //?q=<词>&limit=<条数>&before=<序号> 搜房间里同时含有所有词的消息，从新到旧
+    //每条和历史一样是 "<序号> <字节数>\n<正文>\n"，正文从日志的映射里切；还有更早的就给 X-Next-Before，拿它接着往前翻
+    //一页看的候选有上限，X-Next-Before 给了而这一页不满 limit 条甚至是空的也正常，接着翻就是
+    void do_search(uint64_t room, std::string_view query) {
+        static constexpr uint64_t default_limit = 20;
+        static constexpr uint64_t max_limit = 100;
+        std::string_view text;
+        if (!http_query_value(query, "q", text)) {
+            return do_respond(400, "text/plain");
+        }
+        if (cluster_ring::instance().is_remote(room)) {
+            return do_misdirected(room);
+        }
+        uint64_t limit = default_limit, before = std::numeric_limits<uint64_t>::max();
+        http_query_uint64(query, "limit", limit);
+        http_query_uint64(query, "before", before);
+        uint64_t next_before, first_seq;
+        auto found = search_index::instance().search(room, http_url_decode(text), before, std::min(limit, max_limit), next_before, first_seq);
+        auto &log = message_log::instance();
+        for (uint64_t seq : found) {
+            log.read_range(room, seq - 1, seq + 1, 1, [&] (uint64_t seq, bytes_const_view body) {
+                char head[48];
+                auto end = fmt::format_to_n(head, sizeof(head), "{} {}\n", seq, body.size());
+                m_res_writer.write_body_packed(std::string_view{head, end.size});
+                m_res_writer.write_body_external(body);
+                m_res_writer.write_body_packed("\n");
+            });
+        }
+        m_res_writer.begin_header(200);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Content-type", "text/plain");
+        m_res_writer.write_header("Connection", "keep-alive");
+        fmt::format_int next(next_before);
+        if (next_before != 0)
+            m_res_writer.write_header("X-Next-Before", {next.data(), next.size()});
+        //比这个早的消息不在索引里，搜不到不代表没有
+        fmt::format_int first(first_seq);
+        if (first_seq > 1)
+            m_res_writer.write_header("X-Index-First-Seq", {first.data(), first.size()});
+        fmt::format_int content_length(m_res_writer.body().size());
+        m_res_writer.write_header("Content-length", {content_length.data(), content_length.size()});
+        m_res_writer.end_header();
+        return do_write();
+    }
+    void do_publish(uint64_t room) {
+        //带 X-Client-Id 和 X-Message-Id 的发布可以放心重试，重复的只回第一次的序号
+        publish_id from;
+        auto &headers = m_req_parser.headers();
+        auto message_id = headers.find("x-message-id");
+        if (message_id != headers.end()) {
+            auto client_id = headers.find("x-client-id");
+            if (client_id == headers.end() || !parse_uint64(message_id->second, from.m_message) || from.m_message == 0) {
+                return do_respond(400, "text/plain");
+            }
+            from.m_client = publish_id::client_key(client_id->second);
+        }
+        if (!room_registry::open_room(room)) {
+            return do_respond(503, "text/plain");
+        }
+        //日志落盘以后才回复
+        room_registry::instance().publish(room, m_req_parser.body(), [self = ref_from_this()] (uint64_t seq) {
+            if (seq == 0) {
+                return self->do_respond(503, "text/plain");
+            }
+            char body[32];
+            auto end = fmt::format_to_n(body, sizeof(body), "{}\n", seq);
+            self->m_res_writer.write_body(std::string_view{body, end.size});
+            return self->do_respond(200, "text/plain");
+        }, from);
+    }
+    //?since=<序号>&limit=<条数> 从某条之后往后翻，?last=<条数> 取最后几条
+    //每条是 "<序号> <字节数>\n<正文>\n"；历史在房间的所有者线程上取
+    void do_history(uint64_t room, std::string_view query) {
+        static constexpr uint64_t default_limit = 100;
+        static constexpr uint64_t max_limit = 1000;
+        if (cluster_ring::instance().is_remote(room)) {
+            return do_misdirected(room);
+        }
+        uint64_t since = 0, limit = default_limit, last = 0;
+        bool by_last = http_query_uint64(query, "last", last);
+        http_query_uint64(query, "since", since);
+        http_query_uint64(query, "limit", limit);
+        limit = std::min(by_last ? last : limit, max_limit);
+        room_registry::instance().query_history(room, since, limit, by_last, [self = ref_from_this(), room, limit] (history_page &page) {
+            return self->do_write_history(room, limit, page);
+        });
+    }
+    //环里已经丢掉的部分从日志的映射里切片，环里的正文也直接引用，都不拷贝
+    //环里的消息在响应写完之前一直拿着
+    void do_write_history(uint64_t room, uint64_t limit, history_page &page) {
+        uint64_t first_seq = page.m_first_seq, since = page.m_after, next_since = since;
+        auto write_head = [&] (uint64_t seq, size_t size) {
+            char head[48];
+            auto end = fmt::format_to_n(head, sizeof(head), "{} {}\n", seq, size);
+            m_res_writer.write_body_packed(std::string_view{head, end.size});
+            next_since = seq;
+        };
+        auto &log = message_log::instance();
+        size_t count = 0;
+        if (log.enabled()) {
+            if (uint64_t log_first = log.first_seq(room))
+                first_seq = log_first;
+        }
+        if (log.enabled() && since + 1 < page.m_first_seq) {
+            count = log.read_range(room, since, page.m_first_seq, limit, [&] (uint64_t seq, bytes_const_view body) {
+                write_head(seq, body.size());
+                m_res_writer.write_body_external(body);
+                m_res_writer.write_body_packed("\n");
+            });
+        }
+        for (auto const &msg : page.m_messages) {
+            if (count++ == limit)
+                break;
+            write_head(msg->m_seq, msg->m_body.size());
+            m_res_writer.write_body_external(msg->m_body);
+            m_res_writer.write_body_packed("\n");
+        }
+        m_pinned = std::move(page.m_messages);
+        m_res_writer.begin_header(200);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Content-type", "text/plain");
+        m_res_writer.write_header("Connection", "keep-alive");
+        //客户端拿 X-Next-Since 接着翻页；since 比 X-First-Seq 还早说明中间有消息已经丢了
+        fmt::format_int first(first_seq), next(next_since);
+        m_res_writer.write_header("X-First-Seq", {first.data(), first.size()});
+        m_res_writer.write_header("X-Next-Since", {next.data(), next.size()});
+        fmt::format_int content_length(m_res_writer.body().size());
+        m_res_writer.write_header("Content-length", {content_length.data(), content_length.size()});
+        m_res_writer.end_header();
+        return do_write();
+    }
+    //?overflow=drop|coalesce|disconnect 选发送队列满了怎么办，默认断开，客户端重连时从历史里补
+    void do_event_stream(uint64_t room, std::string_view query) {
+        auto policy = output_queue::overflow_policy::disconnect;
+        std::string_view policy_name;
+        if (http_query_value(query, "overflow", policy_name) && !output_queue::parse_policy(policy_name, policy)) {
+            return do_respond(400, "text/plain");
+        }
+        auto &headers = m_req_parser.headers();
+        auto last_id = headers.find("last-event-id");
+        uint64_t last_event_id = 0;
+        bool resume = last_id != headers.end() && parse_uint64(last_id->second, last_event_id);
+        //续传要从历史里补，历史只在家节点上；不续传的实时订阅经节点之间的链路照样能收
+        if (resume && cluster_ring::instance().is_remote(room)) {
+            return do_misdirected(room);
+        }
+        //订阅就是进房间，也要先建好房间
+        if (!room_registry::open_room(room)) {
+            return do_respond(503, "text/plain");
+        }
+        m_res_writer.begin_header(200);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Content-type", "text/event-stream");
+        m_res_writer.write_header("Cache-Control", "no-cache");
+        m_res_writer.write_header("Connection", "keep-alive");
+        m_res_writer.begin_chunked();
+        m_res_writer.end_header();
+        m_handoff = [room, resume, last_event_id, policy] (async_file conn) {
+            event_stream_handler::make()->do_start(std::move(conn), room, resume, last_event_id, policy);
+        };
+        return do_write();
+    }
+    //家在别的节点的房间：历史、续传和搜索只有家节点上有，回 421 和家节点的下标、节点之间链路的地址
+    void do_misdirected(uint64_t room) {
+        auto &ring = cluster_ring::instance();
+        uint32_t home = ring.home(room);
+        char body[320];
+        auto end = fmt::format_to_n(body, sizeof(body), "room {} lives on node {} {}:{}\n", room, home, ring.m_nodes[home].m_host, ring.m_nodes[home].m_port);
+        m_res_writer.write_body(std::string_view{body, end.size});
+        return do_respond(421, "text/plain");
+    }
+    //路径有，方法不对：Allow 头里列出这个路径能用的方法
+    void do_method_not_allowed(std::string_view allow) {
+        m_res_writer.begin_header(405);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Content-type", "text/plain");
+        m_res_writer.write_header("Connection", "keep-alive");
+        m_res_writer.write_header("Allow", allow);
+        fmt::format_int content_length(m_res_writer.body().size());
+        m_res_writer.write_header("Content-length", {content_length.data(), content_length.size()});
+        m_res_writer.end_header();
+        return do_write();
+    }
+    //正文已经写好，补上头部发出去
+    void do_respond(int status, std::string_view content_type) {
+        m_res_writer.begin_header(status);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Content-type", content_type);
+        m_res_writer.write_header("Connection", "keep-alive");
+        fmt::format_int content_length(m_res_writer.body().size());
+        m_res_writer.write_header("Content-length", {content_length.data(), content_length.size()});
+        m_res_writer.end_header();
+        return do_write();
+    }
+    bool _is_websocket_upgrade() {
+        auto &headers = m_req_parser.headers();
+        auto upgrade = headers.find("upgrade");
+        auto connection = headers.find("connection");
+        auto version = headers.find("sec-websocket-version");
+        return m_req_parser.method() == "GET"
+            && upgrade != headers.end() && http_header_has_token(upgrade->second, "websocket")
+            && connection != headers.end() && http_header_has_token(connection->second, "upgrade")
+            && version != headers.end() && version->second == "13"
+            && headers.find("sec-websocket-key") != headers.end();
+    }
+    //?client=<名字> 给这个连接上的 sendid 去重用，也是在线状态里的名字
+    //?overflow=drop|coalesce|disconnect 选发送队列满了怎么办，默认丢最早的
+    void do_websocket_upgrade(std::string_view query) {
+        auto &headers = m_req_parser.headers();
+        auto policy = output_queue::overflow_policy::drop_oldest;
+        std::string_view policy_name;
+        if (http_query_value(query, "overflow", policy_name) && !output_queue::parse_policy(policy_name, policy)) {
+            return do_respond(400, "text/plain");
+        }
+        std::string accept = websocket_accept_key(headers.find("sec-websocket-key")->second);
+        std::string_view client_name;
+        uint64_t client = 0;
+        uint32_t user = 0;
+        if (http_query_value(query, "client", client_name)) {
+            client = publish_id::client_key(client_name);
+            user = presence::instance().intern_user(client_name);
+        }
+        m_handoff = [client, user, policy, peer = m_peer] (async_file conn) {
+            auto handler = websocket_connection_handler::make();
+            handler->m_client = client;
+            handler->m_user = user;
+            handler->m_peer = peer;
+            handler->m_queue.m_policy = policy;
+            handler->do_start(std::move(conn));
+        };
+        m_res_writer.begin_header(101);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Upgrade", "websocket");
+        m_res_writer.write_header("Connection", "Upgrade");
+        m_res_writer.write_header("Sec-WebSocket-Accept", accept);
+        m_res_writer.end_header();
+        return do_write();
+    }
+    //超出限制的请求直接拒绝，写完响应就关掉连接，剩下没读的数据不要了
+    void do_reject(int status) {
+        m_close_after_write = true;
+        m_res_writer.begin_header(status);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Connection", "close");
+        m_res_writer.write_header("Content-length", "0");
+        m_res_writer.end_header();
+        return do_write();
     }
-    void do_write(bytes_const_view buffer) {
-        return m_conn.async_write(buffer, [self = shared_from_this(), buffer] (size_t n) {
-            if (buffer.size() == n) {
+    void do_write(size_t written = 0) {
+        io_vectors bufs;
+        m_res_writer.to_iovecs(bufs, written);
+        return m_conn.async_writev(bufs, [self = ref_from_this(), written] (ssize_t n) {
+            if (n < 0) {
+                return;
+            }
+            if (written + n == self->m_res_writer.size()) {
+                if (self->m_close_after_write) {
+                    shutdown(self->m_conn.m_fd, SHUT_RDWR);
+                    return;
+                }
+                if (self->m_handoff.m_base) {
+                    //连接交给别的处理者，这个对象随后回到池子里
+                    auto handoff = std::move(self->m_handoff);
+                    return handoff(std::move(self->m_conn));
+                }
+                //请求和响应都用完了，整个 arena 一次回退，高水位以外的块还给线程内的池子
+                self->m_req_parser.reset_state();
                 self->m_res_writer.reset_state();
+                self->m_pinned.clear();
+                self->m_arena.release_idle();
                 return self->do_read();
             }
-            return self->do_write(buffer.subspan(n));
+            return self->do_write(written + n);
         });
     }
 };
 
-struct http_acceptor : std::enable_shared_from_this<http_acceptor> {
+//同一套接受连接的流程，Handler 决定新连接说什么协议
+template <class Handler = http_connection_handler>
+struct http_acceptor : std::enable_shared_from_this<http_acceptor<Handler>> {
     async_file m_listen;
     address_resolver::address m_addr;
     using pointer = std::shared_ptr<http_acceptor>;
     static pointer make() {
-        return std::make_shared<pointer::element_type>();
+        return std::make_shared<http_acceptor>();
     }
     void do_start(std::string name, std::string port) {
         address_resolver resolver;
@@ -852,39 +8108,180 @@ struct http_acceptor : std::enable_shared_from_this<http_acceptor> {
     }
 
     void do_accept() {
-        return m_listen.async_accept(m_addr, [self = shared_from_this()] (int connfd) {
+        return m_listen.async_accept(m_addr, [self = this->shared_from_this()] (int connfd) {
             fmt::println("接受了一个连接: {}", connfd);
-            http_connection_handler::make()->do_start(connfd);
+            auto handler = Handler::make();
+            handler->m_peer = rate_limiter::peer_key(self->m_addr);
+            handler->do_start(connfd);
             return self->do_accept();
         });
     }
 };
 
+//命令行选项：
+//  --http-port 8080 --binary-port 8081 --data chat-data
+//  --cluster 127.0.0.1:8081,127.0.0.1:9081,... --node 0   节点之间连二进制端口，列表在每个节点上一样，--node 是自己的下标
+//  --cluster-secret <密钥>   开集群时必须给，每个节点一样，节点之间的链路靠它认出来
+//  --rate-limit on|off   --flush-delay 0   发送前多攒多少毫秒再写，0 是每轮事件处理完就写
+//同一台机器上开几个进程当集群时，每个进程各用一套端口和数据目录
+struct server_options {
+    std::string m_http_port = "8080";
+    std::string m_binary_port = "8081";
+    std::string m_data_dir = "chat-data";
+    std::vector<cluster_ring::node> m_cluster;
+    uint32_t m_node = 0;
+    std::string m_cluster_secret;
 
-void server() {
+    static server_options &instance() {
+        static server_options options;
+        return options;
+    }
+
+    void parse(int argc, char **argv) {
+        for (int i = 1; i + 1 < argc; i += 2) {
+            std::string_view key = argv[i];
+            std::string_view value = argv[i + 1];
+            if (key == "--http-port") {
+                m_http_port = value;
+            } else if (key == "--binary-port") {
+                m_binary_port = value;
+            } else if (key == "--data") {
+                m_data_dir = value;
+            } else if (key == "--cluster") {
+                _parse_cluster(value);
+            } else if (key == "--cluster-secret") {
+                m_cluster_secret = value;
+            } else if (key == "--rate-limit") {
+                if (value != "on" && value != "off")
+                    throw std::invalid_argument("--rate-limit");
+                rate_limiter::instance().m_enabled = value == "on";
+            } else if (key == "--flush-delay") {
+                uint64_t ms;
+                if (!parse_uint64(value, ms) || ms > 1000)
+                    throw std::invalid_argument("--flush-delay");
+                write_batcher::flush_delay = std::chrono::milliseconds(ms);
+            } else if (key == "--node") {
+                uint64_t node;
+                if (!parse_uint64(value, node))
+                    throw std::invalid_argument("--node");
+                m_node = static_cast<uint32_t>(node);
+            } else {
+                throw std::invalid_argument(std::string(key));
+            }
+        }
+        if (!m_cluster.empty() && m_node >= m_cluster.size())
+            throw std::invalid_argument("--node");
+        //不带密钥的集群谁都能冒充节点连上来
+        if (m_cluster.size() > 1 && m_cluster_secret.empty())
+            throw std::invalid_argument("--cluster-secret");
+    }
+
+    void _parse_cluster(std::string_view list) {
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            auto item = list.substr(0, comma);
+            auto colon = item.rfind(':');
+            if (colon == std::string_view::npos)
+                throw std::invalid_argument("--cluster");
+            cluster_ring::node n;
+            n.m_host = item.substr(0, colon);
+            n.m_port = item.substr(colon + 1);
+            m_cluster.push_back(std::move(n));
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        }
+    }
+};
+
+//一个事件循环线程的主循环：先把启动时读出来的、归本线程的房间恢复进本线程的房间表，再开始监听
+void run_reactor(reactor &self, room_restore_list const &restored, std::chrono::steady_clock::time_point start) {
+    reactor::current() = &self;
     epollfd = epoll_create1(0);
-    auto acceptor = http_acceptor::make();
-    acceptor->do_start("127.0.0.1", "8080");
-    struct epoll_event events[10];
+    auto &registry = room_registry::instance();
+    restored.apply(registry);
+    registry.schedule_rebalance();
+    self.do_receive([] (shared_message const &msg) {
+        room_registry::instance().deliver(msg);
+    });
+    if (self.m_index == 0) {
+        room_snapshot::instance().schedule();
+        presence::instance().schedule();
+        read_receipts::instance().schedule();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        fmt::println("恢复房间状态用了 {} 毫秒，{} 个事件循环线程", elapsed.count(), reactor::all().size());
+    }
+    auto &options = server_options::instance();
+    auto acceptor = http_acceptor<>::make();
+    acceptor->do_start("127.0.0.1", options.m_http_port);
+    auto binary_acceptor = http_acceptor<binary_connection_handler>::make();
+    binary_acceptor->do_start("127.0.0.1", options.m_binary_port);
+    struct epoll_event events[64];
     while (true) {
-        int ret = epoll_wait(epollfd, events, 1, -1);
+        auto &timers = timer_queue::instance();
+        int timeout = timers.timeout_ms();
+        //有连接因为内存预算在等，就定时醒来看看能不能恢复
+        if (memory_stats::has_waiters() && (timeout < 0 || timeout > 10))
+            timeout = 10;
+        if (write_batcher::instance().has_due())
+            timeout = 0;
+        int ret = epoll_wait(epollfd, events, std::size(events), timeout);
         if (ret < 0)
             throw;
-        for (int i = 0; i < ret; ++i) {
-            auto cb = callback<>::from_address(events[i].data.ptr);
-            cb();
-        }
+        //一批事件都处理完再统一写，一轮里投给同一个连接的消息合成一次 writev
+        event_batch::instance().dispatch(events, ret);
+        timers.run_expired();
+        memory_stats::resume_waiters();
+        write_batcher::instance().run();
     }
     // fmt::println("所有任务都完毕了");
     close(epollfd);
 }
 
-int main(){
+void server() {
+    //对面关了连接再写会收到 SIGPIPE，改成让 write 返回 EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    auto start = std::chrono::steady_clock::now();
+    auto &options = server_options::instance();
+    if (!options.m_cluster.empty()) {
+        cluster_ring::instance().configure(options.m_cluster, options.m_node, options.m_cluster_secret);
+    }
+    static room_restore_list restored;
+    uint64_t from = room_snapshot::instance().load(options.m_data_dir + "/snapshot", restored);
+    auto &log = message_log::instance();
+    log.open(options.m_data_dir, from, [&] (uint64_t room, uint64_t seq, bytes_const_view body) {
+        restored.restore(room, seq, body);
+    });
+    search_index::instance().start();
+    auto &reactors = reactor::all();
+    //房间的订阅者集合是一个 64 位的位图
+    size_t count = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 64);
+    for (size_t i = 0; i < count; ++i) {
+        reactors.push_back(std::make_unique<reactor>(i));
+    }
+    //建房间要知道有几个线程，所以在这之后；线程都还没开始接连接
+    read_receipts::instance().load(options.m_data_dir + "/receipts");
+    //第一个事件循环线程就是主线程
+    for (size_t i = 1; i < count; ++i) {
+        std::thread([&self = *reactors[i], start] {
+            try {
+                run_reactor(self, restored, start);
+            } catch (std::system_error const &e) {
+                fmt::println("错误: {} ({}.{})", e.what(), e.code().category().name(), e.code().value());
+            }
+        }).detach();
+    }
+    run_reactor(*reactors[0], restored, start);
+}
+
+int main(int argc, char **argv){
     setlocale(LC_ALL, "zh_CN.UTF-8");
     try{
+        server_options::instance().parse(argc, argv);
         server();
     }catch (std::system_error const &e){
         fmt::println("错误: {} ({}.{})", e.what(), e.code().category().name(), e.code().value());
+    }catch (std::invalid_argument const &e){
+        fmt::println("选项不对: {}", e.what());
+        return 1;
     }
     return 0;
 }
\ No newline at end of file